@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+
+#include "arena.h"
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lib.h"
+
+struct ArenaChunk {
+        ArenaChunk *next;
+        size_t size;  // Of data.
+        alignas(max_align_t) char data[];
+};
+
+#define ALIGN(size) \
+        (((size) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+static ArenaChunk *alloc_chunk(size_t size) {
+        ArenaChunk *chunk = (ArenaChunk *)my_malloc(sizeof(ArenaChunk) + size);
+        chunk->size = size;
+        return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+        size = ALIGN(size ? size : 1);
+        if (size <= (size_t)(arena->end - arena->pos)) {
+                void *block = arena->pos;
+                arena->pos += size;
+                return block;
+        }
+
+        // Large block: its own chunk, behind the current one.
+        if (size > ARENA_MAX_CHUNK / 4 && arena->chunks) {
+                ArenaChunk *chunk = alloc_chunk(size);
+                chunk->next = arena->chunks->next;
+                arena->chunks->next = chunk;
+                return chunk->data;
+        }
+
+        size_t chunk_size = arena->chunks ? arena->chunks->size * 2
+                                          : ARENA_MIN_CHUNK;
+        if (chunk_size > ARENA_MAX_CHUNK) chunk_size = ARENA_MAX_CHUNK;
+        if (chunk_size < size) chunk_size = size;
+        ArenaChunk *chunk = alloc_chunk(chunk_size);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->pos = chunk->data + size;
+        arena->end = chunk->data + chunk_size;
+        return chunk->data;
+}
+
+void *arena_calloc(Arena *arena, size_t size) {
+        void *block = arena_alloc(arena, size);
+        memset(block, 0, size);
+        return block;
+}
+
+static void free_chunks(ArenaChunk *chunk) {
+        while (chunk) {
+                ArenaChunk *next = chunk->next;
+                free(chunk);
+                chunk = next;
+        }
+}
+
+void arena_reset(Arena *arena) {
+        ArenaChunk *current = arena->chunks;
+        // A large block may have been the first one.
+        if (!current || current->size > ARENA_MAX_CHUNK) {
+                arena_free(arena);
+                return;
+        }
+        free_chunks(current->next);
+        current->next = NULL;
+        arena->pos = current->data;
+        arena->end = current->data + current->size;
+}
+
+void arena_free(Arena *arena) {
+        free_chunks(arena->chunks);
+        memset(arena, 0, sizeof(Arena));
+}
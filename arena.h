@@ -0,0 +1,30 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Bump-pointer allocator. Blocks are not freed one by one: all the blocks of
+ * an arena are released at once. Chunks start at ARENA_MIN_CHUNK bytes and
+ * double up to ARENA_MAX_CHUNK, larger blocks get a chunk of their own. An
+ * arena is not thread-safe, its users must serialize calls. A zeroed Arena is
+ * empty. */
+
+#define ARENA_MIN_CHUNK 1024
+#define ARENA_MAX_CHUNK (1 << 16)
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+        ArenaChunk *chunks;  // Current chunk first, NULL if none.
+        char *pos;           // Next free byte of the current chunk.
+        char *end;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_calloc(Arena *arena, size_t size);
+// Release all blocks. The current chunk is kept for the next ones.
+void arena_reset(Arena *arena);
+// Release all blocks and chunks.
+void arena_free(Arena *arena);
+
+#endif
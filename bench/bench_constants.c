@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+
+/* Looks up every constant of the maps of constants.h, as the JSON writers do
+ * for errnos, ioctl requests, socket options, ... It compares the linear
+ * search and copy to the heap that used to back these lookups with the hash
+ * table of constants.c. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "constants.h"
+
+#define ROUNDS 2000
+
+typedef const char *(*LookupFn)(int cons, char *buf);
+
+typedef struct {
+        const char *name;
+        const IntStrPair *pairs;
+        int size;
+        LookupFn lookup;
+} BenchMap;
+
+static const char *sol_socket_option_str(int optname, char *buf) {
+        return sockoptname_str(SOL_SOCKET, optname, buf);
+}
+
+static const char *ipproto_ip_option_str(int optname, char *buf) {
+        return sockoptname_str(IPPROTO_IP, optname, buf);
+}
+
+static const char *ipproto_ipv6_option_str(int optname, char *buf) {
+        return sockoptname_str(IPPROTO_IPV6, optname, buf);
+}
+
+static const char *ipproto_tcp_option_str(int optname, char *buf) {
+        return sockoptname_str(IPPROTO_TCP, optname, buf);
+}
+
+#define BENCH_MAP(NAME, FN) \
+        { #NAME, NAME, sizeof(NAME) / sizeof(IntStrPair), FN }
+
+static const BenchMap maps[] = {
+    BENCH_MAP(ERRNOS, errno_str),
+    BENCH_MAP(IOCTL_REQUESTS, ioctl_request_str),
+    BENCH_MAP(FCNTL_CMDS, fcntl_cmd_str),
+    BENCH_MAP(SOL_SOCKET_OPTIONS, sol_socket_option_str),
+    BENCH_MAP(IPPROTO_IP_OPTIONS, ipproto_ip_option_str),
+    BENCH_MAP(IPPROTO_IPV6_OPTIONS, ipproto_ipv6_option_str),
+    BENCH_MAP(IPPROTO_TCP_OPTIONS, ipproto_tcp_option_str)};
+
+static volatile size_t sink;
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The previous implementation: linear search, then a copy for the caller.
+static char *alloc_linear_str(const BenchMap *map, int cons) {
+        const char *str = NULL;
+        for (int i = 0; i < map->size; i++) {
+                if (map->pairs[i].cons == cons) {
+                        str = map->pairs[i].str;
+                        break;
+                }
+        }
+        char *copy = malloc(CONS_STR_SIZE);
+        strncpy(copy, str, CONS_STR_SIZE);
+        return copy;
+}
+
+// Returns the mean time of a lookup, in nanoseconds.
+static double bench_linear(const BenchMap *map) {
+        double start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+                for (int i = 0; i < map->size; i++) {
+                        char *str = alloc_linear_str(map, map->pairs[i].cons);
+                        sink += str[0];
+                        free(str);
+                }
+        }
+        return (now() - start) / ROUNDS / map->size * 1e9;
+}
+
+static double bench_table(const BenchMap *map) {
+        char buf[CONS_STR_SIZE];
+        double start = now();
+        for (int r = 0; r < ROUNDS; r++)
+                for (int i = 0; i < map->size; i++)
+                        sink += map->lookup(map->pairs[i].cons, buf)[0];
+        return (now() - start) / ROUNDS / map->size * 1e9;
+}
+
+int main(void) {
+        printf("%-22s %6s %14s %14s\n", "map", "consts", "linear+malloc",
+               "hash table");
+        for (size_t m = 0; m < sizeof(maps) / sizeof(BenchMap); m++) {
+                const BenchMap *map = &maps[m];
+                printf("%-22s %6d %11.1f ns %11.1f ns\n", map->name,
+                       map->size, bench_linear(map), bench_table(map));
+        }
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+
+/* Compares the Jansson based JSON builder with the streaming JSON writer over
+ * a synthetic mix of events. Both must produce the same bytes: the benchmark
+ * fails if they do not. */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include "json_builder.h"
+#include "json_writer.h"
+#include "latency.h"
+
+#define ITERATIONS 20000
+
+static AnySockEvent events[32];
+static int events_count = 0;
+
+static AnySockEvent *new_event(SockEventType type, int return_value) {
+        AnySockEvent *ev = &events[events_count++];
+        memset(ev, 0, sizeof(AnySockEvent));
+        ev->super.type = type;
+        ev->super.timestamp_ns = 1500000000000000000ULL + events_count * 1001;
+        ev->super.return_value = return_value;
+        ev->super.success = (return_value != -1);
+        ev->super.err = ev->super.success ? 0 : ECONNREFUSED;
+        ev->super.thread_id = 4242;
+        return ev;
+}
+
+static void fill_sock_info(SockInfo *si) {
+        si->domain = AF_INET;
+        si->type = SOCK_STREAM;
+        si->protocol = 0;
+        si->sock_nonblock = true;
+        si->filled = true;
+}
+
+static void fill_addr(Addr *addr) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&addr->sockaddr_sto;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(443);
+        inet_pton(AF_INET, "192.0.2.17", &sin->sin_addr);
+        addr->len = sizeof(struct sockaddr_in);
+}
+
+static size_t sizes[] = {1448, 1448, 512};
+static struct timeval tv = {5, 250000};
+static char mode[] = "r+\t\"\x01";
+static SockSummary summary;
+static Histogram send_latency;
+static Histogram poll_latency;
+static Histogram *latency[LAT_CALLS];
+static TcpInfo tcp_info;
+
+static void build_events(void) {
+        AnySockEvent *ev;
+
+        ev = new_event(SOCK_EV_SOCKET, 3);
+        fill_sock_info(&ev->socket.sock_info);
+
+        ev = new_event(SOCK_EV_CONNECT, -1);
+        fill_addr(&ev->connect.addr);
+
+        ev = new_event(SOCK_EV_SETSOCKOPT, 0);
+        ev->setsockopt.sockopt.level = SOL_SOCKET;
+        ev->setsockopt.sockopt.optname = SO_RCVTIMEO;
+        ev->setsockopt.sockopt.optlen = sizeof(tv);
+        memcpy(ev->setsockopt.sockopt.optval.inline_val, &tv, sizeof(tv));
+
+        ev = new_event(SOCK_EV_SEND, 1448);
+        ev->send.bytes = 1448;
+        ev->send.flags = MSG_NOSIGNAL;
+
+        ev = new_event(SOCK_EV_RECV, 16384);
+        ev->recv.bytes = 16384;
+        ev->recv.flags = MSG_DONTWAIT;
+
+        ev = new_event(SOCK_EV_SENDTO, 512);
+        ev->sendto.bytes = 512;
+        fill_addr(&ev->sendto.addr);
+
+        ev = new_event(SOCK_EV_RECVMSG, 3408);
+        ev->recvmsg.bytes = 3408;
+        ev->recvmsg.msghdr.iovec.iovec_count = 3;
+        memcpy(ev->recvmsg.msghdr.iovec.sizes.inline_sizes, sizes,
+               sizeof(sizes));
+        ev->recvmsg.msghdr.flags = MSG_TRUNC;
+
+        ev = new_event(SOCK_EV_WRITEV, 3408);
+        ev->writev.bytes = 3408;
+        ev->writev.iovec.iovec_count = 3;
+        memcpy(ev->writev.iovec.sizes.inline_sizes, sizes, sizeof(sizes));
+
+        ev = new_event(SOCK_EV_WRITE, 4096);
+        ev->write.bytes = 4096;
+
+        ev = new_event(SOCK_EV_READ, 4096);
+        ev->read.bytes = 4096;
+
+        ev = new_event(SOCK_EV_POLL, 1);
+        ev->poll.timeout.seconds = 1;
+        ev->poll.requested_events.pollin = true;
+        ev->poll.returned_events.pollin = true;
+
+        ev = new_event(SOCK_EV_EPOLL_WAIT, 1);
+        ev->epoll_wait.timeout = -1;
+        ev->epoll_wait.returned_events = EPOLLIN | EPOLLET;
+
+        ev = new_event(SOCK_EV_FCNTL, 2);
+        ev->fcntl.cmd = F_GETFL;
+
+        ev = new_event(SOCK_EV_FDOPEN, 0);
+        ev->fdopen.mode = mode;
+
+        ev = new_event(SOCK_EV_COALESCED, 16384);
+        ev->coalesced.ev_type = SOCK_EV_RECV;
+        ev->coalesced.count = 250;
+        ev->coalesced.bytes = 4096000;
+        ev->coalesced.min_bytes = 16384;
+        ev->coalesced.max_bytes = 16384;
+        ev->coalesced.last_timestamp_ns = 1500000000123456789;
+
+        ev = new_event(SOCK_EV_SKIPPED, 0);
+        ev->skipped.events = 42;
+        ev->skipped.bytes_sent = 60816;
+        ev->skipped.bytes_received = 172032;
+
+        ev = new_event(SOCK_EV_SUMMARY, 0);
+        fill_sock_info(&ev->summary.sock_info);
+        ev->summary.bytes_sent = 60816;
+        ev->summary.bytes_received = 4268032;
+        ev->summary.summary = &summary;
+        summary.calls[SOCK_EV_CONNECT] = 1;
+        summary.calls[SOCK_EV_SEND] = 42;
+        summary.calls[SOCK_EV_RECV] = 261;
+        summary.errors[0].err = EAGAIN;
+        summary.errors[0].count = 11;
+        summary.other_errors = 2;
+        fill_addr(&summary.peer);
+        summary.start_ns = 1500000000000000000ULL;
+        summary.first_byte_ns = 1500000000023456789ULL;
+        summary.tcp_info_len = sizeof(TcpInfo);
+        summary.tcp_info.tcpi_state = 1;
+        summary.tcp_info.tcpi_rtt = 23456;
+        summary.tcp_limited_by = TCP_LIMIT_CWND;
+
+        ev = new_event(SOCK_EV_LATENCY, 0);
+        for (uint64_t ns = 900; ns < 5000000; ns = ns * 3 / 2)
+                hist_record(&send_latency, ns);
+        hist_record(&poll_latency, 250000);
+        hist_record(&poll_latency, 3);
+        latency[SOCK_EV_SEND] = &send_latency;
+        latency[SOCK_EV_POLL] = &poll_latency;
+        ev->latency.histograms = latency;
+
+        ev = new_event(SOCK_EV_TCP_INFO, 0);
+        tcp_info.tcpi_state = 1;
+        tcp_info.tcpi_rtt = 23456;
+        tcp_info.tcpi_snd_cwnd = 10;
+        tcp_info.tcpi_pacing_rate = UINT64_MAX;
+        tcp_info.tcpi_delivery_rate = 1250000;
+        tcp_info.tcpi_busy_time = 80000;
+        ev->tcp_info.len = sizeof(TcpInfo);
+        ev->tcp_info.limited_by = TCP_LIMIT_RWND;
+        ev->tcp_info.changed = TCP_INFO_ALL_WORDS;  // A decoded sample.
+        ev->tcp_info.words = (uint32_t *)&tcp_info;
+
+        new_event(SOCK_EV_CLOSE, 0);
+}
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_builder(void) {
+        double start = now();
+        for (int i = 0; i < ITERATIONS; i++) {
+                for (int j = 0; j < events_count; j++) {
+                        char *str = alloc_sock_ev_json(&events[j].super);
+                        free(str);
+                }
+        }
+        return now() - start;
+}
+
+static double bench_writer(void) {
+        double start = now();
+        size_t total = 0;
+        for (int i = 0; i < ITERATIONS; i++) {
+                for (int j = 0; j < events_count; j++) {
+                        size_t len;
+                        sock_ev_json(&events[j].super, NULL, &len);
+                        total += len;
+                }
+        }
+        if (!total) abort();
+        return now() - start;
+}
+
+int main(void) {
+        build_events();
+
+        for (int i = 0; i < events_count; i++) {
+                char *expected = alloc_sock_ev_json(&events[i].super);
+                const char *actual =
+                    sock_ev_json(&events[i].super, NULL, NULL);
+                if (strcmp(expected, actual)) {
+                        fprintf(stderr, "Output mismatch:\n%s\n%s\n", expected,
+                                actual);
+                        return EXIT_FAILURE;
+                }
+                free(expected);
+        }
+
+        double n = (double)ITERATIONS * events_count;
+        double builder = bench_builder();
+        double writer = bench_writer();
+        printf("json_builder: %12.0f events/s\n", n / builder);
+        printf("json_writer:  %12.0f events/s\n", n / writer);
+        printf("speedup:      %12.1fx\n", builder / writer);
+        return EXIT_SUCCESS;
+}
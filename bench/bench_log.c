@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+
+/* Measures the cost of the INFO message logged for each event, at the default
+ * log levels (WARN and above): formatted then discarded by logger(), as LOG()
+ * used to do, skipped by LOG() at run time, and compiled out with LOG_LVL. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "logger.h"
+
+#define ITERATIONS 2000000
+
+static volatile int fd = 7;
+static volatile int con_id = 42;
+static const char *ev_name = "send";
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static __attribute__((noinline)) void log_formatted(void) {
+        char buf[1024];
+        snprintf(buf, sizeof(buf), "%s on connection %d (fd %d).", ev_name,
+                 con_id, fd);
+        logger(INFO, buf, __FILE__, __LINE__);
+}
+
+static __attribute__((noinline)) void log_checked(void) {
+        LOG(INFO, "%s on connection %d (fd %d).", ev_name, con_id, fd);
+}
+
+#undef LOG_MAX_LVL
+#define LOG_MAX_LVL WARN
+
+static __attribute__((noinline)) void log_compiled_out(void) {
+        LOG(INFO, "%s on connection %d (fd %d).", ev_name, con_id, fd);
+}
+
+// Returns the mean time of a call, in nanoseconds.
+static double bench(void (*log_fn)(void)) {
+        double start = now();
+        for (int i = 0; i < ITERATIONS; i++) log_fn();
+        return (now() - start) / ITERATIONS * 1e9;
+}
+
+int main(void) {
+        bench(log_formatted);  // Warm up.
+        printf("formatted then discarded: %6.1f ns/event\n",
+               bench(log_formatted));
+        printf("level checked first:      %6.1f ns/event\n",
+               bench(log_checked));
+        printf("compiled out:             %6.1f ns/event\n",
+               bench(log_compiled_out));
+        return EXIT_SUCCESS;
+}
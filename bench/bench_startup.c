@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+
+/* Measures the process launch time of a trivial command, with and without
+ * the library preloaded. The library resolves the libc symbols it overrides
+ * when it is loaded: this must not noticeably slow down process launch.
+ *
+ * The library is taken from $BENCH_LIB. The benchmark is skipped if it has
+ * not been built. */
+
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ITERATIONS 500
+#define COMMAND "/bin/true"
+
+extern char **environ;
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char **alloc_env(const char *preload) {
+        int n = 0;
+        while (environ[n]) n++;
+        char **env = calloc(n + 2, sizeof(char *));
+        if (!env) return NULL;
+        int j = 0;
+        for (int i = 0; i < n; i++)
+                if (strncmp(environ[i], "LD_PRELOAD=", 11)) env[j++] = environ[i];
+        if (preload) env[j++] = (char *)preload;
+        return env;
+}
+
+// Returns the mean launch time in microseconds, or a negative value on error.
+static double bench_launch(char **env) {
+        char cmd[] = COMMAND;
+        char *argv[] = {cmd, NULL};
+        double start = now();
+        for (int i = 0; i < ITERATIONS; i++) {
+                pid_t pid;
+                int status;
+                if (posix_spawn(&pid, COMMAND, NULL, NULL, argv, env)) return -1;
+                if (waitpid(pid, &status, 0) != pid) return -1;
+                if (!WIFEXITED(status) || WEXITSTATUS(status)) return -1;
+        }
+        return (now() - start) / ITERATIONS * 1e6;
+}
+
+int main(void) {
+        const char *lib = getenv("BENCH_LIB");
+        if (!lib || access(lib, R_OK)) {
+                printf("Skipped: library not built (BENCH_LIB=%s).\n",
+                       lib ? lib : "");
+                return EXIT_SUCCESS;
+        }
+        char *preload = malloc(strlen("LD_PRELOAD=") + strlen(lib) + 1);
+        if (!preload) return EXIT_FAILURE;
+        sprintf(preload, "LD_PRELOAD=%s", lib);
+
+        char **plain_env = alloc_env(NULL);
+        char **preload_env = alloc_env(preload);
+        if (!plain_env || !preload_env) return EXIT_FAILURE;
+
+        bench_launch(preload_env);  // Warm up the page cache.
+        double plain = bench_launch(plain_env);
+        double preloaded = bench_launch(preload_env);
+        if (plain < 0 || preloaded < 0) {
+                fprintf(stderr, "Failed to run %s.\n", COMMAND);
+                return EXIT_FAILURE;
+        }
+
+        printf("launch:                %8.0f us\n", plain);
+        printf("launch with tcpsnitch: %8.0f us\n", preloaded);
+        printf("overhead:              %8.0f us\n", preloaded - plain);
+        free(plain_env);
+        free(preload_env);
+        free(preload);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include "binary_format.h"
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+#include "lib.h"
+#include "logger.h"
+
+/* Payloads are the buffers referenced by pointers in the event structs. The
+ * same walker is used to size, write and read them, so that the writer and
+ * the reader always agree on their order. */
+
+typedef bool (*BlobFn)(void *ctx, void **field, size_t len);
+
+// Length of a NUL terminated string payload. Its actual length can only be
+// computed when writing, since the pointer is stale when reading.
+#define STRING_BLOB SIZE_MAX
+
+static size_t blob_len(void **field, size_t len) {
+        if (!*field) return 0;
+        return (len == STRING_BLOB) ? strlen((char *)*field) + 1 : len;
+}
+
+// Members stored inline are part of the event struct, only spilled ones are
+// payloads.
+
+static bool walk_sockopt(Sockopt *s, BlobFn fn, void *ctx) {
+        if (!is_sockopt_spilled(s)) return true;
+        return fn(ctx, &s->optval.spilled, s->optlen);
+}
+
+static bool walk_iovec(Iovec *iov, BlobFn fn, void *ctx) {
+        if (!is_iovec_spilled(iov)) return true;
+        return fn(ctx, (void **)&iov->sizes.spilled,
+                  sizeof(size_t) * iov->iovec_count);
+}
+
+static bool walk_msghdr(Msghdr *m, BlobFn fn, void *ctx) {
+        if (!walk_iovec(&m->iovec, fn, ctx)) return false;
+        if (!is_control_spilled(m)) return true;
+        return fn(ctx, &m->control.spilled, m->control_len);
+}
+
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+static bool walk_mmsghdr_vec(Mmsghdr **vec, int count, BlobFn fn, void *ctx) {
+        if (count < 0) count = 0;
+        if (!fn(ctx, (void **)vec, sizeof(Mmsghdr) * count)) return false;
+        for (int i = 0; *vec && i < count; i++)
+                if (!walk_msghdr(&(*vec)[i].msghdr, fn, ctx)) return false;
+        return true;
+}
+#endif
+
+static bool walk_histograms(Histogram ***histograms, BlobFn fn, void *ctx) {
+        size_t len = sizeof(Histogram *) * LAT_CALLS;
+        if (!fn(ctx, (void **)histograms, len)) return false;
+        for (int i = 0; *histograms && i < LAT_CALLS; i++)
+                if (!fn(ctx, (void **)&(*histograms)[i], sizeof(Histogram)))
+                        return false;
+        return true;
+}
+
+static bool walk_payloads(SockEvent *ev, BlobFn fn, void *ctx) {
+        AnySockEvent *any = (AnySockEvent *)ev;
+        switch (ev->type) {
+                case SOCK_EV_GETSOCKOPT:
+                        return walk_sockopt(&any->getsockopt.sockopt, fn, ctx);
+                case SOCK_EV_SETSOCKOPT:
+                        return walk_sockopt(&any->setsockopt.sockopt, fn, ctx);
+                case SOCK_EV_SENDMSG:
+                        return walk_msghdr(&any->sendmsg.msghdr, fn, ctx);
+                case SOCK_EV_RECVMSG:
+                        return walk_msghdr(&any->recvmsg.msghdr, fn, ctx);
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+                case SOCK_EV_SENDMMSG:
+                        return walk_mmsghdr_vec(&any->sendmmsg.mmsghdr_vec,
+                                                any->sendmmsg.mmsghdr_count,
+                                                fn, ctx);
+                case SOCK_EV_RECVMMSG:
+                        return walk_mmsghdr_vec(&any->recvmmsg.mmsghdr_vec,
+                                                any->recvmmsg.mmsghdr_count,
+                                                fn, ctx);
+#endif
+                case SOCK_EV_WRITEV:
+                        return walk_iovec(&any->writev.iovec, fn, ctx);
+                case SOCK_EV_READV:
+                        return walk_iovec(&any->readv.iovec, fn, ctx);
+                case SOCK_EV_FDOPEN:
+                        return fn(ctx, (void **)&any->fdopen.mode,
+                                  STRING_BLOB);
+                case SOCK_EV_SUMMARY:
+                        return fn(ctx, (void **)&any->summary.summary,
+                                  sizeof(SockSummary));
+                case SOCK_EV_LATENCY:
+                        return walk_histograms(&any->latency.histograms, fn,
+                                               ctx);
+                case SOCK_EV_TCP_INFO: {
+                        size_t n = __builtin_popcountll(any->tcp_info.changed);
+                        return fn(ctx, (void **)&any->tcp_info.words,
+                                  sizeof(uint32_t) * n);
+                }
+                default:
+                        return true;
+        }
+}
+
+/* Writer */
+
+static bool count_blob(void *ctx, void **field, size_t len) {
+        *(size_t *)ctx += sizeof(uint32_t) + blob_len(field, len);
+        return true;
+}
+
+static bool write_blob(void *ctx, void **field, size_t len) {
+        TraceFile *file = (TraceFile *)ctx;
+        len = blob_len(field, len);
+        uint32_t n = *field ? len : BIN_NULL_BLOB;
+        tw_append(file, &n, sizeof(n));
+        if (*field) tw_append(file, *field, len);
+        return true;
+}
+
+#define WRITE(ptr, size) tw_append(file, ptr, size)
+
+void write_bin_header(TraceFile *file) {
+        uint16_t version = BIN_TRACE_VERSION;
+        uint16_t bom = BIN_BYTE_ORDER_MARK;
+        uint8_t ptr_size = sizeof(void *);
+        uint8_t long_size = sizeof(long);
+        const TsAnchor *anchor = ts_get_anchor();
+        uint8_t clock = anchor->clock;
+        uint16_t count = SOCK_EV_TCP_INFO + 1;
+
+        WRITE(BIN_TRACE_MAGIC, BIN_TRACE_MAGIC_LEN);
+        WRITE(&version, sizeof(version));
+        WRITE(&bom, sizeof(bom));
+        WRITE(&ptr_size, sizeof(ptr_size));
+        WRITE(&long_size, sizeof(long_size));
+        WRITE(&clock, sizeof(clock));
+        WRITE(&anchor->wall_ns, sizeof(anchor->wall_ns));
+        WRITE(&anchor->mono_ns, sizeof(anchor->mono_ns));
+        WRITE(&count, sizeof(count));
+        for (int i = 0; i < count; i++) {
+                uint16_t size = sizeof_sock_ev(i);
+                const char *name = string_from_sock_event_type(i);
+                uint8_t name_len = strlen(name);
+                WRITE(&size, sizeof(size));
+                WRITE(&name_len, sizeof(name_len));
+                WRITE(name, name_len);
+        }
+}
+
+void write_sock_ev_bin(SockEvent *ev, TraceFile *file) {
+        uint16_t type = ev->type;
+        size_t size = sizeof_sock_ev(ev->type);
+        size_t payloads_size = 0;
+        walk_payloads(ev, count_blob, &payloads_size);
+        uint32_t len = sizeof(type) + size + payloads_size;
+
+        WRITE(&len, sizeof(len));
+        WRITE(&type, sizeof(type));
+        WRITE(ev, size);
+        walk_payloads(ev, write_blob, file);
+}
+
+/* Reader */
+
+typedef struct {
+        BinTraceReader *reader;
+        const char *pos;
+        const char *end;
+} Cursor;
+
+static bool take(Cursor *c, void *dst, size_t n) {
+        if ((size_t)(c->end - c->pos) < n) return false;
+        memcpy(dst, c->pos, n);
+        c->pos += n;
+        return true;
+}
+
+static bool read_blob(void *ctx, void **field, size_t len) {
+        Cursor *c = (Cursor *)ctx;
+        uint32_t n;
+        if (!take(c, &n, sizeof(n))) return false;
+        if (n == BIN_NULL_BLOB) {
+                *field = NULL;
+                return true;
+        }
+        if (len == STRING_BLOB ? !n : n != len) return false;
+
+        BinTraceReader *r = c->reader;
+        void *blob = my_malloc(n ? n : 1);
+        if (!take(c, blob, n)) {
+                free(blob);
+                return false;
+        }
+        if (len == STRING_BLOB) ((char *)blob)[n - 1] = '\0';
+        r->blobs = (void **)realloc(r->blobs,
+                                    sizeof(void *) * (r->blobs_count + 1));
+        if (!r->blobs) abort();
+        r->blobs[r->blobs_count++] = blob;
+        *field = blob;
+        return true;
+}
+
+static void free_blobs(BinTraceReader *reader) {
+        for (int i = 0; i < reader->blobs_count; i++) free(reader->blobs[i]);
+        reader->blobs_count = 0;
+}
+
+static int local_type_from_name(const char *name) {
+        for (int i = 0; i <= SOCK_EV_TCP_INFO; i++)
+                if (!strcmp(name, string_from_sock_event_type(i))) return i;
+        return -1;
+}
+
+#define READ(ptr, size) \
+        if (fread(ptr, size, 1, reader->fp) != 1) goto error1;
+
+bool bin_trace_open(BinTraceReader *reader, FILE *fp) {
+        memset(reader, 0, sizeof(BinTraceReader));
+        reader->fp = fp;
+
+        char magic[BIN_TRACE_MAGIC_LEN];
+        uint16_t version, bom, count;
+        uint8_t ptr_size, long_size, clock;
+        READ(magic, BIN_TRACE_MAGIC_LEN);
+        if (memcmp(magic, BIN_TRACE_MAGIC, BIN_TRACE_MAGIC_LEN)) goto error2;
+        READ(&version, sizeof(version));
+        if (version != BIN_TRACE_VERSION) goto error3;
+        READ(&bom, sizeof(bom));
+        READ(&ptr_size, sizeof(ptr_size));
+        READ(&long_size, sizeof(long_size));
+        if (bom != BIN_BYTE_ORDER_MARK || ptr_size != sizeof(void *) ||
+            long_size != sizeof(long))
+                goto error4;
+        READ(&clock, sizeof(clock));
+        reader->anchor.clock = clock;
+        READ(&reader->anchor.wall_ns, sizeof(reader->anchor.wall_ns));
+        READ(&reader->anchor.mono_ns, sizeof(reader->anchor.mono_ns));
+
+        READ(&count, sizeof(count));
+        reader->type_count = count;
+        reader->local_types = (int *)my_malloc(sizeof(int) * count);
+        reader->sizes = (size_t *)my_malloc(sizeof(size_t) * count);
+        for (int i = 0; i < count; i++) {
+                uint16_t size;
+                uint8_t name_len;
+                char name[256];
+                READ(&size, sizeof(size));
+                READ(&name_len, sizeof(name_len));
+                READ(name, name_len);
+                name[name_len] = '\0';
+
+                int local = local_type_from_name(name);
+                if (local != -1 && sizeof_sock_ev(local) != size) {
+                        LOG(WARN, "Layout mismatch for %s, skipping.", name);
+                        local = -1;
+                } else if (local == -1) {
+                        LOG(WARN, "Unknown event type %s, skipping.", name);
+                }
+                reader->local_types[i] = local;
+                reader->sizes[i] = size;
+        }
+        return true;
+error1:
+        LOG(ERROR, "Truncated trace header.");
+        goto error_out;
+error2:
+        LOG(ERROR, "Not a tcpsnitch binary trace.");
+        goto error_out;
+error3:
+        LOG(ERROR, "Unsupported trace version %d.", version);
+        goto error_out;
+error4:
+        LOG(ERROR, "Trace recorded on an incompatible architecture.");
+error_out:
+        reader->error = true;
+        LOG_FUNC_ERROR;
+        return false;
+}
+
+SockEvent *bin_trace_next(BinTraceReader *reader) {
+        free_blobs(reader);
+        while (true) {
+                uint32_t len;
+                if (fread(&len, sizeof(len), 1, reader->fp) != 1) {
+                        if (ferror(reader->fp)) goto error1;
+                        return NULL;  // End of trace.
+                }
+
+                char *record = (char *)my_malloc(len ? len : 1);
+                if (fread(record, len, 1, reader->fp) != 1) {
+                        free(record);
+                        goto error1;
+                }
+
+                Cursor c = {reader, record, record + len};
+                uint16_t type;
+                int local = -1;
+                if (take(&c, &type, sizeof(type)) && type < reader->type_count)
+                        local = reader->local_types[type];
+                if (local == -1) {  // Unknown type, skip record.
+                        free(record);
+                        continue;
+                }
+
+                memset(&reader->ev, 0, sizeof(AnySockEvent));
+                bool ok = take(&c, &reader->ev, reader->sizes[type]);
+                reader->ev.super.type = local;
+                ok = ok && walk_payloads(&reader->ev.super, read_blob, &c);
+                free(record);
+                if (!ok) goto error2;
+                return &reader->ev.super;
+        }
+error1:
+        LOG(ERROR, "Truncated trace.");
+        goto error_out;
+error2:
+        LOG(ERROR, "Corrupted record.");
+error_out:
+        reader->error = true;
+        LOG_FUNC_ERROR;
+        return NULL;
+}
+
+void bin_trace_close(BinTraceReader *reader) {
+        free_blobs(reader);
+        free(reader->blobs);
+        free(reader->local_types);
+        free(reader->sizes);
+}
@@ -0,0 +1,55 @@
+#ifndef BINARY_FORMAT_H
+#define BINARY_FORMAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "sock_events.h"
+#include "timestamps.h"
+#include "trace_writer.h"
+
+/* Compact binary trace format, an alternative to JSON selected with
+ * TCPSNITCH_OPT_R. Events are written as raw SockEvent structs, so a trace
+ * can only be read by a build for the same architecture. The header records
+ * what is needed to verify that.
+ *
+ * File layout (host byte order):
+ *   header: magic (8 bytes), u16 version, u16 byte order mark,
+ *           u8 sizeof(void *), u8 sizeof(long), u8 clock (TsClock),
+ *           u64 anchor wall clock ns, u64 anchor monotonic ns,
+ *           u16 type count,
+ *           then per type: u16 struct size, u8 name length, name.
+ *   record: u32 length (of what follows), u16 type, struct,
+ *           then payloads: u32 length (BIN_NULL_BLOB for NULL), bytes.
+ *
+ * Types are identified by name in the header so that a converter still
+ * reads old traces after SockEventType values are reordered. */
+
+#define BIN_TRACE_MAGIC "TCPSNTCH"
+#define BIN_TRACE_MAGIC_LEN 8
+#define BIN_TRACE_VERSION 5
+#define BIN_BYTE_ORDER_MARK 0x0102
+#define BIN_NULL_BLOB UINT32_MAX
+
+void write_bin_header(TraceFile *file);
+void write_sock_ev_bin(SockEvent *ev, TraceFile *file);
+
+typedef struct {
+        FILE *fp;
+        TsAnchor anchor;  // Timestamps anchor of the traced process.
+        int type_count;
+        int *local_types;  // Trace type -> SockEventType, -1 if unknown.
+        size_t *sizes;     // Trace type -> struct size.
+        AnySockEvent ev;   // Last event read.
+        void **blobs;      // Payloads of the last event.
+        int blobs_count;
+        bool error;
+} BinTraceReader;
+
+bool bin_trace_open(BinTraceReader *reader, FILE *fp);
+// Returns NULL at end of trace or on error (reader->error is then set). The
+// event remains valid until the next call.
+SockEvent *bin_trace_next(BinTraceReader *reader);
+void bin_trace_close(BinTraceReader *reader);
+
+#endif
@@ -1,70 +1,154 @@
 #include "constants.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <string.h>
 #include "logger.h"
 
-bool alloc_string_from_cons(int cons, const IntStrPair *map, int map_size,
-                            char **str_ptr) {
-        static const int str_size = MEMBER_SIZE(IntStrPair, str);
-        *str_ptr = (char *)my_malloc(str_size);
-
-        // Search for const in map.
-        const IntStrPair *cur;
-        for (int i = 0; i < map_size; i++) {
-                cur = (map + i);
-                if (cur->cons == cons) {
-                        strncpy(*str_ptr, cur->str, str_size);
-                        return true;
+/* The maps are indexed by a single open addressing hash table, filled once
+ * when the library is loaded: a lookup is a hash and a couple of compares.
+ * The maps may have aliases (EAGAIN & EWOULDBLOCK, ...), the first constant
+ * of a map wins as it used to with a linear search. */
+
+#define PAIRS(NAME) (sizeof(NAME) / sizeof(IntStrPair))
+
+typedef struct {
+        const IntStrPair *pairs;
+        int size;
+} ConsMap;
+
+#define MAP(NAME) \
+        { NAME, PAIRS(NAME) }
+
+static const ConsMap errnos = MAP(ERRNOS);
+static const ConsMap fcntl_cmds = MAP(FCNTL_CMDS);
+static const ConsMap ioctl_requests = MAP(IOCTL_REQUESTS);
+static const ConsMap ipproto_ip_options = MAP(IPPROTO_IP_OPTIONS);
+static const ConsMap ipproto_ipv6_options = MAP(IPPROTO_IPV6_OPTIONS);
+static const ConsMap ipproto_tcp_options = MAP(IPPROTO_TCP_OPTIONS);
+static const ConsMap ipproto_udp_options = MAP(IPPROTO_UDP_OPTIONS);
+static const ConsMap socket_domains = MAP(SOCKET_DOMAINS);
+static const ConsMap socket_types = MAP(SOCKET_TYPES);
+static const ConsMap sockopt_levels = MAP(SOCKOPT_LEVELS);
+static const ConsMap sol_packet_options = MAP(SOL_PACKET_OPTIONS);
+static const ConsMap sol_socket_options = MAP(SOL_SOCKET_OPTIONS);
+
+static const ConsMap *const maps[] = {
+    &errnos,              &fcntl_cmds,           &ioctl_requests,
+    &ipproto_ip_options,  &ipproto_ipv6_options, &ipproto_tcp_options,
+    &ipproto_udp_options, &socket_domains,       &socket_types,
+    &sockopt_levels,      &sol_packet_options,   &sol_socket_options};
+
+#define TABLE_BITS 11
+#define TABLE_SIZE (1 << TABLE_BITS)
+
+#define ALL_PAIRS                                                             \
+        (PAIRS(ERRNOS) + PAIRS(FCNTL_CMDS) + PAIRS(IOCTL_REQUESTS) +          \
+         PAIRS(IPPROTO_IP_OPTIONS) + PAIRS(IPPROTO_IPV6_OPTIONS) +            \
+         PAIRS(IPPROTO_TCP_OPTIONS) + PAIRS(IPPROTO_UDP_OPTIONS) +            \
+         PAIRS(SOCKET_DOMAINS) + PAIRS(SOCKET_TYPES) + PAIRS(SOCKOPT_LEVELS) + \
+         PAIRS(SOL_PACKET_OPTIONS) + PAIRS(SOL_SOCKET_OPTIONS))
+
+// At most half full, for short probe sequences.
+_Static_assert(ALL_PAIRS <= TABLE_SIZE / 2, "constants table is too small");
+
+static const IntStrPair *table[TABLE_SIZE];  // NULL if the slot is free.
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static unsigned long slot_of(const ConsMap *map, int cons) {
+        uint64_t key = (uintptr_t)map ^ (uint32_t)cons;
+        return (key * 0x9e3779b97f4a7c15ULL) >> (64 - TABLE_BITS);
+}
+
+static bool is_in_map(const IntStrPair *pair, const ConsMap *map) {
+        return pair >= map->pairs && pair < map->pairs + map->size;
+}
+
+static const char *lookup(const ConsMap *map, int cons) {
+        for (unsigned long i = slot_of(map, cons); table[i];
+             i = (i + 1) % TABLE_SIZE) {
+                if (table[i]->cons == cons && is_in_map(table[i], map))
+                        return table[i]->str;
+        }
+        return NULL;
+}
+
+// Nothing in here may log, as it runs when the library is loaded.
+static void fill_table(void) {
+        for (size_t m = 0; m < sizeof(maps) / sizeof(ConsMap *); m++) {
+                const ConsMap *map = maps[m];
+                for (int i = 0; i < map->size; i++) {
+                        if (lookup(map, map->pairs[i].cons)) continue;
+                        unsigned long slot = slot_of(map, map->pairs[i].cons);
+                        while (table[slot]) slot = (slot + 1) % TABLE_SIZE;
+                        table[slot] = &map->pairs[i];
                 }
         }
+}
+
+__attribute__((constructor)) static void fill_table_at_load(void) {
+        pthread_once(&table_once, fill_table);
+}
+
+static const char *string_from_cons(const ConsMap *map, int cons, char *buf) {
+        pthread_once(&table_once, fill_table);
+        const char *str = lookup(map, cons);
+        if (str) return str;
 
         // No match found, just write the constant digit.
-        LOG_FUNC_WARN;
         LOG(WARN, "No match found for %d.", cons);
-        snprintf(*str_ptr, str_size, "%d", cons);
-        return false;
+        snprintf(buf, CONS_STR_SIZE, "%d", cons);
+        return buf;
 }
 
-#define MAP_GET(MAP, KEY)                                              \
-        {                                                              \
-                char *str;                                             \
-                int map_size = sizeof(MAP) / sizeof(IntStrPair);       \
-                if (!alloc_string_from_cons(KEY, MAP, map_size, &str)) \
-                        LOG_FUNC_WARN;                                 \
-                return str;                                            \
-        }
-
-char *alloc_sock_domain_str(int domain) { MAP_GET(SOCKET_DOMAINS, domain); }
+const char *sock_domain_str(int domain, char *buf) {
+        return string_from_cons(&socket_domains, domain, buf);
+}
 
-char *alloc_sock_type_str(int type) { MAP_GET(SOCKET_TYPES, type); }
+const char *sock_type_str(int type, char *buf) {
+        return string_from_cons(&socket_types, type, buf);
+}
 
-char *alloc_sockopt_level(int level) { MAP_GET(SOCKOPT_LEVELS, level); }
+const char *sockopt_level_str(int level, char *buf) {
+        return string_from_cons(&sockopt_levels, level, buf);
+}
 
-char *alloc_sockoptname(int level, int optname) {
+const char *sockoptname_str(int level, int optname, char *buf) {
+        const ConsMap *map;
         switch (level) {
                 case SOL_SOCKET:
-                        MAP_GET(SOL_SOCKET_OPTIONS, optname);
+                        map = &sol_socket_options;
+                        break;
                 case IPPROTO_TCP:
-                        MAP_GET(IPPROTO_TCP_OPTIONS, optname);
+                        map = &ipproto_tcp_options;
+                        break;
                 case IPPROTO_IP:
-                        MAP_GET(IPPROTO_IP_OPTIONS, optname);
+                        map = &ipproto_ip_options;
+                        break;
                 case IPPROTO_IPV6:
-                        MAP_GET(IPPROTO_IPV6_OPTIONS, optname);
+                        map = &ipproto_ipv6_options;
+                        break;
                 case IPPROTO_UDP:
-                        MAP_GET(IPPROTO_UDP_OPTIONS, optname);
+                        map = &ipproto_udp_options;
+                        break;
                 case SOL_PACKET:
-                        MAP_GET(SOL_PACKET_OPTIONS, optname);
+                        map = &sol_packet_options;
+                        break;
                 default:
                         LOG(WARN, "Unknown sockopt level: %d.", level);
                         LOG_FUNC_WARN;
-                        MAP_GET(SOL_SOCKET_OPTIONS, optname);
+                        map = &sol_socket_options;
         }
-        // Unreachable
-        return NULL;
+        return string_from_cons(map, optname, buf);
 }
 
-char *alloc_fcntl_cmd_str(int cmd) { MAP_GET(FCNTL_CMDS, cmd); }
+const char *fcntl_cmd_str(int cmd, char *buf) {
+        return string_from_cons(&fcntl_cmds, cmd, buf);
+}
 
-char *alloc_ioctl_request_str(int request) { MAP_GET(IOCTL_REQUESTS, request); }
+const char *ioctl_request_str(int request, char *buf) {
+        return string_from_cons(&ioctl_requests, request, buf);
+}
 
-char *alloc_errno_str(int err) { MAP_GET(ERRNOS, err); }
+const char *errno_str(int err, char *buf) {
+        return string_from_cons(&errnos, err, buf);
+}
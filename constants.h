@@ -53,12 +53,16 @@ typedef struct {
 #include "constants/sol_packet_options.h"
 #include "constants/sol_socket_options.h"
 
-char *alloc_errno_str(int err);
-char *alloc_fcntl_cmd_str(int cmd);
-char *alloc_ioctl_request_str(int request);
-char *alloc_sockoptname(int level, int optname);
-char *alloc_sockopt_level(int level);
-char *alloc_sock_domain_str(int domain);
-char *alloc_sock_type_str(int type);
+// Size of the buffer passed to the functions below. They return either a
+// string from the constant maps, or the constant digits written in buf.
+#define CONS_STR_SIZE MEMBER_SIZE(IntStrPair, str)
+
+const char *errno_str(int err, char *buf);
+const char *fcntl_cmd_str(int cmd, char *buf);
+const char *ioctl_request_str(int request, char *buf);
+const char *sockoptname_str(int level, int optname, char *buf);
+const char *sockopt_level_str(int level, char *buf);
+const char *sock_domain_str(int domain, char *buf);
+const char *sock_type_str(int type, char *buf);
 
 #endif
@@ -0,0 +1,70 @@
+#include "histogram.h"
+
+#define SUB_BUCKETS (1 << HIST_SUB_BITS)
+
+#define LOAD(a) atomic_load_explicit(a, memory_order_relaxed)
+#define STORE(a, v) atomic_store_explicit(a, v, memory_order_relaxed)
+
+// Single writer: no need for an atomic read-modify-write.
+static void add(_Atomic uint64_t *a, uint64_t n) { STORE(a, LOAD(a) + n); }
+
+static void raise_max(_Atomic uint64_t *a, uint64_t n) {
+        if (n > LOAD(a)) STORE(a, n);
+}
+
+static int bucket_of(uint64_t value) {
+        if (value >> HIST_MAX_BITS) return HIST_BUCKETS - 1;
+        if (value < SUB_BUCKETS) return value;
+        int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+        return ((shift + 1) << HIST_SUB_BITS) +
+               ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+void hist_record(Histogram *h, uint64_t value) {
+        add(&h->counts[bucket_of(value)], 1);
+        add(&h->count, 1);
+        add(&h->sum, value);
+        raise_max(&h->max, value);
+}
+
+void hist_merge(Histogram *dst, const Histogram *src) {
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+                uint64_t n = LOAD(&src->counts[i]);
+                if (n) add(&dst->counts[i], n);
+        }
+        add(&dst->count, LOAD(&src->count));
+        add(&dst->sum, LOAD(&src->sum));
+        raise_max(&dst->max, LOAD(&src->max));
+}
+
+void hist_clear(Histogram *h) {
+        for (int i = 0; i < HIST_BUCKETS; i++) STORE(&h->counts[i], 0);
+        STORE(&h->count, 0);
+        STORE(&h->sum, 0);
+        STORE(&h->max, 0);
+}
+
+uint64_t hist_bucket_low(int bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        int shift = (bucket >> HIST_SUB_BITS) - 1;
+        return (uint64_t)(SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift;
+}
+
+uint64_t hist_percentile(const Histogram *h, double percentile) {
+        uint64_t count = LOAD(&h->count);
+        uint64_t max = LOAD(&h->max);
+        if (!count) return 0;
+
+        double exact_rank = count * percentile / 100;
+        uint64_t rank = exact_rank;
+        if (rank < exact_rank || !rank) rank++;
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+                seen += LOAD(&h->counts[i]);
+                if (seen < rank) continue;
+                // Report the highest value of the bucket, as HdrHistogram.
+                uint64_t high = hist_bucket_low(i + 1) - 1;
+                return high < max ? high : max;
+        }
+        return max;
+}
@@ -0,0 +1,35 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Log-linear histograms of durations, in nanoseconds, in the style of
+ * HdrHistogram: each power of 2 is split into 2^HIST_SUB_BITS buckets of
+ * equal width, so that a bucket is at most 12.5% wide relative to its values.
+ * Values below 2^HIST_SUB_BITS have a bucket each and values above
+ * 2^HIST_MAX_BITS ns (about 18 minutes) fall in the last bucket.
+ *
+ * A histogram has a single writer at a time, which updates it without locks.
+ * It may be read or merged into another one concurrently. */
+
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct {
+        _Atomic uint64_t counts[HIST_BUCKETS];
+        _Atomic uint64_t count;
+        _Atomic uint64_t sum;  // For the mean.
+        _Atomic uint64_t max;  // Exact, unlike the buckets.
+} Histogram;
+
+void hist_record(Histogram *h, uint64_t value);
+void hist_merge(Histogram *dst, const Histogram *src);
+void hist_clear(Histogram *h);  // Not concurrently with its writer.
+
+uint64_t hist_bucket_low(int bucket);  // Lowest value of the bucket.
+// Value below which percentile % of the values fall, 0 if h is empty.
+uint64_t hist_percentile(const Histogram *h, double percentile);
+
+#endif
@@ -12,19 +12,34 @@
 #include <android/log.h>
 #include <sys/system_properties.h>
 #endif
+#include "latency.h"
 #include "lib.h"
+#include "libc_symbols.h"
 #include "logger.h"
 #include "sock_events.h"
 #include "string_builders.h"
+#include "tcp_info.h"
+#include "thread_cache.h"
+#include "timestamps.h"
+#include "trace_writer.h"
 
 long conf_opt_b;
 long conf_opt_c;
 char *conf_opt_d;
+long conf_opt_e;
 long conf_opt_f;
+long conf_opt_g;
+long conf_opt_i;
 long conf_opt_l;
+long conf_opt_m;
+char *conf_opt_o;
+long conf_opt_r;
+long conf_opt_s;
 long conf_opt_u;
 long conf_opt_t;
 long conf_opt_v;
+long conf_opt_w;
+long conf_opt_z;
 
 char *logs_dir_path;
 
@@ -89,6 +104,7 @@ error_out:
 
 static void tcpsnitch_free(void) {
         free(conf_opt_d);
+        free(conf_opt_o);
         free(logs_dir_path);
 #ifndef __ANDROID__
         if (_stdout) fclose(_stdout);
@@ -117,11 +133,20 @@ static void get_options(void) {
         conf_opt_c = get_long_opt_or_defaultval(OPT_C, 0);
         conf_opt_d = alloc_str_opt(OPT_D);
 #endif
+        conf_opt_e = get_long_opt_or_defaultval(OPT_E, 0);
         conf_opt_f = get_long_opt_or_defaultval(OPT_F, WARN);
+        conf_opt_g = get_long_opt_or_defaultval(OPT_G, 0);
+        conf_opt_i = get_long_opt_or_defaultval(OPT_I, 0);
         conf_opt_l = get_long_opt_or_defaultval(OPT_L, WARN);
+        conf_opt_m = get_long_opt_or_defaultval(OPT_M, 0);
+        conf_opt_o = alloc_str_opt(OPT_O);
+        conf_opt_r = get_long_opt_or_defaultval(OPT_R, 0);
+        conf_opt_s = get_long_opt_or_defaultval(OPT_S, 0);
         conf_opt_t = get_long_opt_or_defaultval(OPT_T, 1000);
         conf_opt_u = get_long_opt_or_defaultval(OPT_U, 0);
         conf_opt_v = get_long_opt_or_defaultval(OPT_V, 0);
+        conf_opt_w = get_long_opt_or_defaultval(OPT_W, 0);
+        conf_opt_z = get_long_opt_or_defaultval(OPT_Z, 0);
 }
 
 static void log_options(void) {
@@ -130,11 +155,20 @@ static void log_options(void) {
         LOG(INFO, "Option c: %lu.", conf_opt_c);
 #endif
         LOG(INFO, "Option d: %s", conf_opt_d);
+        LOG(INFO, "Option e: %lu.", conf_opt_e);
         LOG(INFO, "Option f: %lu.", conf_opt_f);
+        LOG(INFO, "Option g: %lu.", conf_opt_g);
+        LOG(INFO, "Option i: %lu.", conf_opt_i);
         LOG(INFO, "Option l: %lu.", conf_opt_l);
+        LOG(INFO, "Option m: %lu.", conf_opt_m);
+        LOG(INFO, "Option o: %s", conf_opt_o);
+        LOG(INFO, "Option r: %lu.", conf_opt_r);
+        LOG(INFO, "Option s: %lu.", conf_opt_s);
         LOG(INFO, "Option t: %lu.", conf_opt_t);
         LOG(INFO, "Option u: %lu.", conf_opt_u);
         LOG(INFO, "Option v: %lu.", conf_opt_v);
+        LOG(INFO, "Option w: %lu.", conf_opt_w);
+        LOG(INFO, "Option z: %lu.", conf_opt_z);
 }
 
 static void init_logs(void) {
@@ -149,6 +183,30 @@ error:
         LOG(ERROR, "No logs to file.");
 }
 
+static void dump_latency(void) {
+        if (conf_opt_e <= 0 || !logs_dir_path) return;
+        char *path;
+        if (!(path = alloc_concat_path(logs_dir_path, "latency.json")))
+                goto error;
+        lat_dump(path);
+        free(path);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
+
+static void dump_thread_counts(void) {
+        if (!logs_dir_path) return;
+        char *path;
+        if (!(path = alloc_concat_path(logs_dir_path, "threads.json")))
+                goto error;
+        tc_dump(path);
+        free(path);
+        return;
+error:
+        LOG_FUNC_ERROR;
+}
+
 static void *json_dumper_thread(void *arg) {
         UNUSED(arg);
         LOG_FUNC_INFO;
@@ -179,7 +237,7 @@ void start_json_dumper_thread(void) {
 void reset_tcpsnitch(void) {
         if (!initialized) return;  // Nothing to do.
         tcpsnitch_free();
-        logger_init(NULL, WARN, WARN);
+        logger_reset();
         initialized = false;
         mutex_init(&init_mutex);
         sock_ev_reset();
@@ -189,15 +247,22 @@ void init_tcpsnitch(void) {
         mutex_lock(&init_mutex);
         if (initialized) goto exit;
 
+        ts_init();
 #ifndef __ANDROID__
         open_std_streams();
 #endif
         get_options();
+        sock_ev_set_filter(conf_opt_o);
         if (!conf_opt_d) goto exit1;
         if (!(logs_dir_path = create_logs_dir_at_path(conf_opt_d))) goto exit1;
         init_logs();
         log_options();
+        LOG(INFO, "libc symbols resolved in %lu us.",
+            libc_symbols_resolution_nanos() / 1000);
+        LOG(INFO, "Timestamps from %s.",
+            string_from_ts_clock(ts_get_anchor()->clock));
         if (conf_opt_t) start_json_dumper_thread();
+        ti_start();
         goto exit;
 exit1:
         LOG(ERROR, "Nothing will be written to file (log, pcap, json).");
@@ -210,6 +275,10 @@ exit:
 __attribute__((destructor)) static void cleanup(void) {
         LOG(INFO, "Performing library cleanup before end of process.");
         dump_all_sock_events();
+        tw_flush();
+        dump_latency();
+        dump_thread_counts();
+        logger_flush();
         // tcp_free();
         // tcpsnitch_free();
 }
@@ -11,31 +11,58 @@
 #define OPT_B "be.ucl.tcpsnitch.opt_b"
 #define OPT_C "be.ucl.tcpsnitch.opt_c"
 #define OPT_D "be.ucl.tcpsnitch.opt_d"
+#define OPT_E "be.ucl.tcpsnitch.opt_e"
 #define OPT_F "be.ucl.tcpsnitch.opt_f"
+#define OPT_G "be.ucl.tcpsnitch.opt_g"
+#define OPT_I "be.ucl.tcpsnitch.opt_i"
 #define OPT_L "be.ucl.tcpsnitch.opt_l"
+#define OPT_M "be.ucl.tcpsnitch.opt_m"
+#define OPT_O "be.ucl.tcpsnitch.opt_o"
+#define OPT_R "be.ucl.tcpsnitch.opt_r"
+#define OPT_S "be.ucl.tcpsnitch.opt_s"
 #define OPT_T "be.ucl.tcpsnitch.opt_t"
 #define OPT_U "be.ucl.tcpsnitch.opt_u"
 #define OPT_V "be.ucl.tcpsnitch.opt_v"
+#define OPT_W "be.ucl.tcpsnitch.opt_w"
+#define OPT_Z "be.ucl.tcpsnitch.opt_z"
 #else
 #define OPT_B "TCPSNITCH_OPT_B"
 #define OPT_C "TCPSNITCH_OPT_C"
 #define OPT_D "TCPSNITCH_OPT_D"
+#define OPT_E "TCPSNITCH_OPT_E"
 #define OPT_F "TCPSNITCH_OPT_F"
+#define OPT_G "TCPSNITCH_OPT_G"
+#define OPT_I "TCPSNITCH_OPT_I"
 #define OPT_L "TCPSNITCH_OPT_L"
+#define OPT_M "TCPSNITCH_OPT_M"
+#define OPT_O "TCPSNITCH_OPT_O"
+#define OPT_R "TCPSNITCH_OPT_R"
+#define OPT_S "TCPSNITCH_OPT_S"
 #define OPT_T "TCPSNITCH_OPT_T"
 #define OPT_U "TCPSNITCH_OPT_U"
 #define OPT_V "TCPSNITCH_OPT_V"
+#define OPT_W "TCPSNITCH_OPT_W"
+#define OPT_Z "TCPSNITCH_OPT_Z"
 #endif
 
 extern long conf_opt_b;
 extern long conf_opt_c;
 extern char *conf_opt_d;
+extern long conf_opt_e;
 extern long conf_opt_f;
+extern long conf_opt_g;
+extern long conf_opt_i;
 extern long conf_opt_l;
+extern long conf_opt_m;
+extern char *conf_opt_o;
 extern long conf_opt_p;
+extern long conf_opt_r;
+extern long conf_opt_s;
 extern long conf_opt_u;
 extern long conf_opt_t;
 extern long conf_opt_v;
+extern long conf_opt_w;
+extern long conf_opt_z;
 
 extern char *logs_dir_path;
 
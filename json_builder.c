@@ -6,9 +6,11 @@
 #include "constants.h"
 #include "fcntl.h"
 #include "init.h"
+#include "latency.h"
 #include "lib.h"
 #include "logger.h"
 #include "string_builders.h"
+#include "tcp_info.h"
 #include "sys/epoll.h"
 
 static json_t *my_json_object(void) {
@@ -40,13 +42,10 @@ static json_t *build_sock_info(const SockInfo *sock_info) {
         if (!sock_info->filled) return NULL;
         json_t *json_si = my_json_object();
 
-        char *domain = alloc_sock_domain_str(sock_info->domain);
-        add(json_si, "domain", json_string(domain));
-        free(domain);
-
-        char *type = alloc_sock_type_str(sock_info->type);
-        add(json_si, "type", json_string(type));
-        free(type);
+        char buf[CONS_STR_SIZE];
+        add(json_si, "domain",
+            json_string(sock_domain_str(sock_info->domain, buf)));
+        add(json_si, "type", json_string(sock_type_str(sock_info->type, buf)));
 
         add(json_si, "protocol", json_integer(sock_info->protocol));
         add(json_si, "SOCK_CLOEXEC", json_boolean(sock_info->sock_cloexec));
@@ -67,12 +66,9 @@ static json_t *build_addr(const Addr *addr) {
         else if (sockaddr->sa_family == AF_INET6)
                 add(json_addr, "sa_family", json_string("AF_INET6"));
 
-        char *ip = alloc_ip_str(sockaddr);
-        add(json_addr, "ip", json_string(ip));
-        free(ip);
-        char *port = alloc_port_str(sockaddr);
-        add(json_addr, "port", json_string(port));
-        free(port);
+        char ip[IP_STR_SIZE], port[PORT_STR_SIZE];
+        add(json_addr, "ip", json_string(ip_str(sockaddr, ip)));
+        add(json_addr, "port", json_string(port_str(sockaddr, port)));
 
         // char *hostname, *service;
         // alloc_name_str(sockaddr, addr->len, &hostname, &service);
@@ -159,20 +155,19 @@ static json_t *build_epoll_events(uint32_t events) {
 static json_t *build_iovec(const Iovec *iovec) {
         json_t *json_iovec = my_json_object();
         add(json_iovec, "iovec_count", json_integer(iovec->iovec_count));
-        json_t *iovec_sizes = my_json_array();
+        json_t *json_sizes = my_json_array();
+        const size_t *sizes = iovec_sizes(iovec);
         for (int i = 0; i < iovec->iovec_count; i++)
-                json_array_append_new(iovec_sizes,
-                                      json_integer(iovec->iovec_sizes[i]));
-        add(json_iovec, "iovec_sizes", iovec_sizes);
+                json_array_append_new(json_sizes, json_integer(sizes[i]));
+        add(json_iovec, "iovec_sizes", json_sizes);
         return json_iovec;
 }
 
-static json_t *build_control_data(struct msghdr *msgh) {
+static json_t *build_control_data(const Msghdr *msg) {
         json_t *json_cd_list = my_json_array();
         // TODO: Can't find where the problem is... Can't properly extract the
         // ancillary data.
-        struct cmsghdr *cmsg;
-        cmsg = CMSG_FIRSTHDR(msgh);
+        const struct cmsghdr *cmsg = first_cmsghdr(msg);
         if (cmsg) {
                 json_t *json_cd = my_json_object();
                 add(json_cd, "cmsg_level", json_integer(cmsg->cmsg_level));
@@ -199,8 +194,8 @@ static json_t *build_msghdr(const Msghdr *msg) {
         if (msg->flags) add(json_msghdr, "flags", build_recv_flags(msg->flags));
         add(json_msghdr, "iovec", build_iovec(&msg->iovec));
         add(json_msghdr, "control_data_len",
-            json_integer(msg->msghdr->msg_controllen));
-        add(json_msghdr, "control_data", build_control_data(msg->msghdr));
+            json_integer(msg->control_len));
+        add(json_msghdr, "control_data", build_control_data(msg));
         return json_msghdr;
 }
 
@@ -233,29 +228,30 @@ static json_t *build_linger(const struct linger *linger) {
 }
 
 static json_t *build_optval(const Sockopt *sockopt) {
+        const void *optval = sockopt_val(sockopt);
         switch (sockopt->level) {
                 case SOL_SOCKET:
                         switch (sockopt->optname) {
                                 case SO_RCVTIMEO:
                                 case SO_SNDTIMEO:
                                         return build_timeval(
-                                            (struct timeval *)sockopt->optval);
+                                            (const struct timeval *)optval);
                                         break;
                                 case SO_LINGER:
                                         return build_linger(
-                                            (struct linger *)sockopt->optval);
+                                            (const struct linger *)optval);
                                         break;
                                 case SO_RCVBUF:
                                 case SO_SNDBUF:
                                 case SO_ERROR:
                                         return json_integer(
-                                            *((int *)sockopt->optval));
+                                            *((const int *)optval));
                                         break;
                                 case SO_KEEPALIVE:
                                 case SO_DEBUG:
                                 case SO_REUSEADDR:
                                         return json_boolean(
-                                            *((int *)sockopt->optval));
+                                            *((const int *)optval));
                                         break;
                         }
                         break;
@@ -264,11 +260,11 @@ static json_t *build_optval(const Sockopt *sockopt) {
                                 case TCP_KEEPINTVL:
                                 case TCP_KEEPIDLE:
                                         return json_integer(
-                                            *((int *)sockopt->optval));
+                                            *((const int *)optval));
                                         break;
                                 case TCP_NODELAY:
                                         return json_boolean(
-                                            *((int *)sockopt->optval));
+                                            *((const int *)optval));
                                         break;
                         }
                         break;
@@ -276,7 +272,7 @@ static json_t *build_optval(const Sockopt *sockopt) {
                         switch (sockopt->optname) {
                                 case IPV6_V6ONLY:
                                         return json_boolean(
-                                            *((int *)sockopt->optval));
+                                            *((const int *)optval));
                                         break;
                         }
                         break;
@@ -285,13 +281,12 @@ static json_t *build_optval(const Sockopt *sockopt) {
 }
 
 static void add_sockopt(json_t *details, const Sockopt *sockopt) {
-        char *level = alloc_sockopt_level(sockopt->level);
-        add(details, "level", json_string(level));
-        free(level);
-
-        char *optname = alloc_sockoptname(sockopt->level, sockopt->optname);
-        add(details, "optname", json_string(optname));
-        free(optname);
+        char buf[CONS_STR_SIZE];
+        add(details, "level",
+            json_string(sockopt_level_str(sockopt->level, buf)));
+        add(details, "optname",
+            json_string(
+                sockoptname_str(sockopt->level, sockopt->optname, buf)));
 
         add(details, "optlen", json_integer(sockopt->optlen));
         if (sockopt->optlen) add(details, "optval", build_optval(sockopt));
@@ -312,13 +307,12 @@ static void add_fl_flags(json_t *details, int flags) {
 static void build_shared_fields(json_t *json_ev, const SockEvent *ev) {
         const char *type_str = string_from_sock_event_type(ev->type);
         add(json_ev, "type", json_string(type_str));
-        add(json_ev, "timestamp_usec", json_integer(ev->timestamp_usec));
+        add(json_ev, "timestamp_usec", json_integer(ev->timestamp_ns / 1000));
         add(json_ev, "return_value", json_integer(ev->return_value));
         add(json_ev, "success", json_boolean(ev->success));
         if (!ev->success) {
-                char *errno_str = alloc_errno_str(ev->err);
-                add(json_ev, "errno", json_string(errno_str));
-                free(errno_str);
+                char buf[CONS_STR_SIZE];
+                add(json_ev, "errno", json_string(errno_str(ev->err, buf)));
         }
         add(json_ev, "thread_id", json_integer(ev->thread_id));
         add(json_ev, "fake_call", json_boolean(false));
@@ -550,9 +544,9 @@ static json_t *build_sock_ev_readv(const SockEvReadv *ev) {
 
 static json_t *build_sock_ev_ioctl(const SockEvIoctl *ev) {
         BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t *json_details
-        char *request = alloc_ioctl_request_str(ev->request);
-        add(json_details, "request", json_string(request));
-        free(request);
+        char buf[CONS_STR_SIZE];
+        add(json_details, "request",
+            json_string(ioctl_request_str(ev->request, buf)));
         return json_ev;
 }
 
@@ -606,9 +600,8 @@ static json_t *build_sock_ev_fcntl(const SockEvFcntl *ev) {
         BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t *json_details
         json_t *d = json_details;
 
-        char *cmd_str = alloc_fcntl_cmd_str(ev->cmd);
-        add(json_details, "cmd", json_string(cmd_str));
-        free(cmd_str);
+        char buf[CONS_STR_SIZE];
+        add(json_details, "cmd", json_string(fcntl_cmd_str(ev->cmd, buf)));
 
         switch (ev->cmd) {
                 case F_GETFD:
@@ -687,55 +680,216 @@ static json_t *build_sock_ev_fdopen(const SockEvFdopen *ev) {
         return json_ev;
 }
 
-static json_t *build_sock_ev_tcp_info(const SockEvTcpInfo *ev) {
+static json_t *build_sock_ev_coalesced(const SockEvCoalesced *ev) {
+        BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t *json_details
+        const char *type_str = string_from_sock_event_type(ev->ev_type);
+        add(json_details, "event", json_string(type_str));
+        add(json_details, "count", json_integer(ev->count));
+        add(json_details, "bytes", json_integer(ev->bytes));
+        add(json_details, "min_bytes", json_integer(ev->min_bytes));
+        add(json_details, "max_bytes", json_integer(ev->max_bytes));
+        add(json_details, "last_timestamp_usec",
+            json_integer(ev->last_timestamp_ns / 1000));
+        if (ev->ev_type == SOCK_EV_SEND)
+                add(json_details, "flags", build_send_flags(ev->flags));
+        if (ev->ev_type == SOCK_EV_RECV)
+                add(json_details, "flags", build_recv_flags(ev->flags));
+        return json_ev;
+}
+
+static json_t *build_sock_ev_skipped(const SockEvSkipped *ev) {
         BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t *json_details
         add(json_ev, "fake_call", json_boolean(true));
+        add(json_details, "events", json_integer(ev->events));
+        add(json_details, "bytes_sent", json_integer(ev->bytes_sent));
+        add(json_details, "bytes_received", json_integer(ev->bytes_received));
+        return json_ev;
+}
 
-        struct tcp_info i = ev->info;
+/* Fields past those of glibc are only added if the kernel filled them, i.e.
+ * if they fit in len. Unset 64-bit rates (~0) show up as -1. */
+#define ADD_IF(key, field) \
+        if (TCP_INFO_HAS(len, field)) add(details, key, json_integer(i->field))
+
+static void add_tcp_info(json_t *details, const TcpInfo *i, size_t len,
+                         TcpLimit limited_by) {
+        add(details, "state", json_integer(i->tcpi_state));
+        add(details, "ca_state", json_integer(i->tcpi_ca_state));
+        add(details, "retransmits", json_integer(i->tcpi_retransmits));
+        add(details, "probes", json_integer(i->tcpi_probes));
+        add(details, "backoff", json_integer(i->tcpi_backoff));
+        add(details, "options", json_integer(i->tcpi_options));
+        add(details, "snd_wscale", json_integer(i->tcpi_snd_wscale));
+        add(details, "rcv_wscale", json_integer(i->tcpi_rcv_wscale));
+
+        add(details, "rto", json_integer(i->tcpi_rto));
+        add(details, "ato", json_integer(i->tcpi_ato));
+        add(details, "snd_mss", json_integer(i->tcpi_snd_mss));
+        add(details, "rcv_mss", json_integer(i->tcpi_rcv_mss));
+
+        add(details, "unacked", json_integer(i->tcpi_unacked));
+        add(details, "sacked", json_integer(i->tcpi_sacked));
+        add(details, "lost", json_integer(i->tcpi_lost));
+        add(details, "retrans", json_integer(i->tcpi_retrans));
+        add(details, "fackets", json_integer(i->tcpi_fackets));
 
-        add(json_details, "state", json_integer(i.tcpi_state));
-        add(json_details, "ca_state", json_integer(i.tcpi_ca_state));
-        add(json_details, "retransmits", json_integer(i.tcpi_retransmits));
-        add(json_details, "probes", json_integer(i.tcpi_probes));
-        add(json_details, "backoff", json_integer(i.tcpi_backoff));
-        add(json_details, "options", json_integer(i.tcpi_options));
-        add(json_details, "snd_wscale", json_integer(i.tcpi_snd_wscale));
-        add(json_details, "rcv_wscale", json_integer(i.tcpi_rcv_wscale));
+        /* Times */
+        add(details, "last_data_sent", json_integer(i->tcpi_last_data_sent));
+        add(details, "last_ack_sent", json_integer(i->tcpi_last_ack_sent));
+        add(details, "last_data_recv", json_integer(i->tcpi_last_data_recv));
+        add(details, "last_ack_recv", json_integer(i->tcpi_last_ack_recv));
 
-        add(json_details, "rto", json_integer(i.tcpi_rto));
-        add(json_details, "ato", json_integer(i.tcpi_ato));
-        add(json_details, "snd_mss", json_integer(i.tcpi_snd_mss));
-        add(json_details, "rcv_mss", json_integer(i.tcpi_rcv_mss));
+        /* Metrics */
+        add(details, "pmtu", json_integer(i->tcpi_pmtu));
+        add(details, "rcv_ssthresh", json_integer(i->tcpi_rcv_ssthresh));
+        add(details, "rtt", json_integer(i->tcpi_rtt));
+        add(details, "rttvar", json_integer(i->tcpi_rttvar));
+        add(details, "snd_ssthresh", json_integer(i->tcpi_snd_ssthresh));
+        add(details, "snd_cwnd", json_integer(i->tcpi_snd_cwnd));
+        add(details, "advmss", json_integer(i->tcpi_advmss));
+        add(details, "reordering", json_integer(i->tcpi_reordering));
+
+        add(details, "rcv_rtt", json_integer(i->tcpi_rcv_rtt));
+        add(details, "rcv_space", json_integer(i->tcpi_rcv_space));
+
+        add(details, "total_retrans", json_integer(i->tcpi_total_retrans));
+
+        ADD_IF("pacing_rate", tcpi_pacing_rate);
+        ADD_IF("max_pacing_rate", tcpi_max_pacing_rate);
+        ADD_IF("bytes_acked", tcpi_bytes_acked);
+        ADD_IF("bytes_received", tcpi_bytes_received);
+        ADD_IF("segs_out", tcpi_segs_out);
+        ADD_IF("segs_in", tcpi_segs_in);
+
+        ADD_IF("notsent_bytes", tcpi_notsent_bytes);
+        ADD_IF("min_rtt", tcpi_min_rtt);
+        ADD_IF("data_segs_in", tcpi_data_segs_in);
+        ADD_IF("data_segs_out", tcpi_data_segs_out);
+
+        ADD_IF("delivery_rate", tcpi_delivery_rate);
+        if (TCP_INFO_HAS(len, tcpi_delivery_rate))
+                add(details, "delivery_rate_app_limited",
+                    json_boolean(i->tcpi_delivery_rate_app_limited));
+
+        ADD_IF("busy_time", tcpi_busy_time);
+        ADD_IF("rwnd_limited", tcpi_rwnd_limited);
+        ADD_IF("sndbuf_limited", tcpi_sndbuf_limited);
+
+        ADD_IF("delivered", tcpi_delivered);
+        ADD_IF("delivered_ce", tcpi_delivered_ce);
+
+        ADD_IF("bytes_sent", tcpi_bytes_sent);
+        ADD_IF("bytes_retrans", tcpi_bytes_retrans);
+        ADD_IF("dsack_dups", tcpi_dsack_dups);
+        ADD_IF("reord_seen", tcpi_reord_seen);
+
+        ADD_IF("rcv_ooopack", tcpi_rcv_ooopack);
+
+        ADD_IF("snd_wnd", tcpi_snd_wnd);
+        ADD_IF("rcv_wnd", tcpi_rcv_wnd);
+        ADD_IF("rehash", tcpi_rehash);
+        ADD_IF("total_rto", tcpi_total_rto);
+        ADD_IF("total_rto_recoveries", tcpi_total_rto_recoveries);
+        ADD_IF("total_rto_time", tcpi_total_rto_time);
+
+        if (limited_by != TCP_LIMIT_UNKNOWN)
+                add(details, "limited_by",
+                    json_string(string_from_tcp_limit(limited_by)));
+}
+
+#undef ADD_IF
+
+static json_t *build_errors(const SockSummary *sum) {
+        json_t *json_errors = my_json_object();
+        for (int i = 0; i < SUMMARY_ERRNOS && sum->errors[i].count; i++) {
+                char buf[CONS_STR_SIZE];
+                add(json_errors, errno_str(sum->errors[i].err, buf),
+                    json_integer(sum->errors[i].count));
+        }
+        if (sum->other_errors)
+                add(json_errors, "others", json_integer(sum->other_errors));
+        return json_errors;
+}
 
-        add(json_details, "unacked", json_integer(i.tcpi_unacked));
-        add(json_details, "sacked", json_integer(i.tcpi_sacked));
-        add(json_details, "lost", json_integer(i.tcpi_lost));
-        add(json_details, "retrans", json_integer(i.tcpi_retrans));
-        add(json_details, "fackets", json_integer(i.tcpi_fackets));
+static json_t *build_calls(const SockSummary *sum) {
+        json_t *json_calls = my_json_object();
+        for (int i = 0; i <= SOCK_EV_TCP_INFO; i++) {
+                if (!sum->calls[i]) continue;
+                const char *type_str = string_from_sock_event_type(i);
+                add(json_calls, type_str, json_integer(sum->calls[i]));
+        }
+        return json_calls;
+}
 
-        /* Times */
-        add(json_details, "last_data_sent",
-            json_integer(i.tcpi_last_data_sent));
-        add(json_details, "last_ack_sent", json_integer(i.tcpi_last_ack_sent));
-        add(json_details, "last_data_recv",
-            json_integer(i.tcpi_last_data_recv));
-        add(json_details, "last_ack_recv", json_integer(i.tcpi_last_ack_recv));
+static json_t *build_sock_ev_summary(const SockEvSummary *ev) {
+        BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t *json_details
+        add(json_ev, "fake_call", json_boolean(true));
+        const SockSummary *sum = ev->summary;
 
-        /* Metrics */
-        add(json_details, "pmtu", json_integer(i.tcpi_pmtu));
-        add(json_details, "rcv_ssthresh", json_integer(i.tcpi_rcv_ssthresh));
-        add(json_details, "rtt", json_integer(i.tcpi_rtt));
-        add(json_details, "rttvar", json_integer(i.tcpi_rttvar));
-        add(json_details, "snd_ssthresh", json_integer(i.tcpi_snd_ssthresh));
-        add(json_details, "snd_cwnd", json_integer(i.tcpi_snd_cwnd));
-        add(json_details, "advmss", json_integer(i.tcpi_advmss));
-        add(json_details, "reordering", json_integer(i.tcpi_reordering));
+        add(json_details, "sock_info", build_sock_info(&ev->sock_info));
+        if (sum->peer.len) add(json_details, "addr", build_addr(&sum->peer));
+        add(json_details, "bytes_sent", json_integer(ev->bytes_sent));
+        add(json_details, "bytes_received", json_integer(ev->bytes_received));
+        add(json_details, "calls", build_calls(sum));
+        add(json_details, "errors", build_errors(sum));
+        if (sum->first_byte_ns) {
+                uint64_t delay = sum->first_byte_ns - sum->start_ns;
+                add(json_details, "connect_to_first_byte_usec",
+                    json_integer(delay / 1000));
+        }
+        if (sum->tcp_info_len) {
+                json_t *json_info = my_json_object();
+                add_tcp_info(json_info, &sum->tcp_info, sum->tcp_info_len,
+                             sum->tcp_limited_by);
+                add(json_details, "tcp_info", json_info);
+        }
+        return json_ev;
+}
 
-        add(json_details, "rcv_rtt", json_integer(i.tcpi_rcv_rtt));
-        add(json_details, "rcv_space", json_integer(i.tcpi_rcv_space));
+static json_t *build_histogram(const Histogram *h) {
+        json_t *json_hist = my_json_object();
+        uint64_t count = h->count;
+        add(json_hist, "count", json_integer(count));
+        add(json_hist, "mean_ns", json_integer(count ? h->sum / count : 0));
+        add(json_hist, "max_ns", json_integer(h->max));
+        add(json_hist, "p50_ns", json_integer(hist_percentile(h, 50)));
+        add(json_hist, "p90_ns", json_integer(hist_percentile(h, 90)));
+        add(json_hist, "p99_ns", json_integer(hist_percentile(h, 99)));
+        add(json_hist, "p999_ns", json_integer(hist_percentile(h, 99.9)));
+
+        // Non-empty buckets only, as [lowest value, count].
+        json_t *json_buckets = my_json_array();
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+                uint64_t n = h->counts[i];
+                if (!n) continue;
+                json_t *json_bucket = my_json_array();
+                json_array_append_new(json_bucket,
+                                      json_integer(hist_bucket_low(i)));
+                json_array_append_new(json_bucket, json_integer(n));
+                json_array_append_new(json_buckets, json_bucket);
+        }
+        add(json_hist, "buckets", json_buckets);
+        return json_hist;
+}
 
-        add(json_details, "total_retrans", json_integer(i.tcpi_total_retrans));
+static json_t *build_sock_ev_latency(const SockEvLatency *ev) {
+        BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t *json_details
+        add(json_ev, "fake_call", json_boolean(true));
+        for (int i = 0; i < LAT_CALLS; i++) {
+                const Histogram *h = ev->histograms[i];
+                if (!h) continue;
+                add(json_details, string_from_sock_event_type(i),
+                    build_histogram(h));
+        }
+        return json_ev;
+}
 
+static json_t *build_sock_ev_tcp_info(const SockEvTcpInfo *ev) {
+        BUILD_EV_PRELUDE()  // Inst. json_t *json_ev & json_t *json_details
+        add(json_ev, "fake_call", json_boolean(true));
+        TcpInfo info;
+        tcp_info_of(ev, &info);
+        add_tcp_info(json_details, &info, ev->len, ev->limited_by);
         return json_ev;
 }
 
@@ -878,6 +1032,19 @@ static json_t *build_sock_ev(const SockEvent *ev) {
                 case SOCK_EV_FDOPEN:
                         r = build_sock_ev_fdopen((const SockEvFdopen *)ev);
                         break;
+                case SOCK_EV_COALESCED:
+                        r = build_sock_ev_coalesced(
+                            (const SockEvCoalesced *)ev);
+                        break;
+                case SOCK_EV_SKIPPED:
+                        r = build_sock_ev_skipped((const SockEvSkipped *)ev);
+                        break;
+                case SOCK_EV_SUMMARY:
+                        r = build_sock_ev_summary((const SockEvSummary *)ev);
+                        break;
+                case SOCK_EV_LATENCY:
+                        r = build_sock_ev_latency((const SockEvLatency *)ev);
+                        break;
                 case SOCK_EV_TCP_INFO:
                         r = build_sock_ev_tcp_info((const SockEvTcpInfo *)ev);
                         break;
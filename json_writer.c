@@ -0,0 +1,955 @@
+#define _GNU_SOURCE
+
+#include "json_writer.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include "constants.h"
+#include "latency.h"
+#include "lib.h"
+#include "logger.h"
+#include "string_builders.h"
+#include "tcp_info.h"
+
+/* The output must stay byte-compatible with json_dumps(json, 0) as used by
+ * json_builder.c: members are written in insertion order, separated by ", ",
+ * keys are followed by ": ", and a member whose value Jansson would reject
+ * (a NULL json_t, or a string that is not valid UTF-8) is omitted. */
+
+#define JSON_BUFFER_INITIAL_SIZE 4096
+
+typedef struct {
+        char *str;
+        size_t len;
+        size_t size;
+        bool first;  // Nothing written yet in the current object or array.
+        AddrStrCache *addr_cache;  // Of the socket of the event, or NULL.
+} JsonWriter;
+
+static __thread JsonWriter *my_writer = NULL;
+static pthread_key_t writer_key;
+static pthread_once_t writer_key_once = PTHREAD_ONCE_INIT;
+
+static void free_writer(void *w) {
+        free(((JsonWriter *)w)->str);
+        free(w);
+}
+
+static void make_writer_key(void) {
+        pthread_key_create(&writer_key, free_writer);
+}
+
+static JsonWriter *get_writer(void) {
+        if (my_writer) return my_writer;
+
+        JsonWriter *w = (JsonWriter *)my_calloc(sizeof(JsonWriter));
+        w->size = JSON_BUFFER_INITIAL_SIZE;
+        w->str = (char *)my_malloc(w->size);
+
+        pthread_once(&writer_key_once, make_writer_key);
+        pthread_setspecific(writer_key, w);
+        my_writer = w;
+        return w;
+}
+
+/* Primitives */
+
+static void put(JsonWriter *w, const char *s, size_t n) {
+        if (w->len + n + 1 > w->size) {
+                while (w->len + n + 1 > w->size) w->size *= 2;
+                w->str = (char *)my_realloc(w->str, w->size);
+        }
+        memcpy(w->str + w->len, s, n);
+        w->len += n;
+}
+
+#define PUT_LITERAL(w, s) put(w, s, sizeof(s) - 1)
+
+static void put_separator(JsonWriter *w) {
+        if (!w->first) PUT_LITERAL(w, ", ");
+        w->first = false;
+}
+
+static void put_key(JsonWriter *w, const char *key) {
+        put_separator(w);
+        PUT_LITERAL(w, "\"");
+        put(w, key, strlen(key));
+        PUT_LITERAL(w, "\": ");
+}
+
+static void put_integer(JsonWriter *w, long long i) {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%lld", i);
+        put(w, buf, n);
+}
+
+// Same checks as Jansson: no overlong forms, surrogates or code points above
+// U+10FFFF.
+static bool is_valid_utf8(const char *s) {
+        const unsigned char *u = (const unsigned char *)s;
+        while (*u) {
+                int n;
+                unsigned int cp;
+                if (*u < 0x80) {
+                        u++;
+                        continue;
+                } else if (*u >= 0xC2 && *u <= 0xDF) {
+                        n = 1;
+                        cp = *u & 0x1F;
+                } else if (*u >= 0xE0 && *u <= 0xEF) {
+                        n = 2;
+                        cp = *u & 0x0F;
+                } else if (*u >= 0xF0 && *u <= 0xF4) {
+                        n = 3;
+                        cp = *u & 0x07;
+                } else {
+                        return false;
+                }
+                for (int i = 1; i <= n; i++) {
+                        if ((u[i] & 0xC0) != 0x80) return false;
+                        cp = (cp << 6) | (u[i] & 0x3F);
+                }
+                if ((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) ||
+                    cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+                        return false;
+                u += n + 1;
+        }
+        return true;
+}
+
+static void put_string(JsonWriter *w, const char *s) {
+        PUT_LITERAL(w, "\"");
+        const char *run = s;  // Start of the characters left as is.
+        for (; *s; s++) {
+                unsigned char c = *s;
+                const char *esc;
+                char seq[7];
+                switch (c) {
+                        case '"':
+                                esc = "\\\"";
+                                break;
+                        case '\\':
+                                esc = "\\\\";
+                                break;
+                        case '\b':
+                                esc = "\\b";
+                                break;
+                        case '\f':
+                                esc = "\\f";
+                                break;
+                        case '\n':
+                                esc = "\\n";
+                                break;
+                        case '\r':
+                                esc = "\\r";
+                                break;
+                        case '\t':
+                                esc = "\\t";
+                                break;
+                        default:
+                                if (c >= 0x20) continue;
+                                snprintf(seq, sizeof(seq), "\\u%04X", c);
+                                esc = seq;
+                }
+                put(w, run, s - run);
+                put(w, esc, strlen(esc));
+                run = s + 1;
+        }
+        put(w, run, s - run);
+        PUT_LITERAL(w, "\"");
+}
+
+static void add_int(JsonWriter *w, const char *key, long long i) {
+        put_key(w, key);
+        put_integer(w, i);
+}
+
+static void add_bool(JsonWriter *w, const char *key, bool b) {
+        put_key(w, key);
+        if (b)
+                PUT_LITERAL(w, "true");
+        else
+                PUT_LITERAL(w, "false");
+}
+
+static void add_str(JsonWriter *w, const char *key, const char *s) {
+        if (!s || !is_valid_utf8(s)) return;
+        put_key(w, key);
+        put_string(w, s);
+}
+
+static void begin(JsonWriter *w, const char *key, const char *open) {
+        if (key)
+                put_key(w, key);
+        else
+                put_separator(w);
+        put(w, open, 1);
+        w->first = true;
+}
+
+static void end(JsonWriter *w, const char *close) {
+        put(w, close, 1);
+        w->first = false;
+}
+
+#define BEGIN_OBJ(w, key) begin(w, key, "{")
+#define END_OBJ(w) end(w, "}")
+#define BEGIN_ARRAY(w, key) begin(w, key, "[")
+#define END_ARRAY(w) end(w, "]")
+
+/* Event members, in the same order as json_builder.c */
+
+static void write_sock_info(JsonWriter *w, const SockInfo *sock_info) {
+        // We only fill it when the event is the first of the trace.
+        if (!sock_info->filled) return;
+        char buf[CONS_STR_SIZE];
+
+        BEGIN_OBJ(w, "sock_info");
+        add_str(w, "domain", sock_domain_str(sock_info->domain, buf));
+        add_str(w, "type", sock_type_str(sock_info->type, buf));
+        add_int(w, "protocol", sock_info->protocol);
+        add_bool(w, "SOCK_CLOEXEC", sock_info->sock_cloexec);
+        add_bool(w, "SOCK_NONBLOCK", sock_info->sock_nonblock);
+        END_OBJ(w);
+}
+
+static void write_addr(JsonWriter *w, const Addr *addr) {
+        if (!addr->len) return;
+
+        BEGIN_OBJ(w, "addr");
+        const struct sockaddr *sockaddr =
+            (const struct sockaddr *)&addr->sockaddr_sto;
+        if (sockaddr->sa_family == AF_INET)
+                add_str(w, "sa_family", "AF_INET");
+        else if (sockaddr->sa_family == AF_INET6)
+                add_str(w, "sa_family", "AF_INET6");
+
+        const char *ip, *port;
+        char ip_buf[IP_STR_SIZE], port_buf[PORT_STR_SIZE];
+        if (w->addr_cache) {
+                cached_addr_strs(w->addr_cache, addr, &ip, &port);
+        } else {
+                ip = ip_str(sockaddr, ip_buf);
+                port = port_str(sockaddr, port_buf);
+        }
+        add_str(w, "ip", ip);
+        add_str(w, "port", port);
+        END_OBJ(w);
+}
+
+static void write_send_flags(JsonWriter *w, int flags) {
+        BEGIN_OBJ(w, "flags");
+        add_bool(w, "MSG_CONFIRM", flags & MSG_CONFIRM);
+        add_bool(w, "MSG_DONTROUTE", flags & MSG_DONTROUTE);
+        add_bool(w, "MSG_DONTWAIT", flags & MSG_DONTWAIT);
+        add_bool(w, "MSG_EOR", flags & MSG_EOR);
+        add_bool(w, "MSG_MORE", flags & MSG_MORE);
+        add_bool(w, "MSG_NOSIGNAL", flags & MSG_NOSIGNAL);
+        add_bool(w, "MSG_OOB", flags & MSG_OOB);
+        END_OBJ(w);
+}
+
+static void write_recv_flags(JsonWriter *w, int flags) {
+        BEGIN_OBJ(w, "flags");
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+        add_bool(w, "MSG_CMSG_CLOEXEC", flags & MSG_CMSG_CLOEXEC);
+#else
+        add_bool(w, "MSG_CMSG_CLOEXEC", false);
+#endif
+        add_bool(w, "MSG_DONTWAIT", flags & MSG_DONTWAIT);
+        add_bool(w, "MSG_ERRQUEUE", flags & MSG_ERRQUEUE);
+        add_bool(w, "MSG_OOB", flags & MSG_OOB);
+        add_bool(w, "MSG_PEEK", flags & MSG_PEEK);
+        add_bool(w, "MSG_TRUNC", flags & MSG_TRUNC);
+        add_bool(w, "MSG_WAITALL", flags & MSG_WAITALL);
+        END_OBJ(w);
+}
+
+static void write_timeout(JsonWriter *w, const Timeout *timeout) {
+        BEGIN_OBJ(w, "timeout");
+        add_int(w, "seconds", timeout->seconds);
+        add_int(w, "nanoseconds", timeout->nanoseconds);
+        END_OBJ(w);
+}
+
+static void write_poll_events(JsonWriter *w, const char *key,
+                              const PollEvents *events) {
+        BEGIN_OBJ(w, key);
+        add_bool(w, "POLLIN", events->pollin);
+        add_bool(w, "POLLPRI", events->pollpri);
+        add_bool(w, "POLLOUT", events->pollout);
+        add_bool(w, "POLLRDHUP", events->pollrdhup);
+        add_bool(w, "POLLERR", events->pollerr);
+        add_bool(w, "POLLHUP", events->pollhup);
+        add_bool(w, "POLLNVAL", events->pollnval);
+        END_OBJ(w);
+}
+
+static void write_select_events(JsonWriter *w, const char *key,
+                                const SelectEvents *events) {
+        BEGIN_OBJ(w, key);
+        add_bool(w, "READ", events->read);
+        add_bool(w, "WRITE", events->write);
+        add_bool(w, "EXCEPT", events->except);
+        END_OBJ(w);
+}
+
+static void write_epoll_events(JsonWriter *w, const char *key,
+                               uint32_t events) {
+        BEGIN_OBJ(w, key);
+        add_bool(w, "EPOLLIN", events & EPOLLIN);
+        add_bool(w, "EPOLLOUT", events & EPOLLOUT);
+        add_bool(w, "EPOLLRDHUP", events & EPOLLRDHUP);
+        add_bool(w, "EPOLLPRI", events & EPOLLPRI);
+        add_bool(w, "EPOLLERR", events & EPOLLERR);
+        add_bool(w, "EPOLLHUP", events & EPOLLHUP);
+        add_bool(w, "EPOLLET", events & EPOLLET);
+        add_bool(w, "EPOLLONESHOT", events & EPOLLONESHOT);
+        add_bool(w, "EPOLLWAKEUP", events & EPOLLWAKEUP);
+        END_OBJ(w);
+}
+
+static void write_iovec(JsonWriter *w, const Iovec *iovec) {
+        BEGIN_OBJ(w, "iovec");
+        add_int(w, "iovec_count", iovec->iovec_count);
+        BEGIN_ARRAY(w, "iovec_sizes");
+        for (int i = 0; i < iovec->iovec_count; i++) {
+                put_separator(w);
+                put_integer(w, iovec_sizes(iovec)[i]);
+        }
+        END_ARRAY(w);
+        END_OBJ(w);
+}
+
+static void write_control_data(JsonWriter *w, const Msghdr *msg) {
+        BEGIN_ARRAY(w, "control_data");
+        // Only the first header, see build_control_data() in json_builder.c.
+        const struct cmsghdr *cmsg = first_cmsghdr(msg);
+        if (cmsg) {
+                BEGIN_OBJ(w, NULL);
+                add_int(w, "cmsg_level", cmsg->cmsg_level);
+                add_int(w, "cmsg_type", cmsg->cmsg_type);
+                END_OBJ(w);
+        }
+        END_ARRAY(w);
+}
+
+static void write_msghdr(JsonWriter *w, const char *key, const Msghdr *msg) {
+        BEGIN_OBJ(w, key);
+        // Flags are only for recvmsg()
+        if (msg->flags) write_recv_flags(w, msg->flags);
+        write_iovec(w, &msg->iovec);
+        add_int(w, "control_data_len", msg->control_len);
+        write_control_data(w, msg);
+        END_OBJ(w);
+}
+
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+static void write_mmsghdr_vec(JsonWriter *w, const Mmsghdr *mmsghdr_vec,
+                              int mmsghdr_count) {
+        BEGIN_ARRAY(w, "mmsghdr_vec");
+        for (int i = 0; i < mmsghdr_count; i++) {
+                const Mmsghdr *mmsghdr = (mmsghdr_vec + i);
+                BEGIN_OBJ(w, NULL);
+                add_int(w, "transmitted_bytes", mmsghdr->bytes_transmitted);
+                write_msghdr(w, "msghdr", &mmsghdr->msghdr);
+                END_OBJ(w);
+        }
+        END_ARRAY(w);
+}
+#endif
+
+static void write_optval(JsonWriter *w, const Sockopt *sockopt) {
+        const void *optval = sockopt_val(sockopt);
+        switch (sockopt->level) {
+                case SOL_SOCKET:
+                        switch (sockopt->optname) {
+                                case SO_RCVTIMEO:
+                                case SO_SNDTIMEO: {
+                                        const struct timeval *tv =
+                                            (const struct timeval *)optval;
+                                        BEGIN_OBJ(w, "optval");
+                                        add_int(w, "tv_sec", tv->tv_sec);
+                                        add_int(w, "tv_usec", tv->tv_usec);
+                                        END_OBJ(w);
+                                        return;
+                                }
+                                case SO_LINGER: {
+                                        const struct linger *l =
+                                            (const struct linger *)optval;
+                                        BEGIN_OBJ(w, "optval");
+                                        add_int(w, "l_onoff", l->l_onoff);
+                                        add_int(w, "l_linger", l->l_linger);
+                                        END_OBJ(w);
+                                        return;
+                                }
+                                case SO_RCVBUF:
+                                case SO_SNDBUF:
+                                case SO_ERROR:
+                                        add_int(w, "optval",
+                                                *((const int *)optval));
+                                        return;
+                                case SO_KEEPALIVE:
+                                case SO_DEBUG:
+                                case SO_REUSEADDR:
+                                        add_bool(w, "optval",
+                                                 *((const int *)optval));
+                                        return;
+                        }
+                        break;
+                case IPPROTO_TCP:
+                        switch (sockopt->optname) {
+                                case TCP_KEEPINTVL:
+                                case TCP_KEEPIDLE:
+                                        add_int(w, "optval",
+                                                *((const int *)optval));
+                                        return;
+                                case TCP_NODELAY:
+                                        add_bool(w, "optval",
+                                                 *((const int *)optval));
+                                        return;
+                        }
+                        break;
+                case IPPROTO_IPV6:
+                        switch (sockopt->optname) {
+                                case IPV6_V6ONLY:
+                                        add_bool(w, "optval",
+                                                 *((const int *)optval));
+                                        return;
+                        }
+                        break;
+        }
+}
+
+static void write_sockopt(JsonWriter *w, const Sockopt *sockopt) {
+        char buf[CONS_STR_SIZE];
+        add_str(w, "level", sockopt_level_str(sockopt->level, buf));
+        add_str(w, "optname",
+                sockoptname_str(sockopt->level, sockopt->optname, buf));
+        add_int(w, "optlen", sockopt->optlen);
+        if (sockopt->optlen) write_optval(w, sockopt);
+}
+
+static void write_fd_flags(JsonWriter *w, int flags) {
+        add_bool(w, "O_CLOEXEC", flags & O_CLOEXEC);
+}
+
+static void write_fl_flags(JsonWriter *w, int flags) {
+        add_bool(w, "O_APPEND", flags & O_APPEND);
+        add_bool(w, "O_ASYNC", flags & O_ASYNC);
+        add_bool(w, "O_DIRECT", flags & O_DIRECT);
+        add_bool(w, "O_NOATIME", flags & O_NOATIME);
+        add_bool(w, "O_NONBLOCK", flags & O_NONBLOCK);
+}
+
+static void write_fcntl(JsonWriter *w, const SockEvFcntl *ev) {
+        char buf[CONS_STR_SIZE];
+        add_str(w, "cmd", fcntl_cmd_str(ev->cmd, buf));
+
+        switch (ev->cmd) {
+                case F_GETFD:
+                        write_fd_flags(w, ev->super.return_value);
+                        break;
+                case F_GETFL:
+                        write_fl_flags(w, ev->super.return_value);
+                        break;
+                case F_GETOWN:
+                case F_GETSIG:
+                case F_GETLEASE:
+                case F_GETPIPE_SZ:
+                        break;  // Arg: void
+                case F_SETFD:
+                        write_fd_flags(w, ev->arg);
+                        break;
+                case F_SETFL:
+                        write_fl_flags(w, ev->arg);
+                        break;
+                case F_DUPFD:
+                case F_DUPFD_CLOEXEC:
+                case F_SETOWN:
+                case F_SETSIG:
+                case F_SETLEASE:
+                case F_NOTIFY:
+                case F_SETPIPE_SZ:  // Arg: int
+                        add_int(w, "arg", ev->arg);
+                        break;
+        }
+        if (ev->cmd == F_DUPFD || ev->cmd == F_DUPFD_CLOEXEC)
+                write_sock_info(w, &ev->sock_info);
+}
+
+static void write_epoll_ctl(JsonWriter *w, const SockEvEpollCtl *ev) {
+        const char *op = NULL;
+        switch (ev->op) {
+                case EPOLL_CTL_ADD:
+                        op = "EPOLL_CTL_ADD";
+                        break;
+                case EPOLL_CTL_MOD:
+                        op = "EPOLL_CTL_MOD";
+                        break;
+                case EPOLL_CTL_DEL:
+                        op = "EPOLL_CTL_DEL";
+                        break;
+        }
+        add_str(w, "op", op);
+        write_epoll_events(w, "requested_events", ev->requested_events);
+}
+
+static void write_coalesced(JsonWriter *w, const SockEvCoalesced *ev) {
+        add_str(w, "event", string_from_sock_event_type(ev->ev_type));
+        add_int(w, "count", ev->count);
+        add_int(w, "bytes", ev->bytes);
+        add_int(w, "min_bytes", ev->min_bytes);
+        add_int(w, "max_bytes", ev->max_bytes);
+        add_int(w, "last_timestamp_usec", ev->last_timestamp_ns / 1000);
+        if (ev->ev_type == SOCK_EV_SEND) write_send_flags(w, ev->flags);
+        if (ev->ev_type == SOCK_EV_RECV) write_recv_flags(w, ev->flags);
+}
+
+/* Fields past those of glibc are only written if the kernel filled them, i.e.
+ * if they fit in len. Unset 64-bit rates (~0) show up as -1. */
+#define ADD_IF(key, field) \
+        if (TCP_INFO_HAS(len, field)) add_int(w, key, i->field)
+
+static void write_tcp_info(JsonWriter *w, const TcpInfo *i, size_t len,
+                           TcpLimit limited_by) {
+        add_int(w, "state", i->tcpi_state);
+        add_int(w, "ca_state", i->tcpi_ca_state);
+        add_int(w, "retransmits", i->tcpi_retransmits);
+        add_int(w, "probes", i->tcpi_probes);
+        add_int(w, "backoff", i->tcpi_backoff);
+        add_int(w, "options", i->tcpi_options);
+        add_int(w, "snd_wscale", i->tcpi_snd_wscale);
+        add_int(w, "rcv_wscale", i->tcpi_rcv_wscale);
+
+        add_int(w, "rto", i->tcpi_rto);
+        add_int(w, "ato", i->tcpi_ato);
+        add_int(w, "snd_mss", i->tcpi_snd_mss);
+        add_int(w, "rcv_mss", i->tcpi_rcv_mss);
+
+        add_int(w, "unacked", i->tcpi_unacked);
+        add_int(w, "sacked", i->tcpi_sacked);
+        add_int(w, "lost", i->tcpi_lost);
+        add_int(w, "retrans", i->tcpi_retrans);
+        add_int(w, "fackets", i->tcpi_fackets);
+
+        /* Times */
+        add_int(w, "last_data_sent", i->tcpi_last_data_sent);
+        add_int(w, "last_ack_sent", i->tcpi_last_ack_sent);
+        add_int(w, "last_data_recv", i->tcpi_last_data_recv);
+        add_int(w, "last_ack_recv", i->tcpi_last_ack_recv);
+
+        /* Metrics */
+        add_int(w, "pmtu", i->tcpi_pmtu);
+        add_int(w, "rcv_ssthresh", i->tcpi_rcv_ssthresh);
+        add_int(w, "rtt", i->tcpi_rtt);
+        add_int(w, "rttvar", i->tcpi_rttvar);
+        add_int(w, "snd_ssthresh", i->tcpi_snd_ssthresh);
+        add_int(w, "snd_cwnd", i->tcpi_snd_cwnd);
+        add_int(w, "advmss", i->tcpi_advmss);
+        add_int(w, "reordering", i->tcpi_reordering);
+
+        add_int(w, "rcv_rtt", i->tcpi_rcv_rtt);
+        add_int(w, "rcv_space", i->tcpi_rcv_space);
+
+        add_int(w, "total_retrans", i->tcpi_total_retrans);
+
+        ADD_IF("pacing_rate", tcpi_pacing_rate);
+        ADD_IF("max_pacing_rate", tcpi_max_pacing_rate);
+        ADD_IF("bytes_acked", tcpi_bytes_acked);
+        ADD_IF("bytes_received", tcpi_bytes_received);
+        ADD_IF("segs_out", tcpi_segs_out);
+        ADD_IF("segs_in", tcpi_segs_in);
+
+        ADD_IF("notsent_bytes", tcpi_notsent_bytes);
+        ADD_IF("min_rtt", tcpi_min_rtt);
+        ADD_IF("data_segs_in", tcpi_data_segs_in);
+        ADD_IF("data_segs_out", tcpi_data_segs_out);
+
+        ADD_IF("delivery_rate", tcpi_delivery_rate);
+        if (TCP_INFO_HAS(len, tcpi_delivery_rate))
+                add_bool(w, "delivery_rate_app_limited",
+                         i->tcpi_delivery_rate_app_limited);
+
+        ADD_IF("busy_time", tcpi_busy_time);
+        ADD_IF("rwnd_limited", tcpi_rwnd_limited);
+        ADD_IF("sndbuf_limited", tcpi_sndbuf_limited);
+
+        ADD_IF("delivered", tcpi_delivered);
+        ADD_IF("delivered_ce", tcpi_delivered_ce);
+
+        ADD_IF("bytes_sent", tcpi_bytes_sent);
+        ADD_IF("bytes_retrans", tcpi_bytes_retrans);
+        ADD_IF("dsack_dups", tcpi_dsack_dups);
+        ADD_IF("reord_seen", tcpi_reord_seen);
+
+        ADD_IF("rcv_ooopack", tcpi_rcv_ooopack);
+
+        ADD_IF("snd_wnd", tcpi_snd_wnd);
+        ADD_IF("rcv_wnd", tcpi_rcv_wnd);
+        ADD_IF("rehash", tcpi_rehash);
+        ADD_IF("total_rto", tcpi_total_rto);
+        ADD_IF("total_rto_recoveries", tcpi_total_rto_recoveries);
+        ADD_IF("total_rto_time", tcpi_total_rto_time);
+
+        if (limited_by != TCP_LIMIT_UNKNOWN)
+                add_str(w, "limited_by", string_from_tcp_limit(limited_by));
+}
+
+#undef ADD_IF
+
+static void write_summary(JsonWriter *w, const SockEvSummary *ev) {
+        const SockSummary *sum = ev->summary;
+        write_sock_info(w, &ev->sock_info);
+        write_addr(w, &sum->peer);
+        add_int(w, "bytes_sent", ev->bytes_sent);
+        add_int(w, "bytes_received", ev->bytes_received);
+
+        BEGIN_OBJ(w, "calls");
+        for (int i = 0; i <= SOCK_EV_TCP_INFO; i++)
+                if (sum->calls[i])
+                        add_int(w, string_from_sock_event_type(i),
+                                sum->calls[i]);
+        END_OBJ(w);
+
+        BEGIN_OBJ(w, "errors");
+        for (int i = 0; i < SUMMARY_ERRNOS && sum->errors[i].count; i++) {
+                char buf[CONS_STR_SIZE];
+                add_int(w, errno_str(sum->errors[i].err, buf),
+                        sum->errors[i].count);
+        }
+        if (sum->other_errors) add_int(w, "others", sum->other_errors);
+        END_OBJ(w);
+
+        if (sum->first_byte_ns)
+                add_int(w, "connect_to_first_byte_usec",
+                        (sum->first_byte_ns - sum->start_ns) / 1000);
+        if (sum->tcp_info_len) {
+                BEGIN_OBJ(w, "tcp_info");
+                write_tcp_info(w, &sum->tcp_info, sum->tcp_info_len,
+                               sum->tcp_limited_by);
+                END_OBJ(w);
+        }
+}
+
+static void write_histogram(JsonWriter *w, const char *key,
+                            const Histogram *h) {
+        uint64_t count = h->count;
+        BEGIN_OBJ(w, key);
+        add_int(w, "count", count);
+        add_int(w, "mean_ns", count ? h->sum / count : 0);
+        add_int(w, "max_ns", h->max);
+        add_int(w, "p50_ns", hist_percentile(h, 50));
+        add_int(w, "p90_ns", hist_percentile(h, 90));
+        add_int(w, "p99_ns", hist_percentile(h, 99));
+        add_int(w, "p999_ns", hist_percentile(h, 99.9));
+
+        BEGIN_ARRAY(w, "buckets");
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+                uint64_t n = h->counts[i];
+                if (!n) continue;
+                BEGIN_ARRAY(w, NULL);
+                put_separator(w);
+                put_integer(w, hist_bucket_low(i));
+                put_separator(w);
+                put_integer(w, n);
+                END_ARRAY(w);
+        }
+        END_ARRAY(w);
+        END_OBJ(w);
+}
+
+static void write_latency(JsonWriter *w, Histogram *const *histograms) {
+        for (int i = 0; i < LAT_CALLS; i++)
+                if (histograms[i])
+                        write_histogram(w, string_from_sock_event_type(i),
+                                        histograms[i]);
+}
+
+static void write_details(JsonWriter *w, const SockEvent *ev) {
+        const AnySockEvent *any = (const AnySockEvent *)ev;
+        switch (ev->type) {
+                case SOCK_EV_SOCKET:
+                        write_sock_info(w, &any->socket.sock_info);
+                        break;
+                case SOCK_EV_FORKED_SOCKET:
+                        write_sock_info(w, &any->forked_socket.sock_info);
+                        break;
+                case SOCK_EV_GHOST_SOCKET:
+                        write_sock_info(w, &any->ghost_socket.sock_info);
+                        break;
+                case SOCK_EV_BIND:
+                        write_addr(w, &any->bind.addr);
+                        break;
+                case SOCK_EV_CONNECT:
+                        write_addr(w, &any->connect.addr);
+                        break;
+                case SOCK_EV_SHUTDOWN:
+                        add_bool(w, "SHUT_RD", any->shutdown.shut_rd);
+                        add_bool(w, "SHUT_WR", any->shutdown.shut_wr);
+                        break;
+                case SOCK_EV_LISTEN:
+                        add_int(w, "backlog", any->listen.backlog);
+                        break;
+                case SOCK_EV_ACCEPT:
+                        write_addr(w, &any->accept.addr);
+                        write_sock_info(w, &any->accept.sock_info);
+                        break;
+                case SOCK_EV_ACCEPT4:
+                        write_addr(w, &any->accept4.addr);
+                        add_int(w, "flags", any->accept4.flags);
+                        write_sock_info(w, &any->accept4.sock_info);
+                        break;
+                case SOCK_EV_GETSOCKOPT:
+                        write_sockopt(w, &any->getsockopt.sockopt);
+                        break;
+                case SOCK_EV_SETSOCKOPT:
+                        write_sockopt(w, &any->setsockopt.sockopt);
+                        break;
+                case SOCK_EV_SEND:
+                        add_int(w, "bytes", any->send.bytes);
+                        write_send_flags(w, any->send.flags);
+                        break;
+                case SOCK_EV_RECV:
+                        add_int(w, "bytes", any->recv.bytes);
+                        write_recv_flags(w, any->recv.flags);
+                        break;
+                case SOCK_EV_SENDTO:
+                        add_int(w, "bytes", any->sendto.bytes);
+                        write_send_flags(w, any->sendto.flags);
+                        write_addr(w, &any->sendto.addr);
+                        break;
+                case SOCK_EV_RECVFROM:
+                        add_int(w, "bytes", any->recvfrom.bytes);
+                        write_recv_flags(w, any->recvfrom.flags);
+                        write_addr(w, &any->recvfrom.addr);
+                        break;
+                case SOCK_EV_SENDMSG:
+                        add_int(w, "bytes", any->sendmsg.bytes);
+                        write_send_flags(w, any->sendmsg.flags);
+                        write_msghdr(w, "msghdr", &any->sendmsg.msghdr);
+                        break;
+                case SOCK_EV_RECVMSG:
+                        add_int(w, "bytes", any->recvmsg.bytes);
+                        write_recv_flags(w, any->recvmsg.flags);
+                        write_msghdr(w, "msghdr", &any->recvmsg.msghdr);
+                        break;
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+                case SOCK_EV_SENDMMSG:
+                        add_int(w, "bytes", any->sendmmsg.bytes);
+                        write_send_flags(w, any->sendmmsg.flags);
+                        add_int(w, "mmsghdr_count", any->sendmmsg.mmsghdr_count);
+                        write_mmsghdr_vec(w, any->sendmmsg.mmsghdr_vec,
+                                          any->sendmmsg.mmsghdr_count);
+                        break;
+                case SOCK_EV_RECVMMSG:
+                        add_int(w, "bytes", any->recvmmsg.bytes);
+                        write_recv_flags(w, any->recvmmsg.flags);
+                        add_int(w, "mmsghdr_count", any->recvmmsg.mmsghdr_count);
+                        write_mmsghdr_vec(w, any->recvmmsg.mmsghdr_vec,
+                                          any->recvmmsg.mmsghdr_count);
+                        write_timeout(w, &any->recvmmsg.timeout);
+                        break;
+#endif
+                case SOCK_EV_GETSOCKNAME:
+                        write_addr(w, &any->getsockname.addr);
+                        break;
+                case SOCK_EV_GETPEERNAME:
+                        write_addr(w, &any->getpeername.addr);
+                        break;
+                case SOCK_EV_SOCKATMARK:
+                        break;
+                case SOCK_EV_ISFDTYPE:
+                        add_int(w, "fdtype", any->isfdtype.fdtype);
+                        break;
+                case SOCK_EV_WRITE:
+                        add_int(w, "bytes", any->write.bytes);
+                        break;
+                case SOCK_EV_READ:
+                        add_int(w, "bytes", any->read.bytes);
+                        break;
+                case SOCK_EV_CLOSE:
+                        break;
+                case SOCK_EV_DUP:
+                        write_sock_info(w, &any->dup.sock_info);
+                        break;
+                case SOCK_EV_DUP2:
+                        add_int(w, "newfd", any->dup2.newfd);
+                        write_sock_info(w, &any->dup2.sock_info);
+                        break;
+                case SOCK_EV_DUP3:
+                        add_int(w, "newfd", any->dup3.newfd);
+                        add_bool(w, "O_CLOEXEC", any->dup3.o_cloexec);
+                        write_sock_info(w, &any->dup3.sock_info);
+                        break;
+                case SOCK_EV_WRITEV:
+                        add_int(w, "bytes", any->writev.bytes);
+                        write_iovec(w, &any->writev.iovec);
+                        break;
+                case SOCK_EV_READV:
+                        add_int(w, "bytes", any->readv.bytes);
+                        write_iovec(w, &any->readv.iovec);
+                        break;
+                case SOCK_EV_IOCTL: {
+                        char buf[CONS_STR_SIZE];
+                        add_str(w, "request",
+                                ioctl_request_str(any->ioctl.request, buf));
+                        break;
+                }
+                case SOCK_EV_SENDFILE:
+                        add_int(w, "bytes", any->sendfile.bytes);
+                        break;
+                case SOCK_EV_POLL:
+                        write_timeout(w, &any->poll.timeout);
+                        write_poll_events(w, "requested_events",
+                                          &any->poll.requested_events);
+                        write_poll_events(w, "returned_events",
+                                          &any->poll.returned_events);
+                        break;
+                case SOCK_EV_PPOLL:
+                        write_timeout(w, &any->ppoll.timeout);
+                        write_poll_events(w, "requested_events",
+                                          &any->ppoll.requested_events);
+                        write_poll_events(w, "returned_events",
+                                          &any->ppoll.returned_events);
+                        break;
+                case SOCK_EV_SELECT:
+                        write_timeout(w, &any->select.timeout);
+                        write_select_events(w, "requested_events",
+                                            &any->select.requested_events);
+                        write_select_events(w, "returned_events",
+                                            &any->select.returned_events);
+                        break;
+                case SOCK_EV_PSELECT:
+                        write_timeout(w, &any->pselect.timeout);
+                        write_select_events(w, "requested_events",
+                                            &any->pselect.requested_events);
+                        write_select_events(w, "returned_events",
+                                            &any->pselect.returned_events);
+                        break;
+                case SOCK_EV_FCNTL:
+                        write_fcntl(w, &any->fcntl);
+                        break;
+                case SOCK_EV_EPOLL_CTL:
+                        write_epoll_ctl(w, &any->epoll_ctl);
+                        break;
+                case SOCK_EV_EPOLL_WAIT:
+                        add_int(w, "timeout", any->epoll_wait.timeout);
+                        write_epoll_events(w, "returned_events",
+                                           any->epoll_wait.returned_events);
+                        break;
+                case SOCK_EV_EPOLL_PWAIT:
+                        add_int(w, "timeout", any->epoll_pwait.timeout);
+                        write_epoll_events(w, "returned_events",
+                                           any->epoll_pwait.returned_events);
+                        break;
+                case SOCK_EV_FDOPEN:
+                        add_str(w, "mode", any->fdopen.mode);
+                        break;
+                case SOCK_EV_COALESCED:
+                        write_coalesced(w, &any->coalesced);
+                        break;
+                case SOCK_EV_SKIPPED:
+                        add_int(w, "events", any->skipped.events);
+                        add_int(w, "bytes_sent", any->skipped.bytes_sent);
+                        add_int(w, "bytes_received",
+                                any->skipped.bytes_received);
+                        break;
+                case SOCK_EV_SUMMARY:
+                        write_summary(w, &any->summary);
+                        break;
+                case SOCK_EV_LATENCY:
+                        write_latency(w, any->latency.histograms);
+                        break;
+                case SOCK_EV_TCP_INFO: {
+                        TcpInfo info;
+                        tcp_info_of(&any->tcp_info, &info);
+                        write_tcp_info(w, &info, any->tcp_info.len,
+                                       any->tcp_info.limited_by);
+                        break;
+                }
+        }
+}
+
+static bool is_fake_call(SockEventType type) {
+        return type == SOCK_EV_FORKED_SOCKET || type == SOCK_EV_GHOST_SOCKET ||
+               type == SOCK_EV_SKIPPED || type == SOCK_EV_SUMMARY ||
+               type == SOCK_EV_LATENCY || type == SOCK_EV_TCP_INFO;
+}
+
+/* Public functions */
+
+const char *sock_ev_json(const SockEvent *ev, AddrStrCache *addr_cache,
+                         size_t *len) {
+        JsonWriter *w = get_writer();
+        w->len = 0;
+        w->first = true;
+        w->addr_cache = addr_cache;
+
+        BEGIN_OBJ(w, NULL);
+        add_str(w, "type", string_from_sock_event_type(ev->type));
+        add_int(w, "timestamp_usec", ev->timestamp_ns / 1000);
+        add_int(w, "return_value", ev->return_value);
+        add_bool(w, "success", ev->success);
+        if (!ev->success) {
+                char buf[CONS_STR_SIZE];
+                add_str(w, "errno", errno_str(ev->err, buf));
+        }
+        add_int(w, "thread_id", ev->thread_id);
+        add_bool(w, "fake_call", is_fake_call(ev->type));
+
+        BEGIN_OBJ(w, "details");
+        write_details(w, ev);
+        END_OBJ(w);
+        END_OBJ(w);
+
+        w->str[w->len] = '\0';
+        if (len) *len = w->len;
+        return w->str;
+}
+
+const char *histograms_json(Histogram *const *histograms, size_t *len) {
+        JsonWriter *w = get_writer();
+        w->len = 0;
+        w->first = true;
+
+        BEGIN_OBJ(w, NULL);
+        write_latency(w, histograms);
+        END_OBJ(w);
+
+        w->str[w->len] = '\0';
+        if (len) *len = w->len;
+        return w->str;
+}
+
+const char *threads_json(const TcThreadCount *threads, size_t count,
+                         unsigned long other_threads,
+                         unsigned long other_events, size_t *len) {
+        JsonWriter *w = get_writer();
+        w->len = 0;
+        w->first = true;
+
+        BEGIN_OBJ(w, NULL);
+        BEGIN_ARRAY(w, "threads");
+        for (size_t i = 0; i < count; i++) {
+                BEGIN_OBJ(w, NULL);
+                add_int(w, "tid", threads[i].tid);
+                add_int(w, "events", threads[i].events);
+                add_bool(w, "terminated", threads[i].terminated);
+                END_OBJ(w);
+        }
+        END_ARRAY(w);
+        if (other_threads) {
+                BEGIN_OBJ(w, "other_terminated_threads");
+                add_int(w, "count", other_threads);
+                add_int(w, "events", other_events);
+                END_OBJ(w);
+        }
+        END_OBJ(w);
+
+        w->str[w->len] = '\0';
+        if (len) *len = w->len;
+        return w->str;
+}
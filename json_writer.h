@@ -0,0 +1,28 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stddef.h>
+#include "sock_events.h"
+#include "thread_cache.h"
+
+/* Streaming JSON encoder. It writes the exact same bytes as
+ * alloc_sock_ev_json() in json_builder.c, without building a Jansson tree.
+ * Events are encoded into a per-thread buffer which is reused across calls,
+ * so the encoder does not allocate once the buffer has grown large enough.
+ *
+ * The returned string is valid until the next call from the same thread. Its
+ * length is stored in len, if not NULL. Addresses are formatted through
+ * addr_cache, the cache of the socket of the event, unless it is NULL. */
+const char *sock_ev_json(const SockEvent *ev, AddrStrCache *addr_cache,
+                         size_t *len);
+
+// Same, for the details of a SOCK_EV_LATENCY, i.e. histograms by event type.
+const char *histograms_json(Histogram *const *histograms, size_t *len);
+
+// Same, for the event counters of the threads. The other threads are those
+// only counted as a whole.
+const char *threads_json(const TcThreadCount *threads, size_t count,
+                         unsigned long other_threads,
+                         unsigned long other_events, size_t *len);
+
+#endif
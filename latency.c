@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+
+#include "latency.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include "init.h"
+#include "json_writer.h"
+#include "lib.h"
+#include "logger.h"
+#include "thread_registry.h"
+#include "timestamps.h"
+
+typedef struct {
+        ThreadRecord super;
+        Histogram *_Atomic histograms[LAT_CALLS];  // Allocated on first use.
+} LatThread;
+
+typedef struct {
+        uint64_t start_ns;  // 0 outside of a call.
+        uint64_t ns;
+        bool done;     // ns holds the duration of the last call.
+        bool counted;  // The call is in the histograms of the thread.
+} LatCall;
+
+static void release_thread(ThreadRecord *rec);
+
+static ThreadRegistry threads = TR_INITIALIZER(LatThread, my_calloc,
+                                               release_thread);
+static __thread ThreadRecord *my_thread = NULL;
+static __thread LatCall last_call;
+// Histograms of the terminated threads.
+static Histogram *exited[LAT_CALLS];
+// Serializes the release of a thread with lat_dump(), which would otherwise
+// count its histograms twice or not at all.
+static pthread_mutex_t exited_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The histograms of a terminated thread move to the process total, and its
+// record, histograms included, is left for a new thread.
+static void release_thread(ThreadRecord *rec) {
+        LatThread *t = (LatThread *)rec;
+        pthread_mutex_lock(&exited_mutex);
+        for (int i = 0; i < LAT_CALLS; i++) {
+                Histogram *h = atomic_load(&t->histograms[i]);
+                if (!h) continue;
+                if (!exited[i])
+                        exited[i] = (Histogram *)my_calloc(sizeof(Histogram));
+                hist_merge(exited[i], h);
+                hist_clear(h);
+        }
+        pthread_mutex_unlock(&exited_mutex);
+}
+
+static LatThread *get_thread(void) {
+        if (my_thread) return (LatThread *)my_thread;
+        return (LatThread *)tr_adopt(&threads, &my_thread);
+}
+
+static bool is_blocking(SockEventType type) {
+        switch (type) {
+                case SOCK_EV_CONNECT:
+                case SOCK_EV_ACCEPT:
+                case SOCK_EV_ACCEPT4:
+                case SOCK_EV_SEND:
+                case SOCK_EV_RECV:
+                case SOCK_EV_SENDTO:
+                case SOCK_EV_RECVFROM:
+                case SOCK_EV_SENDMSG:
+                case SOCK_EV_RECVMSG:
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+                case SOCK_EV_SENDMMSG:
+                case SOCK_EV_RECVMMSG:
+#endif
+                case SOCK_EV_WRITE:
+                case SOCK_EV_READ:
+                case SOCK_EV_CLOSE:  // With SO_LINGER.
+                case SOCK_EV_WRITEV:
+                case SOCK_EV_READV:
+                case SOCK_EV_SENDFILE:
+                case SOCK_EV_POLL:
+                case SOCK_EV_PPOLL:
+                case SOCK_EV_SELECT:
+                case SOCK_EV_PSELECT:
+                case SOCK_EV_EPOLL_WAIT:
+                case SOCK_EV_EPOLL_PWAIT:
+                        return true;
+                default:
+                        return false;
+        }
+}
+
+static void count_call(SockEventType type, uint64_t ns) {
+        LatThread *t = get_thread();
+        Histogram *h = atomic_load_explicit(&t->histograms[type],
+                                            memory_order_relaxed);
+        if (!h) {
+                h = (Histogram *)my_calloc(sizeof(Histogram));
+                // Published zeroed for lat_dump().
+                atomic_store_explicit(&t->histograms[type], h,
+                                      memory_order_release);
+        }
+        hist_record(h, ns);
+}
+
+/* Public functions */
+
+void lat_start(void) {
+        if (conf_opt_e <= 0) return;
+        last_call.done = false;
+        last_call.start_ns = ts_now_ns();
+}
+
+void lat_end(void) {
+        if (!last_call.start_ns) return;
+        last_call.ns = ts_now_ns() - last_call.start_ns;
+        last_call.start_ns = 0;
+        last_call.done = true;
+        last_call.counted = false;
+}
+
+bool lat_take(SockEventType type, uint64_t *ns) {
+        if (!last_call.done || !is_blocking(type)) return false;
+        if (!last_call.counted) {
+                count_call(type, last_call.ns);
+                last_call.counted = true;
+        }
+        *ns = last_call.ns;
+        return true;
+}
+
+static void merge_into(Histogram **merged, int i, const Histogram *h) {
+        if (!h) return;
+        if (!merged[i]) merged[i] = (Histogram *)my_calloc(sizeof(Histogram));
+        hist_merge(merged[i], h);
+}
+
+void lat_dump(const char *path) {
+        Histogram **merged =
+            (Histogram **)my_calloc(LAT_CALLS * sizeof(Histogram *));
+        pthread_mutex_lock(&exited_mutex);
+        for (int i = 0; i < LAT_CALLS; i++) merge_into(merged, i, exited[i]);
+        // Records not in use are empty.
+        for (ThreadRecord *r = atomic_load(&threads.records); r; r = r->next)
+                for (int i = 0; i < LAT_CALLS; i++)
+                        merge_into(merged, i,
+                                   atomic_load_explicit(
+                                       &((LatThread *)r)->histograms[i],
+                                       memory_order_acquire));
+        pthread_mutex_unlock(&exited_mutex);
+
+        const char *json = histograms_json(merged, NULL);
+        if (append_string_to_file(json, path)) LOG_FUNC_ERROR;
+        for (int i = 0; i < LAT_CALLS; i++) free(merged[i]);
+        free(merged);
+}
+
+/* Only the calling thread survives fork(), and its histograms are the ones of
+ * its parent thread. The records of the other threads are left for new
+ * threads. */
+void lat_reset(void) {
+        pthread_mutex_init(&exited_mutex, NULL);
+        for (int i = 0; i < LAT_CALLS; i++) {
+                free(exited[i]);
+                exited[i] = NULL;
+        }
+        for (ThreadRecord *r = atomic_load(&threads.records); r; r = r->next) {
+                LatThread *t = (LatThread *)r;
+                for (int i = 0; i < LAT_CALLS; i++) {
+                        Histogram *h = atomic_load(&t->histograms[i]);
+                        if (h) hist_clear(h);
+                }
+        }
+        tr_reset(&threads, my_thread);
+        last_call.done = false;
+}
@@ -0,0 +1,28 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "histogram.h"
+#include "sock_events.h"
+
+/* Time spent in the blocking calls (connect(), accept(), send(), recv(),
+ * poll(), epoll_wait(), select(), ...), with -e. The overrides bracket the
+ * original call with lat_start() & lat_end(). The duration is then claimed by
+ * the events of the call with lat_take(), which feeds the histograms of the
+ * process. These are kept per thread, without locks, and merged when they are
+ * dumped. Those of terminated threads join a process total, and their records
+ * are reused by new threads. Histograms are indexed by event type. */
+
+#define LAT_CALLS (SOCK_EV_TCP_INFO + 1)
+
+void lat_start(void);
+void lat_end(void);
+// Duration of the last call of the thread, if it produced events of this
+// type. May be claimed by several events, e.g. one per socket of a poll().
+bool lat_take(SockEventType type, uint64_t *ns);
+
+void lat_dump(const char *path);  // Write the process histograms as JSON.
+void lat_reset(void);             // Forget the parent's threads, after fork().
+
+#endif
@@ -1,10 +1,10 @@
 #define _GNU_SOURCE  // For program_invocation_name
 
 #include <dirent.h>
-#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,21 +18,14 @@
 #endif
 #include "init.h"
 #include "lib.h"
+#include "libc_symbols.h"
 #include "logger.h"
 #include "string_builders.h"
 
 // We don't want to call the getsockopt we defined as it would be intercepted.
-typedef int (*orig_getsockopt_type)(int sockfd, int level, int optname,
-                                    void *optval, socklen_t *optlen);
-
-orig_getsockopt_type orig_getsockopt;
-
 int my_getsockopt(int sockfd, int level, int optname, void *optval,
                   socklen_t *optlen) {
-        if (!orig_getsockopt)
-                orig_getsockopt =
-                    (orig_getsockopt_type)dlsym(RTLD_NEXT, "getsockopt");
-        int ret = orig_getsockopt(sockfd, level, optname, optval, optlen);
+        int ret = ORIG(getsockopt)(sockfd, level, optname, optval, optlen);
         if (ret) goto error;
         return ret;
 error:
@@ -41,13 +34,8 @@ error:
         return ret;
 }
 
-typedef int (*orig_fcntl_type)(int fd, int cmd, ...);
-orig_fcntl_type orig_fcntl;
-
 bool is_fd(int fd) {
-        if (!orig_fcntl)
-                orig_fcntl = (orig_fcntl_type)dlsym(RTLD_NEXT, "fcntl");
-        return orig_fcntl(fd, F_GETFD) != -1 || errno != EBADF;
+        return ORIG(fcntl)(fd, F_GETFD) != -1 || errno != EBADF;
 }
 
 bool is_socket(int fd) {
@@ -62,46 +50,126 @@ error:
         return false;
 }
 
-bool is_inet_socket(int fd) {
-        if (!is_socket(fd)) return false;
-        int optval;
-        socklen_t optlen = sizeof(optval);
-        if (my_getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &optval, &optlen))
+/* Classifying a fd costs an fcntl(), an fstat() and up to 2 getsockopt(). As
+ * every intercepted call (including read() & write() on regular files) needs to
+ * know whether its fd is an INET socket, we classify each fd once and cache the
+ * result until the fd is closed. The cache is filled by socket(), accept(),
+ * dup*() & fcntl(F_DUPFD) and cleared by close(). Other fds are probed on first
+ * use. Fds above FD_CACHE_SIZE are probed on every call.
+ *
+ * A socket may also be closed behind our back (fclose() of an fdopen() stream,
+ * close_range(), closes internal to the libc) and its fd reused by a file. A
+ * cached socket is thus checked against its inode, with a single fstat(). */
+
+#define FD_CACHE_SIZE 65536
+#define SOCK_TYPE_MASK 0b1111
+
+typedef enum FdType {
+        FD_UNKNOWN,   // Not classified yet (or not a valid fd).
+        FD_OTHER,     // Not a socket, or socket of another domain.
+        FD_INET_TCP,  // AF_INET or AF_INET6 socket of type SOCK_STREAM.
+        FD_INET,      // Any other AF_INET or AF_INET6 socket.
+        FD_PACKET     // AF_PACKET socket.
+} FdType;
+
+static _Atomic unsigned char fd_cache[FD_CACHE_SIZE];
+static _Atomic ino_t fd_inodes[FD_CACHE_SIZE];  // Of the cached sockets.
+
+static FdType fd_type_from_socket(int domain, int type) {
+        switch (domain) {
+                case AF_INET:
+                case AF_INET6:
+                        return ((type & SOCK_TYPE_MASK) == SOCK_STREAM)
+                                   ? FD_INET_TCP
+                                   : FD_INET;
+                case AF_PACKET:
+                        return FD_PACKET;
+                default:
+                        return FD_OTHER;
+        }
+}
+
+// The inode of socket fd, 0 if fd is not a socket.
+static ino_t socket_inode(int fd) {
+        struct stat statbuf;
+        if (fstat(fd, &statbuf) || !S_ISSOCK(statbuf.st_mode)) return 0;
+        return statbuf.st_ino;
+}
+
+static FdType probe_fd_type(int fd, ino_t *inode) {
+        *inode = 0;
+        if (!is_fd(fd)) return FD_UNKNOWN;
+        if (!(*inode = socket_inode(fd))) return FD_OTHER;
+        int domain, type;
+        socklen_t optlen = sizeof(domain);
+        if (my_getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &optlen))
                 goto error;
-        return (optval == AF_INET || optval == AF_INET6 ||
+        optlen = sizeof(type);
+        if (my_getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optlen)) goto error;
+        return fd_type_from_socket(domain, type);
+error:
+        LOG(ERROR, "Assume socket is not a INET socket.");
+        return FD_UNKNOWN;
+}
+
+static bool is_fd_cached(int fd) { return fd >= 0 && fd < FD_CACHE_SIZE; }
+
+static void set_fd_type(int fd, FdType type, ino_t inode) {
+        if (!is_fd_cached(fd)) return;
+        atomic_store_explicit(&fd_inodes[fd], inode, memory_order_relaxed);
+        atomic_store_explicit(&fd_cache[fd], type, memory_order_relaxed);
+}
+
+static FdType get_fd_type(int fd) {
+        ino_t inode;
+        if (fd < 0) return FD_UNKNOWN;
+        if (!is_fd_cached(fd)) return probe_fd_type(fd, &inode);
+        FdType type = atomic_load_explicit(&fd_cache[fd], memory_order_relaxed);
+        if (type == FD_OTHER) return type;
+        if (type != FD_UNKNOWN &&
+            socket_inode(fd) ==
+                atomic_load_explicit(&fd_inodes[fd], memory_order_relaxed))
+                return type;
+        // Invalid fds stay FD_UNKNOWN and will thus be probed again.
+        type = probe_fd_type(fd, &inode);
+        set_fd_type(fd, type, inode);
+        return type;
+}
+
+bool is_inet_socket(int fd) {
+        switch (get_fd_type(fd)) {
+                case FD_INET_TCP:
+                case FD_INET:
+                        return true;
 /* pcap_open_live() will open an AF_PACKET socket. We will thus run into a
  * deadlock if we do trace AF_PACKET sockets while sniffing packets. Also, we
  * actually capture our own socket activity. We should find a way not to track
  * libpcap sockets. Until we find a proper solution to do that, we simply do not
  * trace AF_PACKET sockets when capture pcap traces. */
-                (conf_opt_c ? false : (optval == AF_PACKET)));
-error:
-        LOG(ERROR, "Assume socket is not a INET socket.");
-        return false;
+                case FD_PACKET:
+                        return !conf_opt_c;
+                default:
+                        return false;
+        }
 }
 
-bool is_tcp_socket(int fd) {
-        if (!is_inet_socket(fd)) return false;
-        int optval;
-        socklen_t optlen = sizeof(optval);
-        if (my_getsockopt(fd, SOL_SOCKET, SO_TYPE, &optval, &optlen))
-                goto error;
-        return optval == SOCK_STREAM;
-error:
-        LOG(ERROR, "getsockopt() failed. %s.", strerror(errno));
-        LOG_FUNC_ERROR;
-        LOG(ERROR, "Assume socket is not a TCP socket.");
-        return false;
+bool is_tcp_socket(int fd) { return get_fd_type(fd) == FD_INET_TCP; }
+
+void cache_socket_fd(int fd, int domain, int type) {
+        if (!is_fd_cached(fd)) return;
+        set_fd_type(fd, fd_type_from_socket(domain, type), socket_inode(fd));
 }
 
-typedef FILE *(*orig_fdopen_type)(int fd, const char *mode);
+// newfd refers to the same kind of socket as fd (dup*(), accept*(), fcntl()).
+void cache_dup_fd(int fd, int newfd) {
+        if (!is_fd_cached(newfd)) return;
+        set_fd_type(newfd, get_fd_type(fd), socket_inode(newfd));
+}
 
-orig_fdopen_type orig_fdopen;
+void uncache_fd(int fd) { set_fd_type(fd, FD_UNKNOWN, 0); }
 
 FILE *my_fdopen(int fd, const char *mode) {
-        if (!orig_fdopen)
-                orig_fdopen = (orig_fdopen_type)dlsym(RTLD_NEXT, "fdopen");
-        return orig_fdopen(fd, mode);
+        return ORIG(fdopen)(fd, mode);
 }
 
 int append_string_to_file(const char *str, const char *path) {
@@ -133,16 +201,6 @@ error:
         return -1;
 }
 
-int fill_tcp_info(int fd, struct tcp_info *info) {
-        socklen_t n = sizeof(struct tcp_info);
-        if (my_getsockopt(fd, SOL_TCP, TCP_INFO, (void *)info, &n)) goto error;
-        return 0;
-error:
-        LOG(ERROR, "getsockopt() failed. %s.", strerror(errno));
-        LOG_FUNC_ERROR;
-        return -1;
-}
-
 time_t get_time_sec(void) {
         struct timeval tv;
         if (fill_timeval(&tv)) goto error;
@@ -152,17 +210,6 @@ error:
         return 0;
 }
 
-unsigned long get_time_micros(void) {
-        struct timeval tv;
-        if (fill_timeval(&tv)) goto error;
-        unsigned long time_micros;
-        time_micros = tv.tv_sec * (unsigned long)1000000 + tv.tv_usec;
-        return time_micros;
-error:
-        LOG_FUNC_ERROR;
-        return 0;
-}
-
 long parse_long(const char *str) {
         char *str_end;
         long val = strtol(str, &str_end, 10);
@@ -304,6 +351,16 @@ error:
         abort();
 }
 
+void *my_realloc(void *ptr, size_t size) {
+        void *ret = realloc(ptr, size);
+        if (!ret) goto error;
+        return ret;
+error:
+        LOG(ERROR, "realloc() failed.");
+        LOG_FUNC_ERROR;
+        abort();
+}
+
 int my_fputs(const char *s, FILE *stream) {
         int ret = fputs(s, stream);
         if (ret == EOF) goto error;
@@ -20,14 +20,16 @@ bool is_socket(int fd);
 bool is_inet_socket(int fd);
 bool is_tcp_socket(int fd);
 
+void cache_socket_fd(int fd, int domain, int type);
+void cache_dup_fd(int fd, int newfd);
+void uncache_fd(int fd);
+
 FILE *my_fdopen(int fd, const char *mode);
 int append_string_to_file(const char *str, const char *path);
 
-int fill_tcp_info(int fd, struct tcp_info *info);
 int fill_timeval(struct timeval *timeval);
 
 time_t get_time_sec(void);
-unsigned long get_time_micros(void);
 
 long parse_long(const char *str);
 long get_env_as_long(const char *env_var);
@@ -47,6 +49,7 @@ int my_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
                       void *(*start_routine)(void *), void *arg);
 void *my_malloc(size_t size);
 void *my_calloc(size_t size);
+void *my_realloc(void *ptr, size_t size);
 int my_fputs(const char *s, FILE *stream);
 
 bool is_dir_writable(const char *path);
@@ -8,7 +8,6 @@
 
 #include "lib.h"
 #include <arpa/inet.h>
-#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -24,6 +23,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include "init.h"
+#include "latency.h"
+#include "libc_symbols.h"
 #include "logger.h"
 #include "sock_events.h"
 #include "string_builders.h"
@@ -37,35 +38,64 @@
 #define arg5 arg4, d
 #define arg6 arg5, e
 
-#define override(FUNCTION, RETURN_TYPE, ARGS_COUNT, ...)                   \
-        typedef RETURN_TYPE (*FUNCTION##_type)(int fd, __VA_ARGS__);       \
-        FUNCTION##_type orig_##FUNCTION;                                   \
-                                                                           \
-        EXPORT RETURN_TYPE FUNCTION(int fd, __VA_ARGS__) {                 \
-                if (!orig_##FUNCTION)                                      \
-                        orig_##FUNCTION =                                  \
-                            (FUNCTION##_type)dlsym(RTLD_NEXT, #FUNCTION);  \
-                RETURN_TYPE ret = orig_##FUNCTION(fd, arg##ARGS_COUNT);    \
-                int err = errno;                                           \
-                if (is_inet_socket(fd))                                    \
-                        sock_ev_##FUNCTION(fd, ret, err, arg##ARGS_COUNT); \
-                errno = err;                                               \
-                return ret;                                                \
+/* The overrides only do the libc call if their event type is filtered out
+ * (see sock_ev_set_filter()). */
+#define override(FUNCTION, EV_TYPE, RETURN_TYPE, ARGS_COUNT, ...)           \
+        EXPORT RETURN_TYPE FUNCTION(int fd, __VA_ARGS__) {                  \
+                if (!is_traced(EV_TYPE))                                    \
+                        return ORIG(FUNCTION)(fd, arg##ARGS_COUNT);         \
+                lat_start();                                                \
+                RETURN_TYPE ret = ORIG(FUNCTION)(fd, arg##ARGS_COUNT);      \
+                int err = errno;                                            \
+                lat_end();                                                  \
+                if (is_inet_socket(fd))                                     \
+                        sock_ev_##FUNCTION(fd, ret, err, arg##ARGS_COUNT);  \
+                errno = err;                                                \
+                return ret;                                                 \
         }
 
-#define override_1arg(FUNCTION, RETURN_TYPE)                              \
-        typedef RETURN_TYPE (*FUNCTION##_type)(int fd);                   \
-        FUNCTION##_type orig_##FUNCTION;                                  \
-                                                                          \
-        EXPORT RETURN_TYPE FUNCTION(int fd) {                             \
-                if (!orig_##FUNCTION)                                     \
-                        orig_##FUNCTION =                                 \
-                            (FUNCTION##_type)dlsym(RTLD_NEXT, #FUNCTION); \
-                RETURN_TYPE ret = orig_##FUNCTION(fd);                    \
-                int err = errno;                                          \
-                if (is_inet_socket(fd)) sock_ev_##FUNCTION(fd, ret, err); \
-                errno = err;                                              \
-                return ret;                                               \
+#define override_1arg(FUNCTION, EV_TYPE, RETURN_TYPE)                       \
+        EXPORT RETURN_TYPE FUNCTION(int fd) {                               \
+                if (!is_traced(EV_TYPE)) return ORIG(FUNCTION)(fd);         \
+                lat_start();                                                \
+                RETURN_TYPE ret = ORIG(FUNCTION)(fd);                       \
+                int err = errno;                                            \
+                lat_end();                                                  \
+                if (is_inet_socket(fd)) sock_ev_##FUNCTION(fd, ret, err);   \
+                errno = err;                                                \
+                return ret;                                                 \
+        }
+
+/* Variants of override() & override_1arg() for calls returning a new fd that
+ * refers to the same kind of socket as fd, i.e. accept() and dup(). The new fd
+ * inherits the cached classification of fd (see lib.c), even if the call is
+ * not traced. */
+#define override_dup(FUNCTION, EV_TYPE, RETURN_TYPE, ARGS_COUNT, ...)       \
+        EXPORT RETURN_TYPE FUNCTION(int fd, __VA_ARGS__) {                  \
+                bool traced = is_traced(EV_TYPE);                           \
+                if (traced) lat_start();                                    \
+                RETURN_TYPE ret = ORIG(FUNCTION)(fd, arg##ARGS_COUNT);      \
+                int err = errno;                                            \
+                if (traced) lat_end();                                      \
+                if (ret != -1) cache_dup_fd(fd, ret);                       \
+                if (traced && is_inet_socket(fd))                           \
+                        sock_ev_##FUNCTION(fd, ret, err, arg##ARGS_COUNT);  \
+                errno = err;                                                \
+                return ret;                                                 \
+        }
+
+#define override_dup_1arg(FUNCTION, EV_TYPE, RETURN_TYPE)                   \
+        EXPORT RETURN_TYPE FUNCTION(int fd) {                               \
+                bool traced = is_traced(EV_TYPE);                           \
+                if (traced) lat_start();                                    \
+                RETURN_TYPE ret = ORIG(FUNCTION)(fd);                       \
+                int err = errno;                                            \
+                if (traced) lat_end();                                      \
+                if (ret != -1) cache_dup_fd(fd, ret);                       \
+                if (traced && is_inet_socket(fd))                           \
+                        sock_ev_##FUNCTION(fd, ret, err);                   \
+                errno = err;                                                \
+                return ret;                                                 \
         }
 
 /*
@@ -89,86 +119,92 @@
 
 */
 
-typedef int (*socket_type)(int domain, int type, int protocol);
-socket_type orig_socket;
-
 EXPORT int socket(int domain, int type, int protocol) {
-        if (!orig_socket) orig_socket = (socket_type)dlsym(RTLD_NEXT, "socket");
-        int fd = orig_socket(domain, type, protocol);
+        int fd = ORIG(socket)(domain, type, protocol);
+        if (fd != -1) cache_socket_fd(fd, domain, type);
         if (is_inet_socket(fd)) sock_ev_socket(fd, domain, type, protocol);
         return fd;
 }
 
-typedef int (*connect_type)(int fd, const struct sockaddr *addr, socklen_t len);
-connect_type orig_connect;
-
 EXPORT int connect(int fd, const struct sockaddr *addr, socklen_t len) {
-        if (!orig_connect)
-                orig_connect = (connect_type)dlsym(RTLD_NEXT, "connect");
-
+        if (!is_traced(SOCK_EV_CONNECT)) return ORIG(connect)(fd, addr, len);
         if (is_inet_socket(fd) && conf_opt_c) sock_start_capture(fd, addr);
-        int ret = orig_connect(fd, addr, len);
+        lat_start();
+        int ret = ORIG(connect)(fd, addr, len);
         int err = errno;
+        lat_end();
         if (is_inet_socket(fd)) sock_ev_connect(fd, ret, err, addr, len);
 
         errno = err;
         return ret;
 }
 
-override(bind, int, 3, const struct sockaddr *a, socklen_t b);
-override(shutdown, int, 2, int a) override(listen, int, 2, int a);
-override(accept, int, 3, struct sockaddr *a, socklen_t *b);
-override(accept4, int, 4, struct sockaddr *a, socklen_t *b, int c);
-override(getsockopt, int, 5, int a, int b, void *c, socklen_t *d);
-override(setsockopt, int, 5, int a, int b, const void *c, socklen_t d);
+override(bind, SOCK_EV_BIND, int, 3, const struct sockaddr *a, socklen_t b);
+override(shutdown, SOCK_EV_SHUTDOWN, int, 2, int a);
+override(listen, SOCK_EV_LISTEN, int, 2, int a);
+override_dup(accept, SOCK_EV_ACCEPT, int, 3, struct sockaddr *a, socklen_t *b);
+override_dup(accept4, SOCK_EV_ACCEPT4, int, 4, struct sockaddr *a,
+             socklen_t *b, int c);
+override(getsockopt, SOCK_EV_GETSOCKOPT, int, 5, int a, int b, void *c,
+         socklen_t *d);
+override(setsockopt, SOCK_EV_SETSOCKOPT, int, 5, int a, int b, const void *c,
+         socklen_t d);
 
 #if defined(__ANDROID__) && __ANDROID_API__ <= 19
-override(send, ssize_t, 4, const void *a, size_t b, unsigned int c);
-override(recv, ssize_t, 4, void *a, size_t b, unsigned int c);
+override(send, SOCK_EV_SEND, ssize_t, 4, const void *a, size_t b,
+         unsigned int c);
+override(recv, SOCK_EV_RECV, ssize_t, 4, void *a, size_t b, unsigned int c);
 #else
-override(send, ssize_t, 4, const void *a, size_t b, int c);
-override(recv, ssize_t, 4, void *a, size_t b, int c);
+override(send, SOCK_EV_SEND, ssize_t, 4, const void *a, size_t b, int c);
+override(recv, SOCK_EV_RECV, ssize_t, 4, void *a, size_t b, int c);
 #endif
 
-override(sendto, ssize_t, 6, const void *a, size_t b, int c,
+override(sendto, SOCK_EV_SENDTO, ssize_t, 6, const void *a, size_t b, int c,
          const struct sockaddr *d, socklen_t e);
 #if defined(__ANDROID__) && __ANDROID_API__ <= 19
-override(recvfrom, ssize_t, 6, void *a, size_t b, unsigned int c,
-         const struct sockaddr *d, socklen_t *e);
+override(recvfrom, SOCK_EV_RECVFROM, ssize_t, 6, void *a, size_t b,
+         unsigned int c, const struct sockaddr *d, socklen_t *e);
 #elif defined(__ANDROID__)
-override(recvfrom, ssize_t, 6, void *a, size_t b, int c,
+override(recvfrom, SOCK_EV_RECVFROM, ssize_t, 6, void *a, size_t b, int c,
          const struct sockaddr *d, socklen_t *e);
 #else
-override(recvfrom, ssize_t, 6, void *a, size_t b, int c, struct sockaddr *d,
-         socklen_t *e);
+override(recvfrom, SOCK_EV_RECVFROM, ssize_t, 6, void *a, size_t b, int c,
+         struct sockaddr *d, socklen_t *e);
 #endif
 
 #if defined(__ANDROID__) && __ANDROID_API__ <= 19
-override(sendmsg, ssize_t, 3, const struct msghdr *a, unsigned int b);
-override(recvmsg, ssize_t, 3, struct msghdr *a, unsigned int b);
+override(sendmsg, SOCK_EV_SENDMSG, ssize_t, 3, const struct msghdr *a,
+         unsigned int b);
+override(recvmsg, SOCK_EV_RECVMSG, ssize_t, 3, struct msghdr *a,
+         unsigned int b);
 #else
-override(sendmsg, ssize_t, 3, const struct msghdr *a, int b);
-override(recvmsg, ssize_t, 3, struct msghdr *a, int b);
+override(sendmsg, SOCK_EV_SENDMSG, ssize_t, 3, const struct msghdr *a, int b);
+override(recvmsg, SOCK_EV_RECVMSG, ssize_t, 3, struct msghdr *a, int b);
 #endif
 
 #if defined(__ANDROID__) && __ANDROID_API__ >= 21
-override(sendmmsg, int, 4, const struct mmsghdr *a, unsigned int b, int c);
-override(recvmmsg, int, 5, struct mmsghdr *a, unsigned int b, int c,
-         const struct timespec *d);
+override(sendmmsg, SOCK_EV_SENDMMSG, int, 4, const struct mmsghdr *a,
+         unsigned int b, int c);
+override(recvmmsg, SOCK_EV_RECVMMSG, int, 5, struct mmsghdr *a,
+         unsigned int b, int c, const struct timespec *d);
 #elif LIBC_VERSION > 219  // Absolutely not sure this is the right boundary!
-override(sendmmsg, int, 4, struct mmsghdr *a, unsigned int b, int c);
-override(recvmmsg, int, 5, struct mmsghdr *a, unsigned int b, int c,
-         struct timespec *d);
+override(sendmmsg, SOCK_EV_SENDMMSG, int, 4, struct mmsghdr *a,
+         unsigned int b, int c);
+override(recvmmsg, SOCK_EV_RECVMMSG, int, 5, struct mmsghdr *a,
+         unsigned int b, int c, struct timespec *d);
 #else
-override(sendmmsg, int, 4, struct mmsghdr *a, unsigned int b, int c);
-override(recvmmsg, int, 5, struct mmsghdr *a, unsigned int b, int c,
-         const struct timespec *d);
+override(sendmmsg, SOCK_EV_SENDMMSG, int, 4, struct mmsghdr *a,
+         unsigned int b, int c);
+override(recvmmsg, SOCK_EV_RECVMMSG, int, 5, struct mmsghdr *a,
+         unsigned int b, int c, const struct timespec *d);
 #endif
 
-override(getsockname, int, 3, struct sockaddr *a, socklen_t *b);
-override(getpeername, int, 3, struct sockaddr *a, socklen_t *b);
-override_1arg(sockatmark, int);
-override(isfdtype, int, 2, int a);
+override(getsockname, SOCK_EV_GETSOCKNAME, int, 3, struct sockaddr *a,
+         socklen_t *b);
+override(getpeername, SOCK_EV_GETPEERNAME, int, 3, struct sockaddr *a,
+         socklen_t *b);
+override_1arg(sockatmark, SOCK_EV_SOCKATMARK, int);
+override(isfdtype, SOCK_EV_ISFDTYPE, int, 2, int a);
 
 /*
   _   _ _   _ ___ ____ _____ ____       _    ____ ___
@@ -183,36 +219,35 @@ override(isfdtype, int, 2, int a);
 
 */
 
-override(write, ssize_t, 3, const void *a, size_t b);
-override(read, ssize_t, 3, void *a, size_t b);
-
-typedef int (*close_type)(int fd);
-close_type orig_close;
+override(write, SOCK_EV_WRITE, ssize_t, 3, const void *a, size_t b);
+override(read, SOCK_EV_READ, ssize_t, 3, void *a, size_t b);
 
 EXPORT int close(int fd) {
-        if (!orig_close) orig_close = (close_type)dlsym(RTLD_NEXT, "close");
-
         bool is_inet = is_inet_socket(fd);
-        int ret = orig_close(fd);
+        bool traced = is_traced(SOCK_EV_CLOSE);
+        if (is_inet && traced) sock_ev_before_close(fd);
+        if (traced) lat_start();
+        int ret = ORIG(close)(fd);
         int err = errno;
-        if (is_inet) sock_ev_close(fd, ret, err);
+        if (traced) lat_end();
+        uncache_fd(fd);
+        if (is_inet && traced)
+                sock_ev_close(fd, ret, err);
+        else if (is_inet)  // The trace of the socket still ends here.
+                free_and_dump_socket(fd);
 
         errno = err;
         return ret;
 }
 
-override_1arg(dup, int);
-override(dup2, int, 2, int a);
-override(dup3, int, 3, int a, int b);
-
-typedef pid_t (*fork_type)(void);
-fork_type orig_fork;
+override_dup_1arg(dup, SOCK_EV_DUP, int);
+override_dup(dup2, SOCK_EV_DUP2, int, 2, int a);
+override_dup(dup3, SOCK_EV_DUP3, int, 3, int a, int b);
 
 EXPORT pid_t fork(void) {
-        if (!orig_fork) orig_fork = (fork_type)dlsym(RTLD_NEXT, "fork");
         LOG(INFO, "fork() called.");
 
-        pid_t ret = orig_fork();
+        pid_t ret = ORIG(fork)();
         int err = errno;
         if (ret == 0) reset_tcpsnitch();  // Child
 
@@ -233,8 +268,8 @@ EXPORT pid_t fork(void) {
 
 */
 
-override(writev, ssize_t, 3, const struct iovec *a, int b);
-override(readv, ssize_t, 3, const struct iovec *a, int b);
+override(writev, SOCK_EV_WRITEV, ssize_t, 3, const struct iovec *a, int b);
+override(readv, SOCK_EV_READV, ssize_t, 3, const struct iovec *a, int b);
 
 /*
   ___ ___   ____ _____ _          _    ____ ___
@@ -248,14 +283,6 @@ override(readv, ssize_t, 3, const struct iovec *a, int b);
   functions: ioctl()
 */
 
-#ifdef __ANDROID__
-typedef int (*ioctl_type)(int fd, int request, ...);
-#else
-typedef int (*ioctl_type)(int fd, unsigned long int request, ...);
-#endif
-
-ioctl_type orig_ioctl;
-
 #ifdef __ANDROID__
 EXPORT int ioctl(int fd, int request, ...) {
 #else
@@ -266,11 +293,10 @@ EXPORT int ioctl(int fd, unsigned long int request, ...) {
         void *value = va_arg(argp, void *);
         va_end(argp);
 
-        if (!orig_ioctl) orig_ioctl = (ioctl_type)dlsym(RTLD_NEXT, "ioctl");
-
-        int ret = orig_ioctl(fd, request, value);
+        int ret = ORIG(ioctl)(fd, request, value);
         int err = errno;
-        if (is_inet_socket(fd)) sock_ev_ioctl(fd, ret, err, request);
+        if (is_traced(SOCK_EV_IOCTL) && is_inet_socket(fd))
+                sock_ev_ioctl(fd, ret, err, request);
 
         errno = err;
         return ret;
@@ -288,7 +314,7 @@ EXPORT int ioctl(int fd, unsigned long int request, ...) {
  functions: sendfile()
 */
 
-override(sendfile, ssize_t, 4, int a, off_t *b, size_t c);
+override(sendfile, SOCK_EV_SENDFILE, ssize_t, 4, int a, off_t *b, size_t c);
 
 /*
   ____   ___  _     _          _    ____ ___
@@ -302,14 +328,12 @@ override(sendfile, ssize_t, 4, int a, off_t *b, size_t c);
  functions: poll(), ppoll()
 */
 
-typedef int (*poll_type)(struct pollfd *fds, nfds_t nfds, int timeout);
-poll_type orig_poll;
-
 EXPORT int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
-        if (!orig_poll) orig_poll = (poll_type)dlsym(RTLD_NEXT, "poll");
-
-        int ret = orig_poll(fds, nfds, timeout);
+        if (!is_traced(SOCK_EV_POLL)) return ORIG(poll)(fds, nfds, timeout);
+        lat_start();
+        int ret = ORIG(poll)(fds, nfds, timeout);
         int err = errno;
+        lat_end();
         unsigned long i;
         for (i = 0; i < nfds; i++) {
                 struct pollfd pollfd = fds[i];
@@ -322,17 +346,14 @@ EXPORT int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
         return ret;
 }
 
-typedef int (*ppoll_type)(struct pollfd *fds, nfds_t nfds,
-                          const struct timespec *tmo_p,
-                          const sigset_t *sigmask);
-ppoll_type orig_ppoll;
-
 EXPORT int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p,
           const sigset_t *sigmask) {
-        if (!orig_ppoll) orig_ppoll = (ppoll_type)dlsym(RTLD_NEXT, "ppoll");
-
-        int ret = orig_ppoll(fds, nfds, tmo_p, sigmask);
+        if (!is_traced(SOCK_EV_PPOLL))
+                return ORIG(ppoll)(fds, nfds, tmo_p, sigmask);
+        lat_start();
+        int ret = ORIG(ppoll)(fds, nfds, tmo_p, sigmask);
         int err = errno;
+        lat_end();
         unsigned long i;
         for (i = 0; i < nfds; i++) {
                 struct pollfd pollfd = fds[i];
@@ -357,18 +378,15 @@ EXPORT int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p,
  functions: select(), pselect().
 */
 
-typedef int (*select_type)(int nfds, fd_set *readfds, fd_set *writefds,
-                           fd_set *exceptfds, struct timeval *timeout);
-select_type orig_select;
-
 #define READ_FLAG 0b1
 #define WRITE_FLAG 0b10
 #define EXCEPT_FLAG 0b100
 
 EXPORT int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
            struct timeval *timeout) {
-        if (!orig_select) orig_select = (select_type)dlsym(RTLD_NEXT, "select");
-
+        if (!is_traced(SOCK_EV_SELECT))
+                return ORIG(select)(nfds, readfds, writefds, exceptfds,
+                                    timeout);
         short req_ev[nfds];
         memset(req_ev, 0, sizeof(req_ev));
 
@@ -384,8 +402,10 @@ EXPORT int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds
                 }
         }
 
-        int ret = orig_select(nfds, readfds, writefds, exceptfds, timeout);
+        lat_start();
+        int ret = ORIG(select)(nfds, readfds, writefds, exceptfds, timeout);
         int err = errno;
+        lat_end();
 
         for (fd = 0; fd < nfds; fd++) {
                 if (is_inet_socket(fd) &&
@@ -403,16 +423,11 @@ EXPORT int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds
         return ret;
 }
 
-typedef int (*pselect_type)(int nfds, fd_set *readfds, fd_set *writefds,
-                            fd_set *exceptfds, const struct timespec *timeout,
-                            const sigset_t *sigmask);
-pselect_type orig_pselect;
-
 EXPORT int pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
             const struct timespec *timeout, const sigset_t *sigmask) {
-        if (!orig_pselect)
-                orig_pselect = (pselect_type)dlsym(RTLD_NEXT, "pselect");
-
+        if (!is_traced(SOCK_EV_PSELECT))
+                return ORIG(pselect)(nfds, readfds, writefds, exceptfds,
+                                     timeout, sigmask);
         short req_ev[nfds];
         memset(req_ev, 0, sizeof(req_ev));
 
@@ -428,9 +443,11 @@ EXPORT int pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfd
                 }
         }
 
+        lat_start();
         int ret =
-            orig_pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+            ORIG(pselect)(nfds, readfds, writefds, exceptfds, timeout, sigmask);
         int err = errno;
+        lat_end();
 
         for (fd = 0; fd < nfds; fd++) {
                 if (is_inet_socket(fd) && req_ev[fd]) {
@@ -460,21 +477,19 @@ EXPORT int pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfd
  functions: fcntl()
 */
 
-typedef int (*fcntl_type)(int fd, int cmd, ...);
-fcntl_type orig_fcntl;
-
 EXPORT int fcntl(int fd, int cmd, ...) {
-        if (!orig_fcntl) orig_fcntl = (fcntl_type)dlsym(RTLD_NEXT, "fcntl");
-
         va_list argp;
         void *arg;
         va_start(argp, cmd);
         arg = va_arg(argp, void *);
         va_end(argp);
 
-        int ret = orig_fcntl(fd, cmd, arg);
+        int ret = ORIG(fcntl)(fd, cmd, arg);
         int err = errno;
-        if (is_inet_socket(fd)) sock_ev_fcntl(fd, ret, err, cmd, arg);
+        bool dup = (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC);
+        if (dup && ret != -1) cache_dup_fd(fd, ret);
+        if (is_traced(SOCK_EV_FCNTL) && is_inet_socket(fd))
+                sock_ev_fcntl(fd, ret, err, cmd, arg);
 
         errno = err;
         return ret;
@@ -492,37 +507,24 @@ EXPORT int fcntl(int fd, int cmd, ...) {
   functions: epoll_ctl(), epoll_wait(), epoll_pwait().
 */
 
-typedef int (*epoll_ctl_type)(int epfd, int op, int fd,
-                              struct epoll_event *event);
-
-epoll_ctl_type orig_epoll_ctl;
-
 EXPORT int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
-        if (!orig_epoll_ctl)
-                orig_epoll_ctl = (epoll_ctl_type)dlsym(RTLD_NEXT, "epoll_ctl");
-
-        int ret = orig_epoll_ctl(epfd, op, fd, event);
+        int ret = ORIG(epoll_ctl)(epfd, op, fd, event);
         int err = errno;
-        if (is_inet_socket(fd))
+        if (is_traced(SOCK_EV_EPOLL_CTL) && is_inet_socket(fd))
                 sock_ev_epoll_ctl(fd, ret, err, op, event->events);
 
         errno = err;
         return ret;
 }
 
-typedef int (*epoll_wait_type)(int epfd, struct epoll_event *events,
-                               int maxevents, int timeout);
-
-epoll_wait_type orig_epoll_wait;
-
 EXPORT int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
                int timeout) {
-        if (!orig_epoll_wait)
-                orig_epoll_wait =
-                    (epoll_wait_type)dlsym(RTLD_NEXT, "epoll_wait");
-
-        int ret = orig_epoll_wait(epfd, events, maxevents, timeout);
+        if (!is_traced(SOCK_EV_EPOLL_WAIT))
+                return ORIG(epoll_wait)(epfd, events, maxevents, timeout);
+        lat_start();
+        int ret = ORIG(epoll_wait)(epfd, events, maxevents, timeout);
         int err = errno;
+        lat_end();
         for (int i = 0; i < ret; i++) {
                 int fd = events[i].data.fd;
                 if (is_inet_socket(fd)) {
@@ -536,20 +538,15 @@ EXPORT int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
         return ret;
 }
 
-typedef int (*epoll_pwait_type)(int epfd, struct epoll_event *events,
-                                int maxevents, int timeout,
-                                const sigset_t *sigmask);
-
-epoll_pwait_type orig_epoll_pwait;
-
 EXPORT int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
                 int timeout, const sigset_t *sigmask) {
-        if (!orig_epoll_pwait)
-                orig_epoll_pwait =
-                    (epoll_pwait_type)dlsym(RTLD_NEXT, "epoll_pwait");
-
-        int ret = orig_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+        if (!is_traced(SOCK_EV_EPOLL_PWAIT))
+                return ORIG(epoll_pwait)(epfd, events, maxevents, timeout,
+                                         sigmask);
+        lat_start();
+        int ret = ORIG(epoll_pwait)(epfd, events, maxevents, timeout, sigmask);
         int err = errno;
+        lat_end();
         for (int i = 0; i < ret; i++) {
                 int fd = events[i].data.fd;
                 if (is_inet_socket(fd)) {
@@ -575,4 +572,4 @@ EXPORT int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
  functions: fdopen()
 */
 
-override(fdopen, FILE *, 2, const char *a);
+override(fdopen, SOCK_EV_FDOPEN, FILE *, 2, const char *a);
@@ -0,0 +1,49 @@
+#define _GNU_SOURCE
+
+#include "libc_symbols.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+const LibcSymbols *_Atomic libc_symbols = NULL;
+
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+static LibcSymbols fallback_table;  // Used if mmap() fails.
+static unsigned long resolution_nanos;
+
+static unsigned long get_nanos(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* The table gets its own pages so that it can be write-protected once filled.
+ * Nothing in here may call an overridden function, nor log. */
+static void resolve(void) {
+        unsigned long start = get_nanos();
+        LibcSymbols *table = mmap(NULL, sizeof(LibcSymbols),
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) table = &fallback_table;
+
+#define X(NAME) table->NAME = (__typeof__(NAME) *)dlsym(RTLD_NEXT, #NAME);
+        LIBC_SYMBOLS(X)
+#undef X
+
+        if (table != &fallback_table)
+                mprotect(table, sizeof(LibcSymbols), PROT_READ);
+        resolution_nanos = get_nanos() - start;
+        atomic_store_explicit(&libc_symbols, table, memory_order_release);
+}
+
+const LibcSymbols *resolve_libc_symbols(void) {
+        pthread_once(&resolve_once, resolve);
+        return atomic_load_explicit(&libc_symbols, memory_order_acquire);
+}
+
+unsigned long libc_symbols_resolution_nanos(void) { return resolution_nanos; }
+
+__attribute__((constructor)) static void resolve_at_load(void) {
+        resolve_libc_symbols();
+}
@@ -0,0 +1,54 @@
+#ifndef LIBC_SYMBOLS_H
+#define LIBC_SYMBOLS_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Original libc functions, i.e. the next definitions of the functions
+ * overridden in libc_overrides.c. They are resolved once, by a constructor,
+ * into a table which is then made read-only. Calls made before the
+ * constructor runs (e.g. from the constructor of another library) resolve the
+ * table on the spot.
+ *
+ * Requires _GNU_SOURCE (ppoll(), isfdtype(), ...). */
+
+#define LIBC_SYMBOLS(X)                                                       \
+        X(socket) X(connect) X(bind) X(shutdown) X(listen) X(accept)          \
+        X(accept4) X(getsockopt) X(setsockopt) X(send) X(recv) X(sendto)      \
+        X(recvfrom) X(sendmsg) X(recvmsg) X(sendmmsg) X(recvmmsg)             \
+        X(getsockname) X(getpeername) X(sockatmark) X(isfdtype) X(write)      \
+        X(read) X(close) X(dup) X(dup2) X(dup3) X(fork) X(writev) X(readv)    \
+        X(ioctl) X(sendfile) X(poll) X(ppoll) X(select) X(pselect) X(fcntl)   \
+        X(epoll_ctl) X(epoll_wait) X(epoll_pwait) X(fdopen)
+
+typedef struct {
+#define X(NAME) __typeof__(NAME) *NAME;
+        LIBC_SYMBOLS(X)
+#undef X
+} LibcSymbols;
+
+extern const LibcSymbols *_Atomic libc_symbols;  // NULL until resolved.
+
+const LibcSymbols *resolve_libc_symbols(void);
+unsigned long libc_symbols_resolution_nanos(void);
+
+// Call the original libc function NAME, e.g. ORIG(close)(fd).
+#define ORIG(NAME) (get_libc_symbols()->NAME)
+
+static inline const LibcSymbols *get_libc_symbols(void) {
+        const LibcSymbols *table =
+            atomic_load_explicit(&libc_symbols, memory_order_acquire);
+        if (__builtin_expect(table == NULL, 0)) table = resolve_libc_symbols();
+        return table;
+}
+
+#endif
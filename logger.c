@@ -9,6 +9,8 @@
 #ifndef __ANDROID__
 #include <execinfo.h>
 #endif
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,6 +23,7 @@
 #include "init.h"
 #include "lib.h"
 #include "sock_events.h"
+#include "thread_registry.h"
 
 #define ANSI_COLOR_WHITE "\x1b[37m"
 #define ANSI_COLOR_RED "\x1b[31m"
@@ -28,6 +31,10 @@
 #define ANSI_COLOR_GREEN "\x1b[32m"
 #define ANSI_COLOR_RESET "\x1b[0m"
 
+#define LOG_RING_SIZE 256   // Records per thread, power of 2.
+#define LOG_MSG_SIZE 256    // Longer messages are truncated.
+#define WRITER_SLEEP_MS 20  // Delay of the writer thread between drains.
+
 typedef struct {
         int year;
         int mon;
@@ -38,6 +45,28 @@ typedef struct {
         int usec;
 } Timestamp;
 
+typedef struct {
+        LogLevel lvl;
+        struct timespec time;  // CLOCK_REALTIME.
+        const char *file;
+        int line;
+        char str[LOG_MSG_SIZE];
+} LogRecord;
+
+/* Messages are written by a background thread, once logger_init() opened the
+ * log file. Each thread pushes its messages into its own single-producer
+ * ring, which never blocks: when it is full, the message is dropped and
+ * counted. The writer reports drops as they are drained. ERROR messages are
+ * still written right away, they are usually followed by a backtrace. */
+typedef struct {
+        ThreadRecord super;
+        atomic_ulong head;       // Next record to write.
+        atomic_ulong tail;       // Next record to fill.
+        atomic_ulong dropped;    // Only written by the owner thread.
+        unsigned long reported;  // Drops already reported. Writer only.
+        LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
 #ifndef __ANDROID__
 static const char *colors[] = {ANSI_COLOR_GREEN, ANSI_COLOR_RED,
                                ANSI_COLOR_YELLOW, ANSI_COLOR_WHITE,
@@ -54,6 +83,15 @@ static const int android_log_priorities_map[] = {
 static FILE *log_file = NULL;
 static LogLevel stderr_lvl = WARN;
 static LogLevel file_lvl = WARN;
+int logger_lvl = WARN;
+
+static void *alloc_ring(size_t size);
+
+static ThreadRegistry rings = TR_INITIALIZER(LogRing, alloc_ring, NULL);
+static __thread ThreadRecord *my_ring = NULL;
+static atomic_bool writer_running = false;
+// Serializes the writers: the background thread and logger_flush().
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Private functions */
 
@@ -64,12 +102,9 @@ static const char *log_level_str(LogLevel lvl) {
         return strings[lvl];
 }
 
-static void fill_timestamp(Timestamp *timestamp) {
-        time_t rawtime;
-        if ((rawtime = time(NULL)) == -1) return;
-
+static void fill_timestamp(Timestamp *timestamp, const struct timespec *time) {
         struct tm timeinfo;
-        if (!localtime_r(&rawtime, &timeinfo)) return;
+        if (!localtime_r(&time->tv_sec, &timeinfo)) return;
 
         timestamp->year = timeinfo.tm_year + 1900;
         timestamp->mon = timeinfo.tm_mon + 1;
@@ -77,16 +112,14 @@ static void fill_timestamp(Timestamp *timestamp) {
         timestamp->hour = timeinfo.tm_hour;
         timestamp->min = timeinfo.tm_min;
         timestamp->sec = timeinfo.tm_sec;
-
-        struct timespec now;
-        if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) return;
-        timestamp->usec = now.tv_nsec / 10000000;
+        timestamp->usec = time->tv_nsec / 10000000;
 }
 
-static void log_to_file(LogLevel log_lvl, const char *formated_str,
-                        const char *file, int line, FILE *stream) {
+static void log_to_file(LogLevel log_lvl, const struct timespec *time,
+                        const char *formated_str, const char *file, int line,
+                        FILE *stream) {
         Timestamp ts;
-        fill_timestamp(&ts);
+        fill_timestamp(&ts, time);
         fprintf(stream,
                 "%02d.%02d.%02d-%02d:%02d:%02d.%02d - [%s] - %d (%s:%d) "
                 "%s\n",
@@ -101,11 +134,12 @@ static void log_to_logcat(LogLevel log_lvl, const char *str, const char *file,
                             "(%s:%d) %s", file, line, str);
 }
 #else
-static void log_to_stderr(LogLevel log_lvl, const char *formated_str,
-                          const char *file, int line) {
+static void log_to_stderr(LogLevel log_lvl, const struct timespec *time,
+                          const char *formated_str, const char *file,
+                          int line) {
         FILE *stream = (_stderr ? _stderr : stderr);
         Timestamp ts;
-        fill_timestamp(&ts);
+        fill_timestamp(&ts, time);
         fprintf(stream,
                 "%s%02d.%02d.%02d-%02d:%02d:%02d.%02d - [%s] - %d (%s:%d) "
                 "%s%s\n",
@@ -131,9 +165,112 @@ static void set_log_file(const char *path) {
 #ifdef __ANDROID__
                 log_to_logcat(ERROR, str, __FILE__, __LINE__);
 #else
-                log_to_stderr(ERROR, str, __FILE__, __LINE__);
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                log_to_stderr(ERROR, &now, str, __FILE__, __LINE__);
+#endif
+        }
+}
+
+static void write_log(LogLevel log_lvl, const struct timespec *time,
+                      const char *str, const char *file, int line) {
+        if (log_lvl <= stderr_lvl)
+#ifdef __ANDROID__
+                log_to_logcat(log_lvl, str, file, line);
+#else
+                log_to_stderr(log_lvl, time, str, file, line);
 #endif
+        if (log_file && log_lvl <= file_lvl)
+                log_to_file(log_lvl, time, str, file, line, log_file);
+}
+
+static void write_record(const LogRecord *rec) {
+        write_log(rec->lvl, &rec->time, rec->str, rec->file, rec->line);
+}
+
+// Does not log, as it is called by logger().
+static void *alloc_ring(size_t size) { return calloc(1, size); }
+
+// NULL if out of memory.
+static LogRing *get_ring(void) {
+        if (my_ring) return (LogRing *)my_ring;
+        return (LogRing *)tr_adopt(&rings, &my_ring);
+}
+
+// False if the message must be written right away.
+static bool push_record(LogLevel lvl, const char *str, const char *file,
+                        int line) {
+        LogRing *ring = get_ring();
+        if (!ring) return false;
+
+        unsigned long tail =
+            atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head =
+            atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - head >= LOG_RING_SIZE) {
+                // Single writer: no need for an atomic read-modify-write.
+                unsigned long n = atomic_load_explicit(&ring->dropped,
+                                                       memory_order_relaxed);
+                atomic_store_explicit(&ring->dropped, n + 1,
+                                      memory_order_relaxed);
+                return true;
+        }
+
+        LogRecord *rec = &ring->records[tail % LOG_RING_SIZE];
+        rec->lvl = lvl;
+        clock_gettime(CLOCK_REALTIME, &rec->time);
+        rec->file = file;
+        rec->line = line;
+        strncpy(rec->str, str, LOG_MSG_SIZE - 1);
+        rec->str[LOG_MSG_SIZE - 1] = '\0';
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        return true;
+}
+
+// Does not use mutex_lock(), which logs on errors.
+static void drain_rings(void) {
+        pthread_mutex_lock(&writer_mutex);
+        for (ThreadRecord *r = atomic_load(&rings.records); r; r = r->next) {
+                LogRing *ring = (LogRing *)r;
+                unsigned long head =
+                    atomic_load_explicit(&ring->head, memory_order_relaxed);
+                unsigned long tail =
+                    atomic_load_explicit(&ring->tail, memory_order_acquire);
+                for (; head != tail; head++)
+                        write_record(&ring->records[head % LOG_RING_SIZE]);
+                atomic_store_explicit(&ring->head, head, memory_order_release);
+
+                unsigned long dropped = atomic_load_explicit(
+                    &ring->dropped, memory_order_relaxed);
+                if (dropped == ring->reported) continue;
+                LogRecord rec = {.lvl = WARN, .file = __FILE__,
+                                 .line = __LINE__};
+                clock_gettime(CLOCK_REALTIME, &rec.time);
+                snprintf(rec.str, sizeof(rec.str),
+                         "%lu log messages dropped.", dropped - ring->reported);
+                write_record(&rec);
+                ring->reported = dropped;
         }
+        if (log_file) fflush(log_file);
+        pthread_mutex_unlock(&writer_mutex);
+}
+
+static void *writer_thread(void *arg) {
+        (void)arg;
+        struct timespec delay = {0, WRITER_SLEEP_MS * 1000 * 1000};
+        while (true) {
+                drain_rings();
+                nanosleep(&delay, NULL);
+        }
+        // Unreachable
+        return NULL;
+}
+
+static void start_writer_thread(void) {
+        if (atomic_exchange(&writer_running, true)) return;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, writer_thread, NULL))
+                atomic_store(&writer_running, false);  // Log synchronously.
 }
 
 /* Public functions */
@@ -142,17 +279,38 @@ void logger_init(const char *path, LogLevel _stdout_lvl, LogLevel _file_lvl) {
         set_log_file(path);
         stderr_lvl = _stdout_lvl;
         file_lvl = _file_lvl;
+        logger_lvl = stderr_lvl;
+        if (log_file && file_lvl > stderr_lvl) logger_lvl = file_lvl;
+        if (log_file) start_writer_thread();
 }
 
 void logger(LogLevel log_lvl, const char *str, const char *file, int line) {
-        if (log_lvl <= stderr_lvl)
-#ifdef __ANDROID__
-                log_to_logcat(log_lvl, str, file, line);
-#else
-                log_to_stderr(log_lvl, str, file, line);
-#endif
-        if (log_file && log_lvl <= file_lvl)
-                log_to_file(log_lvl, str, file, line, log_file);
+        if (log_lvl > stderr_lvl && (!log_file || log_lvl > file_lvl)) return;
+        if (log_lvl > ERROR && atomic_load(&writer_running) &&
+            push_record(log_lvl, str, file, line))
+                return;
+
+        // Keep the messages of the thread in order.
+        if (atomic_load(&writer_running)) drain_rings();
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        write_log(log_lvl, &now, str, file, line);
+}
+
+void logger_flush(void) { drain_rings(); }
+
+void logger_reset(void) {
+        // Pending messages were logged by the parent process, which remains
+        // in charge of them. The writer thread did not survive fork().
+        for (ThreadRecord *r = atomic_load(&rings.records); r; r = r->next) {
+                LogRing *ring = (LogRing *)r;
+                atomic_store(&ring->head, atomic_load(&ring->tail));
+                ring->reported = atomic_load(&ring->dropped);
+        }
+        tr_reset(&rings, my_ring);
+        atomic_store(&writer_running, false);
+        pthread_mutex_init(&writer_mutex, NULL);
+        logger_init(NULL, WARN, WARN);
 }
 
 #ifndef __ANDROID__
@@ -166,7 +324,8 @@ void print_trace(void) {
         if (!(strings = backtrace_symbols(array, size))) return;
 
         printf("Obtained %zd stack frames.\n", size);
-        for (i = 0; i < size; i++) fprintf(_stderr, "     %s\n", strings[i]);
+        FILE *stream = (_stderr ? _stderr : stderr);
+        for (i = 0; i < size; i++) fprintf(stream, "     %s\n", strings[i]);
         free(strings);
 }
 #endif
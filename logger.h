@@ -8,16 +8,31 @@ typedef enum LogLevel { ALWAYS, ERROR, WARN, INFO, DEBUG } LogLevel;
 void logger_init(const char *path, LogLevel stdout_lvl, LogLevel file_lvl);
 
 void logger(LogLevel lvl, const char *str, const char *file, int line);
+void logger_flush(void);  // Write the pending messages of all threads.
+void logger_reset(void);  // Forget the parent's messages, after fork().
 
 #ifndef __ANDROID__
 void print_trace(void);
 #endif
 
-#define LOG(lvl, format, args...)                             \
-        {                                                     \
-                char _buf[1024];                              \
-                snprintf(_buf, sizeof(_buf), format, ##args); \
-                logger(lvl, _buf, __FILE__, __LINE__);        \
+/* Messages more verbose than LOG_MAX_LVL are compiled out, see LOG_LVL in the
+ * Makefile. The others are only formatted if logger() would print them: the
+ * INFO messages of each event cost a comparison at the default levels. */
+#ifndef LOG_MAX_LVL
+#define LOG_MAX_LVL DEBUG
+#endif
+
+extern int logger_lvl;  // Most verbose level printed by logger().
+
+#define LOG_ENABLED(lvl) ((lvl) <= LOG_MAX_LVL && (int)(lvl) <= logger_lvl)
+
+#define LOG(lvl, format, args...)                                     \
+        {                                                             \
+                if (LOG_ENABLED(lvl)) {                               \
+                        char _buf[1024];                              \
+                        snprintf(_buf, sizeof(_buf), format, ##args); \
+                        logger(lvl, _buf, __FILE__, __LINE__);        \
+                }                                                     \
         }
 
 #ifdef __ANDROID__
@@ -92,14 +92,15 @@ char *alloc_capture_filter(const struct sockaddr *addr1,
         static const char *DOUBLE_FILTER = "port %s and host %s and port %s";
 
         // Build string rep of hosts/ports
-        char *port1 = NULL, *port2 = NULL, *ip1 = NULL, *ip2 = NULL;
+        char port1[PORT_STR_SIZE], port2[PORT_STR_SIZE];
+        char ip1[IP_STR_SIZE], ip2[IP_STR_SIZE];
         if (addr1) {
-                if (!(port1 = alloc_port_str(addr1))) goto error_out;
-                if (!(ip1 = alloc_ip_str(addr1))) goto error1;
+                if (!port_str(addr1, port1)) goto error_out;
+                if (!ip_str(addr1, ip1)) goto error_out;
         }
         if (addr2) {
-                if (!(port2 = alloc_port_str(addr2))) goto error2;
-                if (!(ip2 = alloc_ip_str(addr2))) goto error3;
+                if (!port_str(addr2, port2)) goto error_out;
+                if (!ip_str(addr2, ip2)) goto error_out;
         }
 
         // Build filter string
@@ -114,17 +115,7 @@ char *alloc_capture_filter(const struct sockaddr *addr1,
                 snprintf(filter, n, SINGLE_FILTER, ip2, port2);
 
         LOG(INFO, "Capture filter: '%s'.", filter);
-        free(port1);
-        free(ip1);
-        free(port2);
-        free(ip2);
         return filter;
-error3:
-        free(port2);
-error2:
-        free(ip1);
-error1:
-        free(port1);
 error_out:
         LOG_FUNC_ERROR;
         return NULL;
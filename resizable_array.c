@@ -3,168 +3,280 @@
 #include "resizable_array.h"
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include "lib.h"
 #include "logger.h"
 #include "sock_events.h"
 
-typedef struct {
+/* The array is a fixed directory of lazily allocated segments. Segments are
+ * never moved nor freed before ra_free(), so a slot address is stable and
+ * readers never need a lock on the array itself. Each element carries its own
+ * mutex (ELEM_MUTEX). Removed elements are reclaimed with epoch-based
+ * reclamation: an element is freed only once every thread that could have
+ * loaded it has left its read-side critical section. */
+
+typedef _Atomic(ELEM_TYPE) Slot;
+
+static _Atomic(Slot *) segments[MAX_SEGMENTS];
+static atomic_int size = 0;  // High-water mark, multiple of SEGMENT_SIZE.
+
+// Epoch-based reclamation
+
+typedef struct ThreadEpoch ThreadEpoch;
+struct ThreadEpoch {
+        atomic_ulong epoch;  // Announced epoch, 0 if not in critical section.
+        atomic_bool in_use;  // Record owned by a live thread.
+        int nesting;         // Only accessed by owner thread.
+        ThreadEpoch *next;
+};
+
+typedef struct RetiredNode RetiredNode;
+struct RetiredNode {
         ELEM_TYPE elem;
-        pthread_mutex_t mutex;
-} ElemWrapper;
+        unsigned long epoch;
+        RetiredNode *next;
+};
+
+static atomic_ulong global_epoch = 1;
+static _Atomic(ThreadEpoch *) thread_epochs = NULL;
+static __thread ThreadEpoch *my_epoch = NULL;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
 
-static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
-static ElemWrapper **array = NULL;
-static int size = 0;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static RetiredNode *retired = NULL;
 
 // Private functions
 
-ElemWrapper **allocate_array(int _size) {
-        return (ElemWrapper **)my_calloc(sizeof(ElemWrapper *) * _size);
+static void release_thread_epoch(void *te) {
+        atomic_store(&((ThreadEpoch *)te)->epoch, 0);
+        atomic_store(&((ThreadEpoch *)te)->in_use, false);
 }
 
-static bool init(int init_size) {
-        if (init_size < MIN_INIT_SIZE) init_size = MIN_INIT_SIZE;
-        LOG(INFO, "Resizable array initialized to size %d.", init_size);
-        if (!(array = allocate_array(init_size))) goto error;
-        size = init_size;
-        return true;
-error:
-        LOG_FUNC_ERROR;
-        return false;
+static void make_epoch_key(void) {
+        pthread_key_create(&epoch_key, release_thread_epoch);
 }
 
-static bool double_size(int index) {
-        // Compute new size
-        int new_size, normal_new_size = size * GROWTH_FACTOR;
-        new_size = normal_new_size > index + 1 ? normal_new_size : index + 1;
-        LOG(INFO, "Resizable array doubling size to %d.", new_size);
+static ThreadEpoch *get_thread_epoch(void) {
+        if (my_epoch) return my_epoch;
 
-        ElemWrapper **new_a;
-        if (!(new_a = allocate_array(new_size))) goto error;
+        // Reuse the record of a terminated thread if possible.
+        ThreadEpoch *te;
+        for (te = atomic_load(&thread_epochs); te; te = te->next) {
+                bool expected = false;
+                if (atomic_compare_exchange_strong(&te->in_use, &expected,
+                                                   true))
+                        break;
+        }
 
-        for (int i = 0; i < size; i++) new_a[i] = array[i];
+        if (!te) {
+                te = (ThreadEpoch *)my_calloc(sizeof(ThreadEpoch));
+                atomic_init(&te->in_use, true);
+                te->next = atomic_load(&thread_epochs);
+                while (!atomic_compare_exchange_weak(&thread_epochs, &te->next,
+                                                     te))
+                        ;
+        }
 
-        free(array);
-        array = new_a;
-        size = new_size;
-        return true;
-error:
-        LOG_FUNC_ERROR;
-        return false;
+        te->nesting = 0;
+        pthread_once(&epoch_key_once, make_epoch_key);
+        pthread_setspecific(epoch_key, te);
+        my_epoch = te;
+        return te;
 }
 
-static bool is_index_in_bounds(int index) { return index < size; }
+static void epoch_enter(void) {
+        ThreadEpoch *te = get_thread_epoch();
+        if (te->nesting++ == 0)
+                atomic_store(&te->epoch, atomic_load(&global_epoch));
+}
 
-/* Public functions */
+static void epoch_exit(void) {
+        ThreadEpoch *te = get_thread_epoch();
+        if (--te->nesting == 0) atomic_store(&te->epoch, 0);
+}
 
-bool ra_put_elem(int index, ELEM_TYPE elem) {
-        pthread_rwlock_wrlock(&rwlock);
-        if (!array && !init(index + 1)) goto error;
-        if (index > size - 1 && !double_size(index)) goto error;
+static unsigned long min_active_epoch(void) {
+        unsigned long min = atomic_load(&global_epoch);
+        for (ThreadEpoch *te = atomic_load(&thread_epochs); te; te = te->next) {
+                unsigned long e = atomic_load(&te->epoch);
+                if (e && e < min) min = e;
+        }
+        return min;
+}
+
+static void reclaim(void) {
+        RetiredNode *to_free = NULL;
+
+        mutex_lock(&retired_mutex);
+        unsigned long min = min_active_epoch();
+        RetiredNode **prev = &retired;
+        while (*prev) {
+                RetiredNode *node = *prev;
+                if (node->epoch < min) {
+                        *prev = node->next;
+                        node->next = to_free;
+                        to_free = node;
+                } else {
+                        prev = &node->next;
+                }
+        }
+        mutex_unlock(&retired_mutex);
 
-        ElemWrapper *ew = (ElemWrapper *)my_malloc(sizeof(ElemWrapper));
-        mutex_init(&ew->mutex);
-        ew->elem = elem;
+        while (to_free) {
+                RetiredNode *next = to_free->next;
+                pthread_mutex_destroy(ELEM_MUTEX(to_free->elem));
+                FREE_ELEM(to_free->elem);
+                free(to_free);
+                to_free = next;
+        }
+}
+
+static bool is_index_in_bounds(int index) {
+        return index >= 0 && index < SEGMENT_SIZE * MAX_SEGMENTS;
+}
 
-        array[index] = ew;
-        pthread_rwlock_unlock(&rwlock);
+static Slot *get_slot(int index, bool alloc) {
+        _Atomic(Slot *) *seg_ptr = &segments[index / SEGMENT_SIZE];
+        Slot *seg = atomic_load(seg_ptr);
+        if (!seg && alloc) {
+                Slot *new_seg = (Slot *)my_calloc(sizeof(Slot) * SEGMENT_SIZE);
+                if (atomic_compare_exchange_strong(seg_ptr, &seg, new_seg)) {
+                        seg = new_seg;
+                        int new_size = (index / SEGMENT_SIZE + 1) * SEGMENT_SIZE;
+                        int old_size = atomic_load(&size);
+                        while (old_size < new_size &&
+                               !atomic_compare_exchange_weak(&size, &old_size,
+                                                             new_size))
+                                ;
+                        LOG(INFO, "Resizable array grown to size %d.",
+                            new_size);
+                } else {
+                        free(new_seg);  // Another thread won the race.
+                }
+        }
+        return seg ? &seg[index % SEGMENT_SIZE] : NULL;
+}
+
+/* Public functions */
+
+bool ra_put_elem(int index, ELEM_TYPE elem) {
+        if (!is_index_in_bounds(index)) goto error;
+        mutex_init(ELEM_MUTEX(elem));
+        ELEM_TYPE old = atomic_exchange(get_slot(index, true), elem);
+        if (old) {
+                LOG(WARN, "Replacing element at index %d.", index);
+                ra_retire_elem(old);
+        }
         return true;
 error:
-        pthread_rwlock_unlock(&rwlock);
+        LOG(ERROR, "OOB (index %d, bound %d).", index,
+            SEGMENT_SIZE * MAX_SEGMENTS - 1);
         LOG_FUNC_ERROR;
         return false;
 }
 
 ELEM_TYPE ra_get_and_lock_elem(int index) {
-        pthread_rwlock_rdlock(&rwlock);
         if (!is_index_in_bounds(index)) goto error;
-        if (!array[index]) {
-                LOG(WARN, "Null in array at index %d.", index);
-                pthread_rwlock_unlock(&rwlock);
-                return NULL;
+        Slot *slot = get_slot(index, false);
+        epoch_enter();
+        ELEM_TYPE elem;
+        while ((elem = slot ? atomic_load(slot) : NULL)) {
+                mutex_lock(ELEM_MUTEX(elem));
+                // The element may have been removed while we were waiting.
+                if (atomic_load(slot) == elem) return elem;
+                mutex_unlock(ELEM_MUTEX(elem));
         }
-        ElemWrapper *ew = array[index];
-        mutex_lock(&ew->mutex);
-        return ew->elem;
+        epoch_exit();
+        LOG(WARN, "Null in array at index %d.", index);
+        return NULL;
 error:
-        LOG(ERROR, "OOB (index %d, bound %d).", index, size - 1);
-        pthread_rwlock_unlock(&rwlock);
+        LOG(ERROR, "OOB (index %d, bound %d).", index,
+            SEGMENT_SIZE * MAX_SEGMENTS - 1);
         LOG_FUNC_ERROR;
         return NULL;
 }
 
-void ra_unlock_elem(int index) {
-        if (!is_index_in_bounds(index)) goto error1;
-        if (!array[index]) goto error2;
-        mutex_unlock(&(array[index]->mutex));
-        pthread_rwlock_unlock(&rwlock);
+void ra_unlock_elem(ELEM_TYPE elem) {
+        if (!elem) goto error;
+        mutex_unlock(ELEM_MUTEX(elem));
+        epoch_exit();
         return;
-error1:
-        LOG(ERROR, "OOB (index %d, bound %d).", index, size - 1);
-        goto error_out;
-error2:
-        LOG(ERROR, "No item at index %d.", index);
-error_out:
-        pthread_rwlock_unlock(&rwlock);
+error:
+        LOG(ERROR, "Unlocking NULL element.");
         LOG_FUNC_ERROR;
 }
 
 ELEM_TYPE ra_remove_elem(int index) {
-        pthread_rwlock_wrlock(&rwlock);
         if (!is_index_in_bounds(index)) goto error;
-        if (!array[index]) {
-                pthread_rwlock_unlock(&rwlock);
-                return NULL;
-        }
-        ElemWrapper *ew = array[index];
-        // No need to lock it. Having the rwlock in write mode means no other
-        // thread has a valid el or will be able to acquire one.
-        mutex_destroy(&ew->mutex);
-        ELEM_TYPE el = ew->elem;
-        array[index] = NULL;
-        free(ew);
-        pthread_rwlock_unlock(&rwlock);
-        return el;
+        Slot *slot = get_slot(index, false);
+        return slot ? atomic_exchange(slot, NULL) : NULL;
 error:
-        LOG(ERROR, "OOB (index %d, bound %d).", index, size - 1);
-        pthread_rwlock_unlock(&rwlock);
+        LOG(ERROR, "OOB (index %d, bound %d).", index,
+            SEGMENT_SIZE * MAX_SEGMENTS - 1);
         LOG_FUNC_ERROR;
         return NULL;
 }
 
-bool ra_is_present(int index) {
-        pthread_rwlock_rdlock(&rwlock);
-        if (!is_index_in_bounds(index)) goto out_false;
-        bool ret = (array[index] != NULL);
-        pthread_rwlock_unlock(&rwlock);
-        return ret;
-out_false:
-        pthread_rwlock_unlock(&rwlock);
-        return false;
+void ra_retire_elem(ELEM_TYPE elem) {
+        if (!elem) return;
+        RetiredNode *node = (RetiredNode *)my_malloc(sizeof(RetiredNode));
+        node->elem = elem;
+        // Any reader that still holds elem announced an epoch <= this one.
+        node->epoch = atomic_fetch_add(&global_epoch, 1);
+        mutex_lock(&retired_mutex);
+        node->next = retired;
+        retired = node;
+        mutex_unlock(&retired_mutex);
+        reclaim();
 }
 
-int ra_get_size(void) {
-        pthread_rwlock_rdlock(&rwlock);
-        int ret = size;
-        pthread_rwlock_unlock(&rwlock);
-        return ret;
+bool ra_is_present(int index) {
+        if (!is_index_in_bounds(index)) return false;
+        Slot *slot = get_slot(index, false);
+        return slot && atomic_load(slot) != NULL;
 }
 
-void ra_free() {
-        pthread_rwlock_rdlock(&rwlock);
-        for (int i = 0; i < size; i++) {
-                if (array[i]) {
-                        // We don't check for errors on this one. This is called
-                        // after fork() and will logically failed if the mutex
-                        // was lock at the time of forking. This is normal.
-                        pthread_mutex_destroy(&array[i]->mutex);
-                        FREE_ELEM(array[i]->elem);
-                        free(array[i]);
+int ra_get_size(void) { return atomic_load(&size); }
+
+void ra_free(void) {
+        for (int i = 0; i < MAX_SEGMENTS; i++) {
+                Slot *seg = atomic_exchange(&segments[i], NULL);
+                if (!seg) continue;
+                for (int j = 0; j < SEGMENT_SIZE; j++) {
+                        ELEM_TYPE elem = atomic_load(&seg[j]);
+                        if (!elem) continue;
+                        // We don't check for errors on this one. This is
+                        // called after fork() and will logically failed if
+                        // the mutex was lock at the time of forking.
+                        pthread_mutex_destroy(ELEM_MUTEX(elem));
+                        FREE_ELEM(elem);
                 }
+                free(seg);
+        }
+        atomic_store(&size, 0);
+
+        mutex_lock(&retired_mutex);
+        while (retired) {
+                RetiredNode *next = retired->next;
+                pthread_mutex_destroy(ELEM_MUTEX(retired->elem));
+                FREE_ELEM(retired->elem);
+                free(retired);
+                retired = next;
+        }
+        mutex_unlock(&retired_mutex);
+}
+
+void ra_reset(void) {
+        // Only the forking thread survives in the child: every other epoch
+        // record belongs to a thread that does not exist anymore.
+        for (ThreadEpoch *te = atomic_load(&thread_epochs); te; te = te->next) {
+                if (te == my_epoch) continue;
+                atomic_store(&te->epoch, 0);
+                atomic_store(&te->in_use, false);
         }
-        free(array);
-        pthread_rwlock_unlock(&rwlock);
-        pthread_rwlock_destroy(&rwlock);
+        pthread_mutex_init(&retired_mutex, NULL);
+        reclaim();
 }
@@ -6,17 +6,21 @@
 #define ELEM_TYPE Socket*  // Elements stored in the array.
 #define FREE_ELEM(elem) \
         free_socket(elem)  // Routine for freeing an element.
-#define MIN_INIT_SIZE 16         // Starting size of array.
-#define GROWTH_FACTOR 2  // Minimum growth factor when the array is expanded.
+#define ELEM_MUTEX(elem) (&(elem)->mutex)  // Lock embedded in an element.
+#define SEGMENT_SIZE 1024  // Number of slots allocated at once.
+#define MAX_SEGMENTS 1024  // Max index is SEGMENT_SIZE * MAX_SEGMENTS - 1.
 
 bool ra_put_elem(int index, ELEM_TYPE elem);
 ELEM_TYPE ra_remove_elem(int index);
 ELEM_TYPE ra_get_and_lock_elem(int index);
-void ra_unlock_elem(int index);
+void ra_unlock_elem(ELEM_TYPE elem);
+// Free an element once no other thread may still access it.
+void ra_retire_elem(ELEM_TYPE elem);
 
 bool ra_is_present(int index);
 int ra_get_size(void);
 
-void ra_free(void);  // Free state.
+void ra_free(void);   // Free state.
+void ra_reset(void);  // Restore a consistent state after fork().
 
 #endif
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+
+#include "ring_buffer.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "lib.h"
+#include "logger.h"
+#include "thread_registry.h"
+
+typedef struct {
+        bool ready;  // Committed but not yet published. Producer only.
+        RB_ELEM_TYPE elem;
+} RingSlot;
+
+typedef struct {
+        ThreadRecord super;
+        atomic_ulong head;       // Next slot to consume.
+        atomic_ulong tail;       // Next slot to publish.
+        unsigned long reserved;  // Next slot to reserve. Producer only.
+        RingSlot slots[RB_SIZE];
+} RingBuffer;
+
+static ThreadRegistry rings = TR_INITIALIZER(RingBuffer, my_calloc, NULL);
+static __thread ThreadRecord *my_ring = NULL;
+
+// Private functions
+
+static RingBuffer *get_ring(void) {
+        if (my_ring) return (RingBuffer *)my_ring;
+        // The pending elements of an adopted ring are simply consumed along
+        // with ours.
+        RingBuffer *rb = (RingBuffer *)tr_adopt(&rings, &my_ring);
+        rb->reserved = atomic_load(&rb->tail);
+        return rb;
+}
+
+/* Public functions */
+
+RB_ELEM_TYPE *rb_reserve(void) {
+        RingBuffer *rb = get_ring();
+        unsigned long head =
+            atomic_load_explicit(&rb->head, memory_order_acquire);
+        if (rb->reserved - head >= RB_SIZE) return NULL;
+        RingSlot *slot = &rb->slots[rb->reserved++ % RB_SIZE];
+        slot->ready = false;
+        return &slot->elem;
+}
+
+void rb_commit(RB_ELEM_TYPE *elem) {
+        RingBuffer *rb = get_ring();
+        RingSlot *slot = (RingSlot *)((char *)elem - offsetof(RingSlot, elem));
+        slot->ready = true;
+
+        unsigned long tail =
+            atomic_load_explicit(&rb->tail, memory_order_relaxed);
+        while (tail != rb->reserved && rb->slots[tail % RB_SIZE].ready) {
+                rb->slots[tail % RB_SIZE].ready = false;
+                tail++;
+        }
+        atomic_store_explicit(&rb->tail, tail, memory_order_release);
+}
+
+void rb_drain(void (*consume)(RB_ELEM_TYPE *)) {
+        for (ThreadRecord *r = atomic_load(&rings.records); r; r = r->next) {
+                RingBuffer *rb = (RingBuffer *)r;
+                unsigned long head =
+                    atomic_load_explicit(&rb->head, memory_order_relaxed);
+                unsigned long tail =
+                    atomic_load_explicit(&rb->tail, memory_order_acquire);
+                for (; head != tail; head++)
+                        consume(&rb->slots[head % RB_SIZE].elem);
+                atomic_store_explicit(&rb->head, head, memory_order_release);
+        }
+}
+
+void rb_free(void) {
+        ThreadRecord *rec = atomic_exchange(&rings.records, NULL);
+        while (rec) {
+                ThreadRecord *next = rec->next;
+                free(rec);
+                rec = next;
+        }
+        my_ring = NULL;
+}
+
+void rb_reset(void) {
+        // Pending elements were recorded by the parent process, which remains
+        // in charge of them. Only the forking thread survives in the child.
+        for (ThreadRecord *r = atomic_load(&rings.records); r; r = r->next) {
+                RingBuffer *rb = (RingBuffer *)r;
+                unsigned long tail = atomic_load(&rb->tail);
+                atomic_store(&rb->head, tail);
+                if (r != my_ring) rb->reserved = tail;
+        }
+        tr_reset(&rings, my_ring);
+}
@@ -0,0 +1,25 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include "sock_events.h"
+
+#define RB_ELEM_TYPE SockEventRecord  // Elements stored in the rings.
+#define RB_SIZE 1024                  // Slots per thread, power of 2.
+
+/* Each thread owns a single-producer ring. Producer functions only touch the
+ * ring of the calling thread and never block. Consumer functions may be
+ * called from any thread but calls must be serialized by the caller. */
+
+// Producer. Returns NULL if the ring of the calling thread is full.
+RB_ELEM_TYPE *rb_reserve(void);
+// Producer. Publish a reserved element. Elements may be committed out of
+// order, they are consumed in reservation order.
+void rb_commit(RB_ELEM_TYPE *elem);
+
+// Consumer. Pass each published element of every ring to consume().
+void rb_drain(void (*consume)(RB_ELEM_TYPE *));
+
+void rb_free(void);   // Free state.
+void rb_reset(void);  // Drop all, after fork().
+
+#endif
@@ -3,7 +3,6 @@
 #include "sock_events.h"
 #include <assert.h>
 #include <dirent.h>
-#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -11,22 +10,29 @@
 #include <pcap/pcap.h>
 #include <poll.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "binary_format.h"
 #include "constants.h"
 #include "init.h"
-#include "json_builder.h"
+#include "json_writer.h"
+#include "latency.h"
 #include "lib.h"
+#include "libc_symbols.h"
 #include "logger.h"
 #include "packet_sniffer.h"
 #include "resizable_array.h"
+#include "ring_buffer.h"
 #include "string_builders.h"
+#include "tcp_info.h"
+#include "thread_cache.h"
+#include "timestamps.h"
 #include "verbose_mode.h"
 
 #ifdef __ANDROID__
@@ -40,6 +46,10 @@ void sock_ev_ghost_socket(int fd);
 
 static pthread_mutex_t connections_count_mutex = MUTEX_ERRORCHECK;
 static int connections_count = 0;
+// Serializes ring buffers consumers and protects Socket events lists.
+static pthread_mutex_t dump_mutex = MUTEX_ERRORCHECK;
+
+uint64_t sock_ev_traced = UINT64_MAX;  // All events until options are read.
 
 /* Private functions */
 
@@ -50,19 +60,16 @@ static Socket *alloc_socket(int fd) {
         connections_count++;
         mutex_unlock(&connections_count_mutex);
         sock->fd = fd;
+        sock->tcp_info_interval = conf_opt_u;
         return sock;
 }
 
-#define CASE_EV(ev_type_cons, ev_type, err_val)               \
-        case ev_type_cons:                                    \
-                ev = (SockEvent *)my_calloc(sizeof(ev_type)); \
-                success = (return_value != err_val);          \
-                break;
+#define CASE_EV(ev_type_cons, ev_type, err_val)      \
+        case ev_type_cons:                           \
+                if (err_value) *err_value = err_val; \
+                return sizeof(ev_type);
 
-static SockEvent *alloc_event(SockEventType type, int return_value, int err,
-                              int id) {
-        bool success;
-        SockEvent *ev;
+static size_t event_size(SockEventType type, int *err_value) {
         switch (type) {
                 CASE_EV(SOCK_EV_SOCKET, SockEvSocket, 0);
                 CASE_EV(SOCK_EV_FORKED_SOCKET, SockEvForkedSocket, -1);
@@ -108,72 +115,552 @@ static SockEvent *alloc_event(SockEventType type, int return_value, int err,
                 CASE_EV(SOCK_EV_EPOLL_WAIT, SockEvEpollWait, -1);
                 CASE_EV(SOCK_EV_EPOLL_PWAIT, SockEvEpollPwait, -1);
                 CASE_EV(SOCK_EV_FDOPEN, SockEvFdopen, 0);
+                CASE_EV(SOCK_EV_COALESCED, SockEvCoalesced, -1);
+                CASE_EV(SOCK_EV_SKIPPED, SockEvSkipped, -1);
+                CASE_EV(SOCK_EV_SUMMARY, SockEvSummary, -1);
+                CASE_EV(SOCK_EV_LATENCY, SockEvLatency, -1);
                 CASE_EV(SOCK_EV_TCP_INFO, SockEvTcpInfo, -1);
         }
-        ev->timestamp_usec = get_time_micros();
+        return sizeof(AnySockEvent);
+}
+
+static void flush_event_rings(void);
+
+static SockEventRecord *reserve_record(void) {
+        SockEventRecord *rec;
+        while (!(rec = rb_reserve())) flush_event_rings();  // Ring is full.
+        rec->sock = NULL;
+        return rec;
+}
+
+// Events are recorded in the ring buffer of the calling thread and become
+// visible to the dumper once pushed with push_event().
+static SockEvent *alloc_event(SockEventType type, int return_value, int err,
+                              int id) {
+        SockEventRecord *rec = reserve_record();
+
+        int err_val;
+        SockEvent *ev = &rec->ev.super;
+        memset(ev, 0, event_size(type, &err_val));
+        bool success = (return_value != err_val);
+        ev->timestamp_ns = ts_now_ns();
         ev->type = type;
         ev->return_value = return_value;
         ev->success = success;
         ev->err = err;
         ev->id = id;
-        ev->thread_id = syscall(SYS_gettid);
+        ev->thread_id = tc_get_tid();
+        tc_count_event();
         return ev;
 }
 
-static void free_event(SockEvent *ev) {
+static SockEventRecord *record_of(SockEvent *ev) {
+        return (SockEventRecord *)((char *)ev -
+                                   offsetof(SockEventRecord, ev.super));
+}
+
+// Drop an event obtained from alloc_event() instead of pushing it. Its
+// payloads stay in the arena of the socket until the next release.
+static void discard_event(SockEvent *ev) {
+        rb_commit(record_of(ev));  // Record has no socket, dumper skips it.
+}
+
+static void commit_event(Socket *sock, SockEvent *ev) {
+        SockEventRecord *rec = record_of(ev);
+        rec->sock = sock;
+        rec->seq = sock->events_count;
+        sock->events_count++;
+        rb_commit(rec);
+        return;
+}
+
+/* Coalescing */
+
+static bool get_data_event(const SockEvent *ev, size_t *bytes, int *flags) {
+        const AnySockEvent *any = (const AnySockEvent *)ev;
+        *flags = 0;
         switch (ev->type) {
-                case SOCK_EV_GETSOCKOPT:
-                        free(((SockEvGetsockopt *)ev)->sockopt.optval);
+                case SOCK_EV_SEND:
+                        *bytes = any->send.bytes;
+                        *flags = any->send.flags;
+                        return true;
+                case SOCK_EV_RECV:
+                        *bytes = any->recv.bytes;
+                        *flags = any->recv.flags;
+                        return true;
+                case SOCK_EV_WRITE:
+                        *bytes = any->write.bytes;
+                        return true;
+                case SOCK_EV_READ:
+                        *bytes = any->read.bytes;
+                        return true;
+                case SOCK_EV_SENDFILE:
+                        *bytes = any->sendfile.bytes;
+                        return true;
+                default:
+                        return false;
+        }
+}
+
+static void set_data_event(SockEvent *ev, size_t bytes, int flags) {
+        AnySockEvent *any = (AnySockEvent *)ev;
+        switch (ev->type) {
+                case SOCK_EV_SEND:
+                        any->send.bytes = bytes;
+                        any->send.flags = flags;
+                        break;
+                case SOCK_EV_RECV:
+                        any->recv.bytes = bytes;
+                        any->recv.flags = flags;
+                        break;
+                case SOCK_EV_WRITE:
+                        any->write.bytes = bytes;
                         break;
-                case SOCK_EV_SETSOCKOPT:
-                        free(((SockEvSetsockopt *)ev)->sockopt.optval);
+                case SOCK_EV_READ:
+                        any->read.bytes = bytes;
                         break;
+                case SOCK_EV_SENDFILE:
+                        any->sendfile.bytes = bytes;
+                        break;
+                default:
+                        break;
+        }
+}
+
+// Push the pending run, as a plain event if it holds a single one.
+static void flush_run(Socket *sock) {
+        SockEvCoalesced *run = &sock->run;
+        if (!run->count) return;
+        SockEventRecord *rec = reserve_record();
+        SockEvent *ev = &rec->ev.super;
+        if (run->count == 1) {
+                memset(ev, 0, event_size(run->ev_type, NULL));
+                *ev = run->super;
+                ev->type = run->ev_type;
+                set_data_event(ev, sock->run_bytes, run->flags);
+        } else {
+                memcpy(ev, run, sizeof(SockEvCoalesced));
+        }
+        ev->id = sock->events_count;
+        commit_event(sock, ev);
+        run->count = 0;
+}
+
+static bool extends_run(const SockEvCoalesced *run, const SockEvent *ev,
+                        int flags) {
+        return run->count && run->ev_type == ev->type && run->flags == flags &&
+               run->super.thread_id == ev->thread_id;
+}
+
+// Add the event to the pending run. Returns false if it cannot be coalesced:
+// failed calls and those which transferred nothing (e.g. recv() at EOF) are
+// pushed as they are. A run adds up the bytes transferred, not requested.
+static bool coalesce_event(Socket *sock, SockEvent *ev) {
+        SockEvCoalesced *run = &sock->run;
+        size_t bytes;
+        int flags;
+        if (!ev->success || ev->return_value <= 0 ||
+            !get_data_event(ev, &bytes, &flags))
+                return false;
+
+        size_t transferred = ev->return_value;
+        if (!extends_run(run, ev, flags)) {
+                flush_run(sock);
+                run->super = *ev;
+                run->super.type = SOCK_EV_COALESCED;
+                run->ev_type = ev->type;
+                run->flags = flags;
+                run->bytes = 0;
+                run->min_bytes = transferred;
+                run->max_bytes = transferred;
+                sock->run_bytes = bytes;
+        }
+        run->count++;
+        run->bytes += transferred;
+        if (transferred < run->min_bytes) run->min_bytes = transferred;
+        if (transferred > run->max_bytes) run->max_bytes = transferred;
+        run->last_timestamp_ns = ev->timestamp_ns;
+        discard_event(ev);
+        return true;
+}
+
+/* Summary */
+
+static void count_error(SockSummary *sum, int err) {
+        for (int i = 0; i < SUMMARY_ERRNOS; i++) {
+                if (!sum->errors[i].count) sum->errors[i].err = err;
+                if (sum->errors[i].err != err) continue;
+                sum->errors[i].count++;
+                return;
+        }
+        sum->other_errors++;
+}
+
+static bool is_receive(SockEventType type) {
+        switch (type) {
+                case SOCK_EV_RECV:
+                case SOCK_EV_RECVFROM:
+                case SOCK_EV_RECVMSG:
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+                case SOCK_EV_RECVMMSG:
+#endif
+                case SOCK_EV_READ:
                 case SOCK_EV_READV:
-                        free(((SockEvReadv *)ev)->iovec.iovec_sizes);
+                        return true;
+                default:
+                        return false;
+        }
+}
+
+static void summarize_event(Socket *sock, const SockEvent *ev) {
+        const AnySockEvent *any = (const AnySockEvent *)ev;
+        SockSummary *sum = &sock->summary;
+        sum->calls[ev->type]++;
+        if (!ev->success) count_error(sum, ev->err);
+        sock->summary_changed = true;
+
+        switch (ev->type) {
+                case SOCK_EV_CONNECT:
+                        if (sum->start_ns) break;
+                        sum->start_ns = ev->timestamp_ns;
+                        sum->peer = any->connect.addr;
+                        break;
+                case SOCK_EV_ACCEPT:
+                case SOCK_EV_ACCEPT4:
+                        // Only for the accepted socket, not the listening one.
+                        if (sum->start_ns || sum->calls[SOCK_EV_LISTEN]) break;
+                        sum->start_ns = ev->timestamp_ns;
+                        sum->peer = (ev->type == SOCK_EV_ACCEPT)
+                                        ? any->accept.addr
+                                        : any->accept4.addr;
+                        break;
+                case SOCK_EV_TCP_INFO:
+                        if (!ev->success) break;
+                        // The encoder holds the full sample.
+                        memcpy(&sum->tcp_info, sock->ti_encoder.words,
+                               sizeof(TcpInfo));
+                        sum->tcp_info_len = any->tcp_info.len;
+                        sum->tcp_limited_by = ti_limited_by(
+                            NULL, &sum->tcp_info, sum->tcp_info_len, 0);
                         break;
+                default:
+                        if (is_receive(ev->type) && ev->return_value > 0 &&
+                            sum->start_ns && !sum->first_byte_ns)
+                                sum->first_byte_ns = ev->timestamp_ns;
+                        break;
+        }
+}
+
+static void push_summary(Socket *sock) {
+        if (!sock->summary_changed) return;
+        SockEvSummary *ev = (SockEvSummary *)alloc_event(SOCK_EV_SUMMARY, 0, 0,
+                                                         sock->events_count);
+        ev->sock_info = sock->sock_info;
+        ev->bytes_sent = sock->bytes_sent;
+        ev->bytes_received = sock->bytes_received;
+        ev->summary = (SockSummary *)arena_alloc(&sock->payload_arena,
+                                                 sizeof(SockSummary));
+        memcpy(ev->summary, &sock->summary, sizeof(SockSummary));
+        commit_event(sock, (SockEvent *)ev);
+        sock->summary_changed = false;
+}
+
+/* Latency */
+
+// The socket must be locked.
+static void record_latency(Socket *sock, const SockEvent *ev) {
+        uint64_t ns;
+        if (!lat_take(ev->type, &ns)) return;
+        if (!sock->latency)
+                sock->latency = (Histogram **)arena_calloc(
+                    &sock->payload_arena, LAT_CALLS * sizeof(Histogram *));
+        Histogram **h = &sock->latency[ev->type];
+        if (!*h)
+                *h = (Histogram *)arena_calloc(&sock->payload_arena,
+                                               sizeof(Histogram));
+        hist_record(*h, ns);
+}
+
+// The histograms move to the event, the next ones start empty.
+static void push_latency(Socket *sock) {
+        if (!sock->latency) return;
+        SockEvLatency *ev = (SockEvLatency *)alloc_event(SOCK_EV_LATENCY, 0, 0,
+                                                         sock->events_count);
+        ev->histograms = sock->latency;
+        sock->latency = NULL;
+        commit_event(sock, (SockEvent *)ev);
+}
+
+static void push_event(Socket *sock, SockEvent *ev) {
+        if (conf_opt_z > 0) {
+                summarize_event(sock, ev);
+                discard_event(ev);
+                return;
+        }
+        if (conf_opt_g > 0 && coalesce_event(sock, ev)) return;
+        flush_run(sock);
+        commit_event(sock, ev);
+}
+
+/* Consumer side of the ring buffers. Records are copied to the events list
+ * of their socket, ordered by seq: a socket used by several threads gets its
+ * events from several rings, which are not drained atomically. */
+static void stage_record(SockEventRecord *rec) {
+        Socket *sock = rec->sock;
+        if (!sock) return;  // Discarded.
+
+        size_t size = event_size(rec->ev.super.type, NULL);
+        SockEventNode *node = (SockEventNode *)arena_alloc(
+            &sock->events_arena, sizeof(SockEventNode) + size);
+        node->data = (SockEvent *)(node + 1);
+        memcpy(node->data, &rec->ev, size);
+        node->seq = rec->seq;
+
+        if (!sock->tail || sock->tail->seq < node->seq) {
+                node->next = NULL;
+                if (!sock->head)
+                        sock->head = node;
+                else
+                        sock->tail->next = node;
+                sock->tail = node;
+                return;
+        }
+
+        SockEventNode **cur = &sock->head;
+        while ((*cur)->seq < node->seq) cur = &(*cur)->next;
+        node->next = *cur;
+        *cur = node;
+}
+
+static void flush_event_rings(void) {
+        mutex_lock(&dump_mutex);
+        rb_drain(stage_record);
+        mutex_unlock(&dump_mutex);
+}
+
+/* Sampling */
+
+static bool is_sampled(SockEventType type) {
+        switch (type) {
+                case SOCK_EV_SEND:
+                case SOCK_EV_RECV:
+                case SOCK_EV_SENDTO:
+                case SOCK_EV_RECVFROM:
+                case SOCK_EV_SENDMSG:
+                case SOCK_EV_RECVMSG:
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+                case SOCK_EV_SENDMMSG:
+                case SOCK_EV_RECVMMSG:
+#endif
+                case SOCK_EV_WRITE:
+                case SOCK_EV_READ:
                 case SOCK_EV_WRITEV:
-                        free(((SockEvWritev *)ev)->iovec.iovec_sizes);
+                case SOCK_EV_READV:
+                case SOCK_EV_SENDFILE:
+                case SOCK_EV_POLL:
+                case SOCK_EV_PPOLL:
+                case SOCK_EV_SELECT:
+                case SOCK_EV_PSELECT:
+                case SOCK_EV_EPOLL_WAIT:
+                case SOCK_EV_EPOLL_PWAIT:
+                        return true;
+                default:
+                        return false;
+        }
+}
+
+// Count bytes as the sock_ev_*() hooks do in bytes_sent & bytes_received.
+static void count_skipped_bytes(Sampler *s, const SockEvent *ev) {
+        const AnySockEvent *any = (const AnySockEvent *)ev;
+        switch (ev->type) {
+                case SOCK_EV_SEND:
+                        s->skipped_bytes_sent += any->send.bytes;
+                        break;
+                case SOCK_EV_RECV:
+                        s->skipped_bytes_received += any->recv.bytes;
+                        break;
+                case SOCK_EV_SENDTO:
+                        s->skipped_bytes_sent += any->sendto.bytes;
+                        break;
+                case SOCK_EV_RECVFROM:
+                        s->skipped_bytes_received += any->recvfrom.bytes;
+                        break;
+                case SOCK_EV_SENDMSG:
+                        s->skipped_bytes_sent += any->sendmsg.bytes;
+                        break;
+                case SOCK_EV_RECVMSG:
+                        s->skipped_bytes_received += any->recvmsg.bytes;
                         break;
 #if !defined(__ANDROID__) || __ANDROID_API__ >= 21
                 case SOCK_EV_SENDMMSG:
-                        free(((SockEvSendmmsg *)ev)->mmsghdr_vec);
+                        s->skipped_bytes_sent += any->sendmmsg.bytes;
                         break;
                 case SOCK_EV_RECVMMSG:
-                        free(((SockEvRecvmmsg *)ev)->mmsghdr_vec);
+                        s->skipped_bytes_received += any->recvmmsg.bytes;
                         break;
 #endif
-                case SOCK_EV_FDOPEN:
-                        free(((SockEvFdopen *)ev)->mode);
+                case SOCK_EV_WRITE:
+                        s->skipped_bytes_sent += any->write.bytes;
+                        break;
+                case SOCK_EV_READ:
+                        s->skipped_bytes_received += any->read.bytes;
+                        break;
+                case SOCK_EV_WRITEV:
+                        s->skipped_bytes_sent += any->writev.bytes;
+                        break;
+                case SOCK_EV_READV:
+                        s->skipped_bytes_received += any->readv.bytes;
+                        break;
+                case SOCK_EV_SENDFILE:
+                        s->skipped_bytes_received += any->sendfile.bytes;
                         break;
                 default:
                         break;
         }
-        free(ev);
 }
 
-static void free_events_list(SockEventNode *head) {
-        SockEventNode *tmp;
-        while (head != NULL) {
-                free_event(head->data);
-                tmp = head;
-                head = head->next;
-                free(tmp);
-        }
+static void skip_event(Sampler *s, const SockEvent *ev) {
+        s->skipped++;
+        count_skipped_bytes(s, ev);
+        s->last_skipped_ns = ev->timestamp_ns;
 }
 
-static void push_event(Socket *sock, SockEvent *ev) {
-        SockEventNode *node = (SockEventNode *)my_malloc(sizeof(SockEventNode));
-        node->data = ev;
-        node->next = NULL;
+static void push_skipped_event(Socket *sock) {
+        Sampler *s = &sock->sampler;
+        if (!s->skipped) return;
+        SockEvSkipped *ev = (SockEvSkipped *)alloc_event(
+            SOCK_EV_SKIPPED, 0, 0, sock->events_count);
+        ev->super.timestamp_ns = s->last_skipped_ns;
+        ev->events = s->skipped;
+        ev->bytes_sent = s->skipped_bytes_sent;
+        ev->bytes_received = s->skipped_bytes_received;
+        push_event(sock, (SockEvent *)ev);
+        s->skipped = 0;
+        s->skipped_bytes_sent = 0;
+        s->skipped_bytes_received = 0;
+}
 
-        if (!sock->head)
-                sock->head = node;
-        else
-                sock->tail->next = node;
+static long reservoir_size(const Sampler *s) {
+        return (long)s->candidates < conf_opt_m ? (long)s->candidates
+                                                : conf_opt_m;
+}
 
-        sock->tail = node;
-        sock->events_count++;
-        return;
+static uint64_t next_random(Sampler *s) {
+        // xorshift64
+        s->rng ^= s->rng << 13;
+        s->rng ^= s->rng >> 7;
+        s->rng ^= s->rng << 17;
+        return s->rng;
+}
+
+// Algorithm R: the event replaces a random one once the reservoir is full.
+static void offer_to_reservoir(Socket *sock, SockEvent *ev) {
+        Sampler *s = &sock->sampler;
+        if (!s->reservoir) {
+                s->reservoir = (AnySockEvent *)my_malloc(
+                    sizeof(AnySockEvent) * conf_opt_m);
+                s->arrivals = (SampleArrival *)my_malloc(
+                    sizeof(SampleArrival) * conf_opt_m);
+                s->rng = (ts_now_ns() ^ ((uint64_t)sock->id << 32)) | 1;
+        }
+
+        unsigned long slot = s->candidates++;
+        if (slot >= (unsigned long)conf_opt_m) {
+                slot = next_random(s) % s->candidates;
+                if (slot >= (unsigned long)conf_opt_m) {
+                        skip_event(s, ev);
+                        discard_event(ev);
+                        return;
+                }
+                skip_event(s, &s->reservoir[slot].super);
+        }
+        memcpy(&s->reservoir[slot], ev, event_size(ev->type, NULL));
+        s->arrivals[slot].rank = s->candidates;
+        s->arrivals[slot].slot = slot;
+        rb_commit(record_of(ev));  // The reservoir now owns the payload.
+}
+
+static void push_event_copy(Socket *sock, const SockEvent *ev) {
+        SockEventRecord *rec = reserve_record();
+        memcpy(&rec->ev, ev, event_size(ev->type, NULL));
+        rec->ev.super.id = sock->events_count;
+        push_event(sock, &rec->ev.super);
+}
+
+static int compare_arrivals(const void *a, const void *b) {
+        unsigned long x = ((const SampleArrival *)a)->rank;
+        unsigned long y = ((const SampleArrival *)b)->rank;
+        return (x > y) - (x < y);
+}
+
+// Push the events of the reservoir in arrival order. The arrivals are
+// sorted in place: the slots are refilled from the first one.
+static void empty_reservoir(Socket *sock) {
+        Sampler *s = &sock->sampler;
+        long size = reservoir_size(s);
+        qsort(s->arrivals, size, sizeof(SampleArrival), compare_arrivals);
+        for (long i = 0; i < size; i++)
+                push_event_copy(sock, &s->reservoir[s->arrivals[i].slot].super);
+        s->candidates = 0;
+}
+
+// Push the events held back by sampling. The socket must be locked.
+static void flush_sampler(Socket *sock) {
+        if (sock->sampler.candidates) empty_reservoir(sock);
+        push_skipped_event(sock);
+}
+
+// Push the events held back by sampling, coalescing, latency histograms or
+// summary mode, before a dump.
+static void flush_held_events(Socket *sock) {
+        flush_sampler(sock);
+        flush_run(sock);
+        push_latency(sock);
+        push_summary(sock);
+}
+
+static void free_sampler(Sampler *s) {
+        if (!s->reservoir) return;
+        free(s->reservoir);
+        free(s->arrivals);
+}
+
+// Push the event, or hold it back if it is not sampled.
+static void sample_event(Socket *sock, SockEvent *ev) {
+        Sampler *s = &sock->sampler;
+        if ((!is_sampled(ev->type) || conf_opt_z > 0) && s->candidates) {
+                // Records are consumed in reservation order: the reservoir,
+                // up to -m events, cannot be pushed behind the record of ev
+                // while it is uncommitted. Release it and push a copy.
+                AnySockEvent copy;
+                memcpy(&copy, ev, event_size(ev->type, NULL));
+                discard_event(ev);
+                flush_sampler(sock);
+                push_event_copy(sock, &copy.super);
+                return;
+        }
+        if (!is_sampled(ev->type) || conf_opt_z > 0) {
+                flush_sampler(sock);
+                push_event(sock, ev);
+                return;
+        }
+
+        bool keep = true;
+        if (conf_opt_s > 1) keep = (s->seen++ % conf_opt_s == 0);
+        if (keep && conf_opt_i > 0) {
+                keep = (ev->timestamp_ns - s->last_kept_ns >=
+                        (uint64_t)conf_opt_i * 1000);
+                if (keep) s->last_kept_ns = ev->timestamp_ns;
+        }
+        if (!keep) {
+                skip_event(s, ev);
+                discard_event(ev);
+        } else if (conf_opt_m > 0) {
+                offer_to_reservoir(sock, ev);
+        } else {
+                push_skipped_event(sock);
+                push_event(sock, ev);
+        }
 }
 
 #define SOCK_TYPE_MASK 0b1111
@@ -226,43 +713,53 @@ static void fill_poll_events(PollEvents *pe, int events) {
         pe->pollnval = (events & POLLNVAL);
 }
 
-static socklen_t fill_iovec(Iovec *iov1, const struct iovec *iov2,
-                            int iovec_count) {
+// Copy of a member too large to be stored inline in its event.
+static void *spill(Arena *arena, const void *src, size_t len) {
+        void *copy = arena_alloc(arena, len);
+        memcpy(copy, src, len);
+        return copy;
+}
+
+static socklen_t fill_iovec(Arena *arena, Iovec *iov1,
+                            const struct iovec *iov2, int iovec_count) {
         iov1->iovec_count = iovec_count;
         if (iovec_count <= 0) return 0;
 
-        iov1->iovec_sizes = (size_t *)my_malloc(sizeof(size_t *) * iovec_count);
+        size_t *sizes = iov1->sizes.inline_sizes;
+        if (is_iovec_spilled(iov1))
+                sizes = iov1->sizes.spilled = (size_t *)arena_alloc(
+                    arena, sizeof(size_t) * iovec_count);
         socklen_t bytes = 0;
         for (int i = 0; i < iovec_count; i++) {
-                if (iov1->iovec_sizes) iov1->iovec_sizes[i] = iov2[i].iov_len;
+                sizes[i] = iov2[i].iov_len;
                 bytes += iov2[i].iov_len;
         }
         return bytes;
 }
 
-static socklen_t fill_msghdr(Msghdr *m1, const struct msghdr *m2) {
-        // We copy the msg_control fields of the "struct msghdr" to another
-        // such struct, since we must have such a struct available later to
-        // use the CMSG macros for extracting the ancillary data.
-
+static socklen_t fill_msghdr(Arena *arena, Msghdr *m1,
+                             const struct msghdr *m2) {
         // Msg name
         if (m2->msg_name) memcpy(&m1->addr, m2->msg_name, m2->msg_namelen);
 
-        // Control data (ancillary data)
-        m1->msghdr = my_calloc(sizeof(struct msghdr));
-        m1->msghdr->msg_controllen = m2->msg_controllen;
-        if (m2->msg_controllen)
-                m1->msghdr->msg_control = my_malloc(m2->msg_controllen);
-        memcpy(m1->msghdr->msg_control, m2->msg_control, m2->msg_controllen);
+        // Control data (ancillary data), kept to extract the headers with the
+        // CMSG macros when the event is dumped.
+        m1->control_len = m2->msg_control ? m2->msg_controllen : 0;
+        if (is_control_spilled(m1))
+                m1->control.spilled =
+                    spill(arena, m2->msg_control, m1->control_len);
+        else if (m1->control_len)
+                memcpy(m1->control.inline_data, m2->msg_control,
+                       m1->control_len);
 
         // Flags
         m1->flags = m2->msg_flags;
 
         // Iovec
-        return fill_iovec(&m1->iovec, m2->msg_iov, m2->msg_iovlen);
+        return fill_iovec(arena, &m1->iovec, m2->msg_iov, m2->msg_iovlen);
 }
 
-static unsigned int fill_mmsghdr_vec(Mmsghdr *mmsghdr_vec1,
+static unsigned int fill_mmsghdr_vec(Arena *arena, Mmsghdr *mmsghdr_vec1,
                                      const struct mmsghdr *mmsghdr_vec2,
                                      unsigned int vlen) {
         unsigned int bytes = 0;
@@ -270,31 +767,29 @@ static unsigned int fill_mmsghdr_vec(Mmsghdr *mmsghdr_vec1,
                 const struct mmsghdr *mmsghdr2 = (mmsghdr_vec2 + i);
                 Mmsghdr *mmsghdr1 = (mmsghdr_vec1 + i);
                 mmsghdr1->bytes_transmitted = mmsghdr2->msg_len;
-                bytes += fill_msghdr(&mmsghdr1->msghdr, &mmsghdr2->msg_hdr);
+                bytes += fill_msghdr(arena, &mmsghdr1->msghdr,
+                                     &mmsghdr2->msg_hdr);
         }
         return bytes;
 }
 
-static void fill_sockopt(Sockopt *sockopt, int level, int optname,
-                         const void *optval, socklen_t optlen) {
+static void fill_sockopt(Arena *arena, Sockopt *sockopt, int level,
+                         int optname, const void *optval, socklen_t optlen) {
         sockopt->level = level;
         sockopt->optname = optname;
-        sockopt->optlen = optlen;
-        sockopt->optval = my_malloc(optlen);
-        memcpy(sockopt->optval, optval, optlen);
+        sockopt->optlen = optval ? optlen : 0;
+        if (is_sockopt_spilled(sockopt))
+                sockopt->optval.spilled = spill(arena, optval, optlen);
+        else if (sockopt->optlen)
+                memcpy(sockopt->optval.inline_val, optval, optlen);
         return;
 }
 
-typedef int (*orig_bind_type)(int fd, const struct sockaddr *addr,
-                              socklen_t len);
-orig_bind_type orig_bind;
-
 #define MIN_PORT 32768  // cat /proc/sys/net/ipv4/ip_local_port_range
 #define MAX_PORT 60999
 static int force_bind(int fd, Socket *sock, bool IPV6) {
         LOG(INFO, "Forcing bind on connection %d.", sock->id);
         LOG_FUNC_INFO;
-        if (!orig_bind) orig_bind = (orig_bind_type)dlsym(RTLD_NEXT, "bind");
 
         for (int port = MIN_PORT; port <= MAX_PORT; port++) {
                 int rc;
@@ -303,13 +798,13 @@ static int force_bind(int fd, Socket *sock, bool IPV6) {
                         a.sin6_family = AF_INET6;
                         a.sin6_port = htons(port);  // Any port
                         a.sin6_addr = in6addr_any;
-                        rc = orig_bind(fd, (struct sockaddr *)&a, sizeof(a));
+                        rc = ORIG(bind)(fd, (struct sockaddr *)&a, sizeof(a));
                 } else {
                         struct sockaddr_in a;
                         a.sin_family = AF_INET;
                         a.sin_port = htons(port);
                         a.sin_addr.s_addr = INADDR_ANY;
-                        rc = orig_bind(fd, (struct sockaddr *)&a, sizeof(a));
+                        rc = ORIG(bind)(fd, (struct sockaddr *)&a, sizeof(a));
                 }
                 if (rc == 0) return 0;                 // Sucessfull bind. Stop.
                 if (errno != EADDRINUSE) goto error1;  // Unexpected error.
@@ -326,76 +821,102 @@ error_out:
         return -1;
 }
 
-static void dump_events_as_json(Socket *sock) {
+// Whether events not dumped yet may refer to the payload arena: events in
+// the rings or in the list, sampled events and latency histograms.
+static bool holds_payloads(const Socket *sock) {
+        return sock->dumped_count < sock->events_count ||
+               sock->sampler.candidates || sock->latency;
+}
+
+// The socket must be locked.
+static void dump_events(Socket *sock) {
         if (OPT_D == NULL) goto error1;
         LOG_FUNC_INFO;
-        char *json_str, *json_file_str;
-
-        if (!(json_file_str = alloc_json_path_str(sock))) goto error_out;
-        FILE *fp = fopen(json_file_str, "a");
-        free(json_file_str);
-        if (!fp) goto error_out;
+        bool binary = (conf_opt_r > 0);
+
+        mutex_lock(&dump_mutex);
+        rb_drain(stage_record);
+        // Events are dumped in order, possibly waiting for missing ones.
+        if (!sock->head || sock->head->seq != sock->dumped_count) goto exit;
+
+        if (!sock->trace_file) {
+                char *file_path = binary ? alloc_bin_path_str(sock)
+                                         : alloc_json_path_str(sock);
+                if (!file_path) goto error_out;
+                sock->trace_file = tw_open(file_path);
+                free(file_path);
+                // A binary trace starts with its header.
+                if (binary) write_bin_header(sock->trace_file);
+        }
 
-        SockEventNode *tmp, *cur = sock->head;
-        while (cur != NULL) {
+        // Events are only buffered here, the trace writer does the I/O.
+        SockEventNode *cur = sock->head;
+        while (cur != NULL && cur->seq == sock->dumped_count) {
                 SockEvent *ev = cur->data;
-                if (!(json_str = alloc_sock_ev_json(ev))) goto error_out;
-
-                my_fputs(json_str, fp);
-                my_fputs("\n", fp);
-
-                free(json_str);
-                free_event(cur->data);
-                tmp = cur;
-                cur = cur->next;
-                free(tmp);
+                // tcp_info samples are deltas: none may be missing.
+                if (ev->type != SOCK_EV_TCP_INFO && tw_is_full()) {
+                        tw_drop();
+                } else if (binary) {
+                        write_sock_ev_bin(ev, sock->trace_file);
+                } else {
+                        if (ev->type == SOCK_EV_TCP_INFO)
+                                ti_decode(&sock->ti_decoder,
+                                          (SockEvTcpInfo *)ev);
+                        size_t len;
+                        const char *json_str =
+                            sock_ev_json(ev, &sock->addr_cache, &len);
+                        tw_append(sock->trace_file, json_str, len);
+                        tw_append(sock->trace_file, "\n", 1);
+                }
+                sock->head = cur->next;
+                cur = sock->head;
+                sock->dumped_count++;
         }
-        sock->head = NULL;
-        sock->tail = NULL;
-
-        if (fclose(fp) == EOF) goto error2;
+        if (!sock->head) {
+                sock->tail = NULL;
+                arena_reset(&sock->events_arena);
+        }
+        if (!holds_payloads(sock)) arena_reset(&sock->payload_arena);
+exit:
+        mutex_unlock(&dump_mutex);
         return;
-error2:
-        LOG(ERROR, "fclose() failed. %s.", strerror(errno));
-        goto error_out;
 error1:
         LOG(ERROR, "OPT_D is NULL.");
+        LOG_FUNC_ERROR;
+        return;
 error_out:
+        mutex_unlock(&dump_mutex);
         LOG_FUNC_ERROR;
         return;
 }
 
-static void tcp_dump_tcp_info(int fd) {
-        struct tcp_info *info =
-            (struct tcp_info *)my_malloc(sizeof(struct tcp_info));
-        int ret = fill_tcp_info(fd, info);
-        int err = errno;
-        sock_ev_tcp_info(fd, ret, err, info);
+// As is_tcp_socket(), without a syscall.
+static bool has_tcp_info(const Socket *sock) {
+        const SockInfo *si = &sock->sock_info;
+        if (!si->filled) return is_tcp_socket(sock->fd);
+        return (si->domain == AF_INET || si->domain == AF_INET6) &&
+               si->type == SOCK_STREAM;
 }
 
-static bool should_dump_tcp_info(const Socket *sock) {
-        if (!is_tcp_socket(sock->fd)) return false;
-
-        if (conf_opt_u > 0) {
-                long cur_time = get_time_micros();
-                long time_elasped = cur_time - sock->last_info_dump_micros;
-                if (time_elasped > conf_opt_u) return true;
-        }
-
-        if (conf_opt_b > 0) {
-                long cur_bytes = sock->bytes_sent + sock->bytes_received;
-                long bytes_elapsed = cur_bytes - sock->last_info_dump_bytes;
-                if (bytes_elapsed > conf_opt_b) return true;
-        }
-
-        return false;
+/* Cheap enough for every event: the sampler does the TCP_INFO call. */
+static void check_tcp_info_bytes(Socket *sock) {
+        if (conf_opt_b <= 0 || sock->tcp_info_requested) return;
+        long bytes = sock->bytes_sent + sock->bytes_received;
+        if (bytes - sock->last_info_dump_bytes <= conf_opt_b) return;
+        if (!is_traced(SOCK_EV_TCP_INFO) || !has_tcp_info(sock)) return;
+        sock->tcp_info_requested = true;
+        ti_request();
 }
 
 /* Public functions */
 
 void free_socket(Socket *sock) {
         if (!sock) return;  // NULL
-        free_events_list(sock->head);
+        flush_event_rings();  // No record may refer to sock anymore.
+        // Events, their nodes and their payloads are all in the arenas.
+        arena_free(&sock->events_arena);
+        arena_free(&sock->payload_arena);
+        free_sampler(&sock->sampler);
         free(sock);
 }
 
@@ -403,7 +924,7 @@ void sock_start_capture(int fd, const struct sockaddr *addr_to) {
         LOG(INFO, "Starting packet capture.");
         LOG_FUNC_INFO;
         Socket *sock = ra_get_and_lock_elem(fd);
-        if (!sock) goto error_out;
+        if (!sock) goto error;
 
         // We force a bind if the socket is not bound. This allows us to know
         // the source port and use a more specific filter for the capture.
@@ -423,27 +944,36 @@ void sock_start_capture(int fd, const struct sockaddr *addr_to) {
         sock->capture_switch = start_capture(capture_filter, pcap_file_path);
 
         free(pcap_file_path);
-        ra_unlock_elem(fd);
+        ra_unlock_elem(sock);
         return;
 error1:
         free(pcap_file_path);
 error_out:
-        ra_unlock_elem(fd);
+        ra_unlock_elem(sock);
+error:
         LOG_FUNC_ERROR;
         return;
 }
 
 void log_event(LogLevel lvl, int ev_type_cons, int fd, int con_id) {
+        if (!LOG_ENABLED(lvl)) return;
         const char *ev_name = string_from_sock_event_type(ev_type_cons);
         LOG(lvl, "%s on connection %d (fd %d).", ev_name, con_id, fd);
 }
 
 void free_and_dump_socket(int fd) {
         Socket *sock = ra_remove_elem(fd);
+        if (!sock) return;
+        // Wait for any thread still holding the socket before dumping it.
+        mutex_lock(&sock->mutex);
         if (sock->capture_switch != NULL)
                 stop_capture(sock->capture_switch, sock->rtt * 2);
-        dump_events_as_json(sock);
-        free_socket(sock);
+        flush_held_events(sock);
+        dump_events(sock);
+        if (sock->trace_file) tw_close(sock->trace_file);
+        sock->trace_file = NULL;
+        mutex_unlock(&sock->mutex);
+        ra_retire_elem(sock);
 }
 
 // Used for any event that duplicates a socket, such as dup() or accept().
@@ -462,26 +992,31 @@ void free_and_dump_socket(int fd) {
                 memcpy(&new_ev->sock_info, &sock->sock_info,           \
                        sizeof(SockInfo));                              \
                 push_event(new_sock, (SockEvent *)new_ev);             \
-                ra_unlock_elem(fd);                                    \
+                ra_unlock_elem(sock);                                  \
                 ra_put_elem(ret, new_sock);                            \
                 sock = ra_get_and_lock_elem(fd);                       \
+                if (!sock) {                                           \
+                        discard_event((SockEvent *)ev);                \
+                        return;                                        \
+                }                                                      \
         }
 
 #define SOCK_EV_PRELUDE(ev_type_cons, ev_type)                       \
         init_tcpsnitch();                                            \
+        if (!is_traced(ev_type_cons)) return; /* Before init. */     \
         if (!ra_is_present(fd)) sock_ev_ghost_socket(fd);            \
         Socket *sock = ra_get_and_lock_elem(fd);                     \
+        if (!sock) return; /* Closed concurrently. */                \
         log_event(INFO, ev_type_cons, fd, sock->id);                 \
         ev_type *ev = (ev_type *)alloc_event(ev_type_cons, ret, err, \
                                              sock->events_count);
 
-#define SOCK_EV_POSTLUDE(ev_type_cons)                                      \
-        push_event(sock, (SockEvent *)ev);                                  \
-        output_event((SockEvent *)ev);                                      \
-        bool dump_tcp_info =                                                \
-            should_dump_tcp_info(sock) && ev_type_cons != SOCK_EV_TCP_INFO; \
-        ra_unlock_elem(fd);                                                 \
-        if (dump_tcp_info) tcp_dump_tcp_info(fd);
+#define SOCK_EV_POSTLUDE(ev_type_cons)         \
+        output_event((SockEvent *)ev);         \
+        record_latency(sock, (SockEvent *)ev); \
+        sample_event(sock, (SockEvent *)ev);   \
+        check_tcp_info_bytes(sock);            \
+        ra_unlock_elem(sock);
 
 const char *string_from_sock_event_type(SockEventType type) {
         static const char *strings[] = {
@@ -529,18 +1064,91 @@ const char *string_from_sock_event_type(SockEventType type) {
                 "epoll_wait",
                 "epoll_pwait",
                 "fdopen",
+                "coalesced",
+                "skipped",
+                "summary",
+                "latency",
                 "tcp_info"
         };
         assert(sizeof(strings) / sizeof(char *) == SOCK_EV_TCP_INFO + 1);
         return strings[type];
 }
 
+size_t sizeof_sock_ev(SockEventType type) { return event_size(type, NULL); }
+
+#define EV_BIT(type) ((uint64_t)1 << (type))
+#define NOT_CALLS                                                       \
+        (EV_BIT(SOCK_EV_FORKED_SOCKET) | EV_BIT(SOCK_EV_GHOST_SOCKET) | \
+         EV_BIT(SOCK_EV_COALESCED) | EV_BIT(SOCK_EV_SKIPPED) |          \
+         EV_BIT(SOCK_EV_SUMMARY) | EV_BIT(SOCK_EV_LATENCY))
+
+typedef struct {
+        const char *name;
+        int types[16];  // Ends with -1.
+} EventGroup;
+
+static const EventGroup groups[] = {
+    {"lifecycle",
+     {SOCK_EV_SOCKET, SOCK_EV_BIND, SOCK_EV_CONNECT, SOCK_EV_SHUTDOWN,
+      SOCK_EV_LISTEN, SOCK_EV_ACCEPT, SOCK_EV_ACCEPT4, SOCK_EV_CLOSE,
+      SOCK_EV_DUP, SOCK_EV_DUP2, SOCK_EV_DUP3, SOCK_EV_FDOPEN, -1}},
+    {"io",
+     {SOCK_EV_SEND, SOCK_EV_RECV, SOCK_EV_SENDTO, SOCK_EV_RECVFROM,
+      SOCK_EV_SENDMSG, SOCK_EV_RECVMSG,
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+      SOCK_EV_SENDMMSG, SOCK_EV_RECVMMSG,
+#endif
+      SOCK_EV_WRITE, SOCK_EV_READ, SOCK_EV_WRITEV, SOCK_EV_READV,
+      SOCK_EV_SENDFILE, -1}},
+    {"poll",
+     {SOCK_EV_POLL, SOCK_EV_PPOLL, SOCK_EV_SELECT, SOCK_EV_PSELECT,
+      SOCK_EV_EPOLL_CTL, SOCK_EV_EPOLL_WAIT, SOCK_EV_EPOLL_PWAIT, -1}},
+    {"options",
+     {SOCK_EV_GETSOCKOPT, SOCK_EV_SETSOCKOPT, SOCK_EV_GETSOCKNAME,
+      SOCK_EV_GETPEERNAME, SOCK_EV_SOCKATMARK, SOCK_EV_ISFDTYPE,
+      SOCK_EV_IOCTL, SOCK_EV_FCNTL, -1}}};
+
+// Mask of an event type or group name, 0 if unknown.
+static uint64_t mask_from_name(const char *name) {
+        if (!strcmp(name, "all")) return UINT64_MAX;
+        for (size_t i = 0; i < sizeof(groups) / sizeof(EventGroup); i++) {
+                if (strcmp(name, groups[i].name)) continue;
+                uint64_t mask = 0;
+                for (const int *t = groups[i].types; *t != -1; t++)
+                        mask |= EV_BIT(*t);
+                return mask;
+        }
+        for (int i = 0; i <= SOCK_EV_TCP_INFO; i++)
+                if (!strcmp(name, string_from_sock_event_type(i)))
+                        return EV_BIT(i);
+        return 0;
+}
+
+void sock_ev_set_filter(const char *filter) {
+        if (!filter) return;  // Keep all events.
+        char *str = (char *)my_malloc(strlen(filter) + 1);
+        strcpy(str, filter);
+
+        uint64_t mask = NOT_CALLS;
+        char *saveptr;
+        for (char *name = strtok_r(str, ",", &saveptr); name;
+             name = strtok_r(NULL, ",", &saveptr)) {
+                uint64_t name_mask = mask_from_name(name);
+                if (!name_mask)
+                        LOG(WARN, "Unknown event type in filter: %s.", name);
+                mask |= name_mask;
+        }
+        free(str);
+        sock_ev_traced = mask;
+}
+
 void sock_ev_socket(int fd, int domain, int type, int protocol) {
         init_tcpsnitch();
         if (ra_is_present(fd)) {
                 LOG(WARN, "Unclosed socket");
                 free_and_dump_socket(fd);
         }
+        if (!is_traced(SOCK_EV_SOCKET)) return;  // Before init.
 
         Socket *sock = alloc_socket(fd);
         SockEvSocket *ev =
@@ -576,7 +1184,9 @@ void sock_ev_ghost_socket(int fd) {
             (SockEvGhostSocket *)alloc_event(SOCK_EV_GHOST_SOCKET, 0, 0, 0);
         fill_sock_info_from_fd(&ev->sock_info, fd);
         memcpy(&ghost_sock->sock_info, &ev->sock_info, sizeof(SockInfo));
-        log_event(WARN, SOCK_EV_GHOST_SOCKET, fd, ghost_sock->id);
+        // Expected if socket() is filtered out.
+        LogLevel lvl = is_traced(SOCK_EV_SOCKET) ? WARN : INFO;
+        log_event(lvl, SOCK_EV_GHOST_SOCKET, fd, ghost_sock->id);
         push_event(ghost_sock, (SockEvent *)ev);
         ra_put_elem(fd, ghost_sock);
 }
@@ -653,7 +1263,8 @@ void sock_ev_getsockopt(int fd, int ret, int err, int level, int optname,
         // Inst. local vars Socket *sock & SockEvGetsockopt *ev
         SOCK_EV_PRELUDE(SOCK_EV_GETSOCKOPT, SockEvGetsockopt);
 
-        fill_sockopt(&ev->sockopt, level, optname, optval, *optlen);
+        fill_sockopt(&sock->payload_arena, &ev->sockopt, level, optname,
+                     optval, *optlen);
 
         SOCK_EV_POSTLUDE(SOCK_EV_SETSOCKOPT);
 }
@@ -663,7 +1274,8 @@ void sock_ev_setsockopt(int fd, int ret, int err, int level, int optname,
         // Inst. local vars Socket *sock & SockEvSetsockopt *ev
         SOCK_EV_PRELUDE(SOCK_EV_SETSOCKOPT, SockEvSetsockopt);
 
-        fill_sockopt(&ev->sockopt, level, optname, optval, optlen);
+        fill_sockopt(&sock->payload_arena, &ev->sockopt, level, optname,
+                     optval, optlen);
 
         SOCK_EV_POSTLUDE(SOCK_EV_SETSOCKOPT);
 }
@@ -727,7 +1339,7 @@ void sock_ev_sendmsg(int fd, int ret, int err, const struct msghdr *msg,
         // Inst. local vars Socket *sock & SockEvSendmsg *ev
         SOCK_EV_PRELUDE(SOCK_EV_SENDMSG, SockEvSendmsg);
 
-        ev->bytes = fill_msghdr(&ev->msghdr, msg);
+        ev->bytes = fill_msghdr(&sock->payload_arena, &ev->msghdr, msg);
         ev->flags = flags;
         sock->bytes_sent += ev->bytes;
 
@@ -739,7 +1351,7 @@ void sock_ev_recvmsg(int fd, int ret, int err, const struct msghdr *msg,
         // Inst. local vars Socket *sock & SockEvRecvmsg *ev
         SOCK_EV_PRELUDE(SOCK_EV_RECVMSG, SockEvRecvmsg);
 
-        ev->bytes = fill_msghdr(&ev->msghdr, msg);
+        ev->bytes = fill_msghdr(&sock->payload_arena, &ev->msghdr, msg);
         ev->flags = flags;
         sock->bytes_received += ev->bytes;
 
@@ -756,8 +1368,10 @@ void sock_ev_sendmmsg(int fd, int ret, int err, const struct mmsghdr *vmessages,
         ev->flags = flags;
 
         ev->mmsghdr_count = vlen;
-        ev->mmsghdr_vec = (Mmsghdr *)my_malloc(vlen * sizeof(Mmsghdr));
-        ev->bytes = fill_mmsghdr_vec(ev->mmsghdr_vec, vmessages, vlen);
+        ev->mmsghdr_vec = (Mmsghdr *)arena_alloc(&sock->payload_arena,
+                                                 vlen * sizeof(Mmsghdr));
+        ev->bytes = fill_mmsghdr_vec(&sock->payload_arena, ev->mmsghdr_vec,
+                                     vmessages, vlen);
 
         sock->bytes_sent += ev->bytes;
         SOCK_EV_POSTLUDE(SOCK_EV_SENDMMSG);
@@ -774,8 +1388,10 @@ void sock_ev_recvmmsg(int fd, int ret, int err, const struct mmsghdr *vmessages,
         ev->timeout.nanoseconds = tmo ? tmo->tv_nsec : 0;
 
         ev->mmsghdr_count = vlen;
-        ev->mmsghdr_vec = (Mmsghdr *)my_malloc(vlen * sizeof(Mmsghdr));
-        ev->bytes = fill_mmsghdr_vec(ev->mmsghdr_vec, vmessages, vlen);
+        ev->mmsghdr_vec = (Mmsghdr *)arena_alloc(&sock->payload_arena,
+                                                 vlen * sizeof(Mmsghdr));
+        ev->bytes = fill_mmsghdr_vec(&sock->payload_arena, ev->mmsghdr_vec,
+                                     vmessages, vlen);
 
         sock->bytes_received += ev->bytes;
         SOCK_EV_POSTLUDE(SOCK_EV_RECVMMSG);
@@ -840,6 +1456,11 @@ void sock_ev_read(int fd, int ret, int err, void *buf, size_t bytes) {
         SOCK_EV_POSTLUDE(SOCK_EV_READ);
 }
 
+void sock_ev_before_close(int fd) {
+        init_tcpsnitch();
+        if (!ra_is_present(fd)) sock_ev_ghost_socket(fd);
+}
+
 void sock_ev_close(int fd, int ret, int err) {
         // Inst. local vars Socket *sock & SockEvClose *ev
         SOCK_EV_PRELUDE(SOCK_EV_CLOSE, SockEvClose);
@@ -882,7 +1503,8 @@ void sock_ev_writev(int fd, int ret, int err, const struct iovec *iovec,
         // Inst. local vars Socket *sock & SockEvWritev *ev
         SOCK_EV_PRELUDE(SOCK_EV_WRITEV, SockEvWritev);
 
-        ev->bytes = fill_iovec(&ev->iovec, iovec, iovec_count);
+        ev->bytes =
+            fill_iovec(&sock->payload_arena, &ev->iovec, iovec, iovec_count);
         sock->bytes_sent += ev->bytes;
 
         SOCK_EV_POSTLUDE(SOCK_EV_WRITEV);
@@ -893,7 +1515,8 @@ void sock_ev_readv(int fd, int ret, int err, const struct iovec *iovec,
         // Inst. local vars Socket *sock & SockEvReadv *ev
         SOCK_EV_PRELUDE(SOCK_EV_READV, SockEvReadv);
 
-        ev->bytes = fill_iovec(&ev->iovec, iovec, iovec_count);
+        ev->bytes =
+            fill_iovec(&sock->payload_arena, &ev->iovec, iovec, iovec_count);
         sock->bytes_received += ev->bytes;
 
         SOCK_EV_POSTLUDE(SOCK_EV_READV);
@@ -1086,22 +1709,48 @@ void sock_ev_fdopen(int fd, FILE *_ret, int err, const char *mode) {
         SOCK_EV_PRELUDE(SOCK_EV_FDOPEN, SockEvFdopen);
 
         int n = strlen(mode) + 1;
-        ev->mode = (char *)my_malloc(sizeof(char) * n);
+        ev->mode = (char *)arena_alloc(&sock->payload_arena, sizeof(char) * n);
         strncpy(ev->mode, mode, n);
 
         SOCK_EV_POSTLUDE(SOCK_EV_FDOPEN);
 }
 
-void sock_ev_tcp_info(int fd, int ret, int err, struct tcp_info *info) {
-        // Inst. local vars Socket *sock & SockEvTcpInfo *ev
-        SOCK_EV_PRELUDE(SOCK_EV_TCP_INFO, SockEvTcpInfo);
+// As SOCK_EV_PRELUDE, but the socket at fd must be the sampled one, which
+// is never a ghost socket.
+void sock_ev_tcp_info(int fd, int id, ino_t inode, int ret, int err,
+                      const TcpInfo *info, size_t len) {
+        init_tcpsnitch();
+        if (!is_traced(SOCK_EV_TCP_INFO)) return;
+        if (!ra_is_present(fd)) return;  // Closed.
+        Socket *sock = ra_get_and_lock_elem(fd);
+        if (!sock) return;  // Closed concurrently.
+        // Closed and fd reused since, or not the socket of the diag message.
+        if (sock->id != id || (inode && sock->inode != inode)) {
+                ra_unlock_elem(sock);
+                return;
+        }
+        log_event(INFO, SOCK_EV_TCP_INFO, fd, sock->id);
+        SockEvTcpInfo *ev = (SockEvTcpInfo *)alloc_event(
+            SOCK_EV_TCP_INFO, ret, err, sock->events_count);
         LOG_FUNC_INFO;
 
-        memcpy(&(ev->info), info, sizeof(struct tcp_info));
+        long now_micros = ts_now_ns() / 1000;
+        ev->len = len;
+        // A failed sample has no words (changed is 0), and leaves the encoder
+        // as it was.
+        if (ev->super.success) {
+                long elapsed = now_micros - sock->last_info_dump_micros;
+                if (!sock->ti_encoder.count) elapsed = 0;
+                ev->limited_by = ti_limited_by(&sock->ti_encoder, info, len,
+                                               elapsed);
+                sock->tcp_info_interval = ti_next_interval(
+                    &sock->ti_encoder, info, sock->tcp_info_interval);
+                ti_encode(&sock->ti_encoder, info, ev, &sock->payload_arena);
+                sock->rtt = info->tcpi_rtt;
+        }
         sock->last_info_dump_bytes = sock->bytes_sent + sock->bytes_received;
-        sock->last_info_dump_micros = get_time_micros();
-        sock->rtt = info->tcpi_rtt;
-        free(info);
+        sock->last_info_dump_micros = now_micros;
+        sock->tcp_info_requested = false;
 
         SOCK_EV_POSTLUDE(SOCK_EV_TCP_INFO);
 }
@@ -1111,19 +1760,30 @@ void dump_all_sock_events(void) {
         for (long i = 0; i < ra_get_size(); i++) {
                 if (!ra_is_present(i)) continue;
                 Socket *socket = ra_get_and_lock_elem(i);
-                if (socket) dump_events_as_json(socket);
-                ra_unlock_elem(i);
+                if (!socket) continue;
+                flush_held_events(socket);
+                dump_events(socket);
+                ra_unlock_elem(socket);
         }
 }
 
 void sock_ev_free(void) {
         ra_free();
+        rb_free();
         pthread_mutex_destroy(&connections_count_mutex);
+        pthread_mutex_destroy(&dump_mutex);
 }
 
 void sock_ev_reset(void) {
         mutex_init(&connections_count_mutex);
         connections_count = 0;
+        mutex_init(&dump_mutex);
+        tw_reset();
+        tc_reset();
+        lat_reset();
+        ti_reset();
+        rb_reset();
+        ra_reset();
         for (long i = 0; i < ra_get_size(); i++) {
                 if (!ra_is_present(i)) continue;
                 Socket *sock = ra_remove_elem(i);
@@ -1,14 +1,21 @@
 #ifndef SOCK_EVENTS_H
 #define SOCK_EVENTS_H
 
+#include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <pcap/pcap.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <time.h>
+#include "arena.h"
+#include "histogram.h"
+#include "trace_writer.h"
 
 typedef enum SockEventType {
         SOCK_EV_SOCKET,
@@ -65,12 +72,26 @@ typedef enum SockEventType {
         // stdio.h
         SOCK_EV_FDOPEN,
         // others
+        SOCK_EV_COALESCED,
+        SOCK_EV_SKIPPED,
+        SOCK_EV_SUMMARY,
+        SOCK_EV_LATENCY,
         SOCK_EV_TCP_INFO
 } SockEventType;
 
+/* Event types to record, one bit per type (see sock_ev_set_filter()). The
+ * overrides check it before anything else: the calls of the other types only
+ * cost the libc call. */
+_Static_assert(SOCK_EV_TCP_INFO < 64, "event types do not fit in a mask");
+extern uint64_t sock_ev_traced;
+
+static inline bool is_traced(SockEventType type) {
+        return (sock_ev_traced >> type) & 1;
+}
+
 typedef struct {
         SockEventType type;
-        unsigned long timestamp_usec;
+        uint64_t timestamp_ns;  // See timestamps.h.
         int return_value;
         bool success;
         int err;
@@ -111,6 +132,19 @@ typedef struct {
         socklen_t len;
 } Addr;
 
+#define IP_STR_SIZE INET6_ADDRSTRLEN  // Also fits a MAC address.
+#define PORT_STR_SIZE 6
+
+/* Last address formatted for a socket, with its strings (see
+ * cached_addr_strs()). The peers of a UDP socket repeat a lot. */
+typedef struct {
+        Addr addr;         // len is 0 while the cache is empty.
+        const char *ip;    // ip_buf, or NULL if addr could not be formatted.
+        const char *port;  // port_buf, or NULL.
+        char ip_buf[IP_STR_SIZE];
+        char port_buf[PORT_STR_SIZE];
+} AddrStrCache;
+
 typedef struct {
         SockEvent super;
         Addr addr;
@@ -145,13 +179,32 @@ typedef struct {
         int flags;
 } SockEvAccept4;
 
+/* Variable length members of the events are stored inline when they fit,
+ * which is the common case. Larger ones are spilled to the payload_arena of
+ * their socket. The accessors below return the storage in use. */
+#define SOCKOPT_INLINE_SIZE 32  // int, struct linger, struct timeval...
+#define IOVEC_INLINE_COUNT 4
+#define CONTROL_INLINE_SIZE 32  // An SCM_RIGHTS fd, or an SO_TIMESTAMP.
+
 typedef struct {
         int level;
         int optname;
-        void *optval;
         socklen_t optlen;
+        union {
+                char inline_val[SOCKOPT_INLINE_SIZE];  // If optlen fits.
+                void *spilled;
+        } optval;
 } Sockopt;
 
+static inline bool is_sockopt_spilled(const Sockopt *sockopt) {
+        return sockopt->optlen > SOCKOPT_INLINE_SIZE;
+}
+
+static inline const void *sockopt_val(const Sockopt *sockopt) {
+        return is_sockopt_spilled(sockopt) ? sockopt->optval.spilled
+                                           : sockopt->optval.inline_val;
+}
+
 typedef struct {
         SockEvent super;
         Sockopt sockopt;
@@ -190,16 +243,48 @@ typedef struct {
 
 typedef struct {
         int iovec_count;
-        size_t *iovec_sizes;
+        union {
+                size_t inline_sizes[IOVEC_INLINE_COUNT];  // If count fits.
+                size_t *spilled;
+        } sizes;
 } Iovec;
 
+static inline bool is_iovec_spilled(const Iovec *iovec) {
+        return iovec->iovec_count > IOVEC_INLINE_COUNT;
+}
+
+static inline const size_t *iovec_sizes(const Iovec *iovec) {
+        return is_iovec_spilled(iovec) ? iovec->sizes.spilled
+                                       : iovec->sizes.inline_sizes;
+}
+
 typedef struct {
         Iovec iovec;
         struct sockaddr_storage addr;
         int flags;
-        struct msghdr *msghdr;
+        size_t control_len;  // Of the ancillary data.
+        union {
+                // The pointer aligns it for struct cmsghdr.
+                char inline_data[CONTROL_INLINE_SIZE];  // If control_len fits.
+                void *spilled;
+        } control;
 } Msghdr;
 
+static inline bool is_control_spilled(const Msghdr *msghdr) {
+        return msghdr->control_len > CONTROL_INLINE_SIZE;
+}
+
+static inline const void *control_data(const Msghdr *msghdr) {
+        return is_control_spilled(msghdr) ? msghdr->control.spilled
+                                          : msghdr->control.inline_data;
+}
+
+// Same as CMSG_FIRSTHDR(), for the control data of msghdr.
+static inline const struct cmsghdr *first_cmsghdr(const Msghdr *msghdr) {
+        if (msghdr->control_len < sizeof(struct cmsghdr)) return NULL;
+        return (const struct cmsghdr *)control_data(msghdr);
+}
+
 typedef struct {
         SockEvent super;
         size_t bytes;
@@ -390,37 +475,340 @@ typedef struct {
         char *mode;
 } SockEvFdopen;
 
+/* A run of consecutive successful events of a socket with the same type,
+ * flags and thread, for types whose details are only bytes and flags (see
+ * push_event()). super is the first event of the run. */
+typedef struct {
+        SockEvent super;
+        SockEventType ev_type;  // Type of the coalesced events.
+        int flags;
+        unsigned long count;
+        unsigned long bytes;  // Transferred (return values), over the run.
+        size_t min_bytes;     // Smallest transfer.
+        size_t max_bytes;     // Largest transfer.
+        uint64_t last_timestamp_ns;
+} SockEvCoalesced;
+
+/* Stands for data-path events dropped by sampling (see Sampler), so that
+ * the bytes of the trace still add up to the socket totals. */
 typedef struct {
         SockEvent super;
-        struct tcp_info info;
+        unsigned long events;
+        unsigned long bytes_sent;
+        unsigned long bytes_received;
+} SockEvSkipped;
+
+#define SUMMARY_ERRNOS 8  // Distinct errno values counted by a summary.
+
+typedef struct {
+        int err;
+        unsigned long count;
+} ErrnoCount;
+
+/* Layout of the kernel struct tcp_info (include/uapi/linux/tcp.h, as of
+ * Linux 6.7). glibc only declares it up to tcpi_total_retrans. The kernel
+ * only ever appends fields and fills as many bytes as it knows: this length
+ * is recorded with each sample and tells which fields are valid. */
+typedef struct {
+        uint8_t tcpi_state;
+        uint8_t tcpi_ca_state;
+        uint8_t tcpi_retransmits;
+        uint8_t tcpi_probes;
+        uint8_t tcpi_backoff;
+        uint8_t tcpi_options;
+        uint8_t tcpi_snd_wscale : 4, tcpi_rcv_wscale : 4;
+        uint8_t tcpi_delivery_rate_app_limited : 1,
+            tcpi_fastopen_client_fail : 2;
+
+        uint32_t tcpi_rto;
+        uint32_t tcpi_ato;
+        uint32_t tcpi_snd_mss;
+        uint32_t tcpi_rcv_mss;
+
+        uint32_t tcpi_unacked;
+        uint32_t tcpi_sacked;
+        uint32_t tcpi_lost;
+        uint32_t tcpi_retrans;
+        uint32_t tcpi_fackets;
+
+        // Times
+        uint32_t tcpi_last_data_sent;
+        uint32_t tcpi_last_ack_sent;
+        uint32_t tcpi_last_data_recv;
+        uint32_t tcpi_last_ack_recv;
+
+        // Metrics
+        uint32_t tcpi_pmtu;
+        uint32_t tcpi_rcv_ssthresh;
+        uint32_t tcpi_rtt;
+        uint32_t tcpi_rttvar;
+        uint32_t tcpi_snd_ssthresh;
+        uint32_t tcpi_snd_cwnd;
+        uint32_t tcpi_advmss;
+        uint32_t tcpi_reordering;
+
+        uint32_t tcpi_rcv_rtt;
+        uint32_t tcpi_rcv_space;
+
+        uint32_t tcpi_total_retrans;  // End of the glibc struct.
+
+        uint64_t tcpi_pacing_rate;
+        uint64_t tcpi_max_pacing_rate;
+        uint64_t tcpi_bytes_acked;
+        uint64_t tcpi_bytes_received;
+        uint32_t tcpi_segs_out;
+        uint32_t tcpi_segs_in;
+
+        uint32_t tcpi_notsent_bytes;
+        uint32_t tcpi_min_rtt;
+        uint32_t tcpi_data_segs_in;
+        uint32_t tcpi_data_segs_out;
+
+        uint64_t tcpi_delivery_rate;
+
+        uint64_t tcpi_busy_time;       // Usec busy sending data.
+        uint64_t tcpi_rwnd_limited;    // Usec limited by the receive window.
+        uint64_t tcpi_sndbuf_limited;  // Usec limited by the send buffer.
+
+        uint32_t tcpi_delivered;
+        uint32_t tcpi_delivered_ce;
+
+        uint64_t tcpi_bytes_sent;
+        uint64_t tcpi_bytes_retrans;
+        uint32_t tcpi_dsack_dups;
+        uint32_t tcpi_reord_seen;
+
+        uint32_t tcpi_rcv_ooopack;
+
+        uint32_t tcpi_snd_wnd;
+        uint32_t tcpi_rcv_wnd;
+        uint32_t tcpi_rehash;
+        uint16_t tcpi_total_rto;
+        uint16_t tcpi_total_rto_recoveries;
+        uint32_t tcpi_total_rto_time;
+} TcpInfo;
+
+// Whether a sample of len bytes has field (not for the bit fields).
+#define TCP_INFO_HAS(len, field) \
+        (offsetof(TcpInfo, field) + sizeof(((TcpInfo *)0)->field) <= (len))
+
+// What capped the throughput of a connection, from tcpi_busy_time,
+// tcpi_rwnd_limited & tcpi_sndbuf_limited. See ti_limited_by().
+typedef enum {
+        TCP_LIMIT_UNKNOWN,  // Not provided by the kernel.
+        TCP_LIMIT_APP,      // The application, not sending enough.
+        TCP_LIMIT_CWND,     // The congestion window, i.e. the network.
+        TCP_LIMIT_RWND,     // The receive window of the peer.
+        TCP_LIMIT_SNDBUF    // The send buffer.
+} TcpLimit;
+
+/* Aggregates of the events of a socket, kept instead of the events in
+ * summary mode (see summarize_event()). */
+typedef struct {
+        unsigned long calls[SOCK_EV_TCP_INFO + 1];  // By event type.
+        ErrnoCount errors[SUMMARY_ERRNOS];           // First errno values seen.
+        unsigned long other_errors;                  // Once errors is full.
+        Addr peer;            // From connect() or accept(), len 0 if none.
+        uint64_t start_ns;    // First connect(), or accept(). 0 if none.
+        uint64_t first_byte_ns;  // First byte received after start_ns.
+        uint16_t tcp_info_len;  // Of tcp_info, 0 if none.
+        TcpInfo tcp_info;       // Last one recorded.
+        uint8_t tcp_limited_by;  // TcpLimit, over the whole connection.
+} SockSummary;
+
+typedef struct {
+        SockEvent super;
+        SockInfo sock_info;
+        unsigned long bytes_sent;
+        unsigned long bytes_received;
+        SockSummary *summary;
+} SockEvSummary;
+
+/* Durations of the blocking calls on the socket since the previous
+ * SOCK_EV_LATENCY, with -e. */
+typedef struct {
+        SockEvent super;
+        Histogram **histograms;  // By event type, NULL if no such call.
+} SockEvLatency;
+
+/* tcp_info samples are delta encoded against the previous sample of the
+ * same socket, as most fields rarely change. TcpInfo is seen as an array of
+ * 32-bit words: words holds, in order, those set in changed. The
+ * others are those of the previous sample. Every TCP_INFO_KEYFRAME samples,
+ * a keyframe has all the words. See ti_encode() & ti_decode(). */
+
+#define TCP_INFO_WORDS (sizeof(TcpInfo) / sizeof(uint32_t))
+#define TCP_INFO_ALL_WORDS (UINT64_MAX >> (64 - TCP_INFO_WORDS))
+#define TCP_INFO_KEYFRAME 64  // Samples between keyframes.
+
+_Static_assert(sizeof(TcpInfo) % sizeof(uint32_t) == 0 && TCP_INFO_WORDS <= 64,
+               "TcpInfo does not fit the delta encoding");
+
+typedef struct {
+        SockEvent super;
+        uint16_t len;        // Bytes of TcpInfo filled by the kernel.
+        uint8_t limited_by;  // TcpLimit, since the previous sample.
+        uint64_t changed;  // Words present, by index.
+        uint32_t *words;   // NULL if none changed.
 } SockEvTcpInfo;
 
+// Previous sample of a socket, for the encoder or the decoder.
+typedef struct {
+        uint32_t words[TCP_INFO_WORDS];
+        unsigned long count;  // Samples encoded.
+} TcpInfoState;
+
+// The full sample of a decoded event (missing words are zero otherwise).
+static inline void tcp_info_of(const SockEvTcpInfo *ev,
+                               TcpInfo *info) {
+        uint32_t words[TCP_INFO_WORDS];
+        int n = 0;
+        for (size_t i = 0; i < TCP_INFO_WORDS; i++)
+                words[i] = ((ev->changed >> i) & 1) ? ev->words[n++] : 0;
+        memcpy(info, words, sizeof(words));
+}
+
+// Large enough to hold any event.
+typedef union {
+        SockEvent super;
+        SockEvSocket socket;
+        SockEvForkedSocket forked_socket;
+        SockEvGhostSocket ghost_socket;
+        SockEvBind bind;
+        SockEvConnect connect;
+        SockEvShutdown shutdown;
+        SockEvListen listen;
+        SockEvAccept accept;
+        SockEvAccept4 accept4;
+        SockEvGetsockopt getsockopt;
+        SockEvSetsockopt setsockopt;
+        SockEvSend send;
+        SockEvRecv recv;
+        SockEvSendto sendto;
+        SockEvRecvfrom recvfrom;
+        SockEvSendmsg sendmsg;
+        SockEvRecvmsg recvmsg;
+#if !defined(__ANDROID__) || __ANDROID_API__ >= 21
+        SockEvSendmmsg sendmmsg;
+        SockEvRecvmmsg recvmmsg;
+#endif
+        SockEvGetsockname getsockname;
+        SockEvGetpeername getpeername;
+        SockEvSockatmark sockatmark;
+        SockEvIsfdtype isfdtype;
+        SockEvWrite write;
+        SockEvRead read;
+        SockEvClose close;
+        SockEvDup dup;
+        SockEvDup2 dup2;
+        SockEvDup3 dup3;
+        SockEvWritev writev;
+        SockEvReadv readv;
+        SockEvIoctl ioctl;
+        SockEvSendfile sendfile;
+        SockEvPoll poll;
+        SockEvPpoll ppoll;
+        SockEvSelect select;
+        SockEvPselect pselect;
+        SockEvFcntl fcntl;
+        SockEvEpollCtl epoll_ctl;
+        SockEvEpollWait epoll_wait;
+        SockEvEpollPwait epoll_pwait;
+        SockEvFdopen fdopen;
+        SockEvCoalesced coalesced;
+        SockEvSkipped skipped;
+        SockEvSummary summary;
+        SockEvLatency latency;
+        SockEvTcpInfo tcp_info;
+} AnySockEvent;
+
 typedef struct SockEventNode SockEventNode;
 struct SockEventNode {
-        SockEvent *data;
+        SockEvent *data;  // Points right after the node.
+        long seq;         // Position in the socket events sequence.
         SockEventNode *next;
 };
 
 typedef struct {
+        unsigned long rank;  // Among the candidates of the reservoir.
+        long slot;
+} SampleArrival;
+
+/* Sampling of the data-path events (transfers and readiness notifications)
+ * of a socket. Filters apply in order: 1 event out of conf_opt_s, at most 1
+ * event per conf_opt_i microseconds, then a reservoir of conf_opt_m events.
+ * The reservoir is emptied whenever a non-sampled event is recorded and when
+ * events are dumped. Skipped events are counted until the next event pushed,
+ * which is preceded by a SOCK_EV_SKIPPED event. */
+typedef struct {
+        unsigned long seen;     // Data-path events seen, for 1-in-N sampling.
+        uint64_t last_kept_ns;  // For time-based sampling.
+        // Skipped events, not reported yet.
+        unsigned long skipped;
+        unsigned long skipped_bytes_sent;
+        unsigned long skipped_bytes_received;
+        uint64_t last_skipped_ns;
+        // Reservoir, allocated on first use.
+        AnySockEvent *reservoir;
+        SampleArrival *arrivals;   // Of the event in each slot.
+        unsigned long candidates;  // Events offered since last emptied.
+        uint64_t rng;
+} Sampler;
+
+typedef struct Socket Socket;
+
+/* An event as recorded in a per-thread ring buffer, waiting for the dumper
+ * to move it to the events list of its socket. */
+typedef struct {
+        Socket *sock;  // NULL if the event was discarded.
+        long seq;
+        AnySockEvent ev;
+} SockEventRecord;
+
+struct Socket {
         // To be freed
-        SockEventNode *head;  // Head for list of events.
+        SockEventNode *head;  // Head for list of events, ordered by seq.
         SockEventNode *tail;  // Tail for list of events.
+        Arena events_arena;   // Nodes & events of the list, under dump_mutex.
+        Arena payload_arena;  // Payloads of the events, under mutex.
         // Others
         int id;
         int fd;
         SockInfo sock_info;
         long events_count;
+        long dumped_count;  // Events already written to JSON.
         unsigned long bytes_sent;      // Total bytes sent.
         unsigned long bytes_received;  // Total bytes received.
         long last_info_dump_micros;  // Time of last info dump in microseconds.
         long last_info_dump_bytes;   // Total bytes (sent+recv) at last dump.
+        long tcp_info_interval;      // Between -u and -w, in microseconds.
+        bool tcp_info_requested;     // Past -b bytes, for the sampler.
+        ino_t inode;                 // For sock_diag, 0 until first sample.
+        in_port_t local_port;        // For sock_diag, 0 until bound.
+        TcpInfoState ti_encoder;     // Last tcp_info recorded, under mutex.
+        TcpInfoState ti_decoder;     // Last tcp_info dumped, under dump lock.
         bool bound;
         struct sockaddr_storage bound_addr;
         int rtt;
         bool *capture_switch;
-} Socket;
+        pthread_mutex_t mutex;  // Managed by resizable_array.
+        TraceFile *trace_file;  // NULL until the first dump.
+        Sampler sampler;
+        SockEvCoalesced run;  // Run being coalesced, if run.count > 0.
+        size_t run_bytes;     // Requested by the first event of run.
+        SockSummary summary;
+        bool summary_changed;  // Since the last SOCK_EV_SUMMARY.
+        Histogram **latency;   // Since the last SOCK_EV_LATENCY, or NULL.
+        AddrStrCache addr_cache;  // For the JSON dump.
+};
 
 const char *string_from_sock_event_type(SockEventType type);
+size_t sizeof_sock_ev(SockEventType type);
+
+// Only record the events listed in filter, a comma separated list of event
+// types and groups of them ("lifecycle", "io", "poll", "options" or "all").
+// Events which are not calls are always recorded.
+void sock_ev_set_filter(const char *filter);
 
 void free_socket(Socket *con);
 
@@ -493,6 +881,9 @@ void sock_ev_write(int fd, int ret, int err, const void *buf, size_t bytes);
 
 void sock_ev_read(int fd, int ret, int err, void *buf, size_t bytes);
 
+// Start the trace of an unknown socket while it can still be queried, i.e.
+// before close(), e.g. when its earlier calls were filtered out.
+void sock_ev_before_close(int fd);
 void sock_ev_close(int fd, int ret, int err);
 
 void sock_ev_dup(int fd, int ret, int err);
@@ -543,8 +934,14 @@ void sock_ev_epoll_pwait(int fd, int ret, int err, int timeout,
 
 void sock_ev_fdopen(int fd, FILE *ret, int err, const char *mode);
 
-void sock_ev_tcp_info(int fd, int ret, int err, struct tcp_info *info);
+// id is the one of the sampled socket: the sample is dropped if fd has been
+// reused by another socket since. So is a sock_diag sample, matched by inode,
+// if the socket does not have this inode. 0 for getsockopt() samples.
+void sock_ev_tcp_info(int fd, int id, ino_t inode, int ret, int err,
+                      const TcpInfo *info, size_t len);
 
+// End the trace of a closed socket, e.g. when close() is filtered out.
+void free_and_dump_socket(int fd);
 void dump_all_sock_events(void);
 
 void sock_ev_free(void);  // Free state.
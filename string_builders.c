@@ -19,26 +19,23 @@
 #include "lib.h"
 #include "logger.h"
 
-char *alloc_ip_str(const struct sockaddr *addr) {
-        static const int n = INET6_ADDRSTRLEN;
-        char *addr_str = (char *)my_calloc(sizeof(char) * n);
-        if (!addr_str) goto error_out;
-
+const char *ip_str(const struct sockaddr *addr, char *buf) {
         // Convert host from network to printable
-        const char *r;
         switch (addr->sa_family) {
                 case AF_INET: {
                         const struct sockaddr_in *v4 =
                             (const struct sockaddr_in *)addr;
-                        r = inet_ntop(AF_INET, &(v4->sin_addr), addr_str, n);
-                        if (!r) goto error2;
+                        if (!inet_ntop(AF_INET, &(v4->sin_addr), buf,
+                                       IP_STR_SIZE))
+                                goto error2;
                         break;
                 }
                 case AF_INET6: {
                         const struct sockaddr_in6 *v6 =
                             (const struct sockaddr_in6 *)addr;
-                        r = inet_ntop(AF_INET6, &(v6->sin6_addr), addr_str, n);
-                        if (!r) goto error2;
+                        if (!inet_ntop(AF_INET6, &(v6->sin6_addr), buf,
+                                       IP_STR_SIZE))
+                                goto error2;
                         break;
                 }
                 case AF_PACKET: {
@@ -47,7 +44,7 @@ char *alloc_ip_str(const struct sockaddr *addr) {
                         int len = 0;
                         for (int i = 0; i < 6; i++)
                                 len +=
-                                    sprintf(addr_str + len, "%02X%s",
+                                    sprintf(buf + len, "%02X%s",
                                             ll->sll_addr[i], i < 5 ? ":" : "");
                         break;
                 }
@@ -55,83 +52,59 @@ char *alloc_ip_str(const struct sockaddr *addr) {
                         goto error1;
         }
 
-        return addr_str;
+        return buf;
 error2:
         LOG(ERROR, "inet_ntop() failed. %s.", strerror(errno));
-        goto cleanup_out;
+        goto error_out;
 error1:
         LOG(ERROR, "Unsupported sa_family: %d.", addr->sa_family);
-cleanup_out:
-        free(addr_str);
 error_out:
         LOG_FUNC_ERROR;
         return NULL;
 }
 
-char *alloc_port_str(const struct sockaddr *addr) {
-        static const int PORT_WIDTH = 6;
-
-        char *port_str = (char *)my_calloc(sizeof(char) * PORT_WIDTH);
-        if (!port_str) goto error_out;
-
+const char *port_str(const struct sockaddr *addr, char *buf) {
         // Convert port to string
-        int n;
         switch (addr->sa_family) {
                 case AF_INET: {
                         const struct sockaddr_in *v4 =
                             (const struct sockaddr_in *)addr;
-                        n = snprintf(port_str, PORT_WIDTH, "%d",
-                                     ntohs(v4->sin_port));
-                        if (n < 0) goto error2;
+                        snprintf(buf, PORT_STR_SIZE, "%d", ntohs(v4->sin_port));
+                        break;
                 }
                 case AF_INET6: {
                         const struct sockaddr_in6 *v6 =
                             (const struct sockaddr_in6 *)addr;
-                        n = snprintf(port_str, PORT_WIDTH, "%d",
-                                     ntohs(v6->sin6_port));
-                        if (n < 0) goto error2;
+                        snprintf(buf, PORT_STR_SIZE, "%d",
+                                 ntohs(v6->sin6_port));
+                        break;
                 }
                 case AF_PACKET:
-                        break;  // No notion of port here
+                        buf[0] = '\0';  // No notion of port here
+                        break;
                 default:
-                        goto error1;
+                        goto error;
         }
 
-        return port_str;
-error2:
-        LOG(ERROR, "snprintf() failed. %s.", strerror(errno));
-        goto cleanup_out;
-error1:
+        return buf;
+error:
         LOG(ERROR, "Unsupported sa_family: %d.", addr->sa_family);
-cleanup_out:
-        free(port_str);
-error_out:
         LOG_FUNC_ERROR;
         return NULL;
 }
 
-char *alloc_addr_str(const struct sockaddr *addr) {
-        static const int n = 46;  // ADDR:PORT\0
-
-        char *addr_str, *host_str, *port_str;
-        if (!(addr_str = (char *)my_calloc(sizeof(char) * n))) goto error_out;
-        if (!(host_str = alloc_ip_str(addr))) goto error1;
-        if (!(port_str = alloc_port_str(addr))) goto error2;
-
-        strncat(addr_str, host_str, n - 1);
-        strncat(addr_str, ":", (n - 1) - strlen(addr_str));
-        strncat(addr_str, port_str, (n - 1) - strlen(addr_str));
-
-        free(addr_str);
-        free(port_str);
-        return addr_str;
-error2:
-        free(host_str);
-error1:
-        free(addr_str);
-error_out:
-        LOG_FUNC_ERROR;
-        return NULL;
+void cached_addr_strs(AddrStrCache *cache, const Addr *addr, const char **ip,
+                      const char **port) {
+        if (!cache->addr.len || cache->addr.len != addr->len ||
+            memcmp(&cache->addr.sockaddr_sto, &addr->sockaddr_sto, addr->len)) {
+                const struct sockaddr *sockaddr =
+                    (const struct sockaddr *)&addr->sockaddr_sto;
+                cache->addr = *addr;
+                cache->ip = ip_str(sockaddr, cache->ip_buf);
+                cache->port = port_str(sockaddr, cache->port_buf);
+        }
+        *ip = cache->ip;
+        *port = cache->port;
 }
 
 bool alloc_name_str(const struct sockaddr *addr, socklen_t n, char **name,
@@ -200,6 +173,10 @@ char *alloc_json_path_str(Socket *con) {
         return alloc_file_name(con->id, ".json");
 }
 
+char *alloc_bin_path_str(Socket *con) {
+        return alloc_file_name(con->id, ".bin");
+}
+
 char *alloc_pcap_path_str(Socket *con) {
         return alloc_file_name(con->id, ".pcap");
 }
@@ -3,9 +3,13 @@
 
 #include "sock_events.h"
 
-char *alloc_ip_str(const struct sockaddr *addr);
-char *alloc_port_str(const struct sockaddr *addr);
-char *alloc_addr_str(const struct sockaddr *addr);
+// Write the host or port of addr in buf, of IP_STR_SIZE or PORT_STR_SIZE
+// bytes, and return buf. NULL if the address family is not supported.
+const char *ip_str(const struct sockaddr *addr, char *buf);
+const char *port_str(const struct sockaddr *addr, char *buf);
+// Same, for an Addr, reusing the strings of cache if addr did not change.
+void cached_addr_strs(AddrStrCache *cache, const Addr *addr, const char **ip,
+                      const char **port);
 bool alloc_name_str(const struct sockaddr *addr, socklen_t len, char **name,
                     char **serv);
 
@@ -15,6 +19,7 @@ char *alloc_append_int_to_path(const char *path1, int i);
 char *alloc_android_opt_d(void);
 char *alloc_pcap_path_str(Socket *con);
 char *alloc_json_path_str(Socket *con);
+char *alloc_bin_path_str(Socket *con);
 
 char *alloc_cmdline_str(void);
 char *alloc_app_name(void);
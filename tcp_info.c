@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+
+#include "tcp_info.h"
+#include <errno.h>
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "init.h"
+#include "lib.h"
+#include "libc_symbols.h"
+#include "logger.h"
+#include "resizable_array.h"
+#include "sock_events.h"
+#include "timestamps.h"
+
+#ifdef __ANDROID__
+#define MUTEX_ERRORCHECK PTHREAD_ERRORCHECK_MUTEX_INITIALIZER
+#else
+#define MUTEX_ERRORCHECK PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP
+#endif
+
+#define DIAG_BUF_SIZE 32768  // Bytes read from the netlink socket at once.
+#define RTT_CHANGE_SHIFT 3   // RTT moves past 1/8 are changes.
+
+// States of include/net/tcp_states.h with no socket to sample: TIME_WAIT and
+// request sockets, which may be many on a busy host.
+#define TCP_STATE_TIME_WAIT 6
+#define TCP_STATE_NEW_SYN_RECV 12
+#define DIAG_STATES \
+        (~((1U << TCP_STATE_TIME_WAIT) | (1U << TCP_STATE_NEW_SYN_RECV)))
+
+typedef struct {
+        int fd;
+        int id;      // Of the socket, which may be closed & its fd reused.
+        int domain;  // AF_UNSPEC if unknown.
+        ino_t inode;
+        in_port_t port;  // Local, 0 if unknown.
+        bool found;      // In the sock_diag dump.
+        uint16_t len;
+        TcpInfo info;
+} TcpSample;
+
+static pthread_mutex_t sampler_mutex = MUTEX_ERRORCHECK;
+static pthread_cond_t sampler_cond = PTHREAD_COND_INITIALIZER;
+static bool requested = false;  // Some socket is flagged.
+static bool sampler_started = false;
+
+// Sampler side.
+static TcpSample *samples = NULL;  // Sockets of the current pass.
+static size_t samples_size = 0;
+static bool use_diag = true;  // Until NETLINK_SOCK_DIAG fails.
+
+/* Private functions */
+
+static void add_micros(struct timespec *ts, long micros) {
+        ts->tv_sec += micros / (1000 * 1000);
+        ts->tv_nsec += (micros % (1000 * 1000)) * 1000;
+        if (ts->tv_nsec >= 1000 * 1000 * 1000) {
+                ts->tv_sec++;
+                ts->tv_nsec -= 1000 * 1000 * 1000;
+        }
+}
+
+static bool is_before(const struct timespec *a, const struct timespec *b) {
+        return a->tv_sec < b->tv_sec ||
+               (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// The kernel sets n to the size of the part it filled.
+static void sample_socket(int fd, int id) {
+        TcpInfo info;
+        memset(&info, 0, sizeof(info));
+        socklen_t n = sizeof(info);
+        int ret = ORIG(getsockopt)(fd, SOL_TCP, TCP_INFO, &info, &n);
+        int err = errno;
+        // Closed since we looked at it.
+        if (ret && (err == EBADF || err == ENOTSOCK)) return;
+        if (ret) {
+                LOG(WARN, "getsockopt() failed. %s.", strerror(err));
+                n = 0;
+        }
+        sock_ev_tcp_info(fd, id, 0, ret, err, &info, n);
+}
+
+// The local port of socket fd, 0 if it is not bound yet.
+static in_port_t local_port(int fd) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if (ORIG(getsockname)(fd, (struct sockaddr *)&addr, &len)) return 0;
+        if (addr.ss_family == AF_INET)
+                return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+        if (addr.ss_family == AF_INET6)
+                return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+        return 0;
+}
+
+static int compare_samples(const void *a, const void *b) {
+        ino_t x = ((const TcpSample *)a)->inode;
+        ino_t y = ((const TcpSample *)b)->inode;
+        return (x > y) - (x < y);
+}
+
+/* Copies the INET_DIAG_INFO of msg to the samples of the same inode, which
+ * are sorted. Several fds may refer to the same socket. */
+static void store_diag_msg(const struct nlmsghdr *nlh, TcpSample *ss,
+                           size_t count) {
+        const struct inet_diag_msg *msg =
+            (const struct inet_diag_msg *)NLMSG_DATA(nlh);
+        // E.g. TIME_WAIT sockets, which would match the samples with no inode.
+        if (!msg->idiag_inode) return;
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (ss[mid].inode < msg->idiag_inode)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        if (lo == count || ss[lo].inode != msg->idiag_inode) return;
+
+        int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+        const struct rtattr *attr = (const struct rtattr *)(msg + 1);
+        for (; RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+                if (attr->rta_type != INET_DIAG_INFO) continue;
+                size_t n = RTA_PAYLOAD(attr);
+                if (n > sizeof(TcpInfo)) n = sizeof(TcpInfo);
+                for (size_t i = lo; i < count && ss[i].inode == ss[lo].inode;
+                     i++) {
+                        memset(&ss[i].info, 0, sizeof(TcpInfo));
+                        memcpy(&ss[i].info, RTA_DATA(attr), n);
+                        ss[i].len = n;
+                        ss[i].found = true;
+                }
+                return;
+        }
+}
+
+/* One sock_diag dump of the TCP sockets of a family, with their tcp_info.
+ * The kernel reports the sockets of the whole network namespace: those of
+ * the process are picked by inode. If hi is not 0, a bytecode filter leaves
+ * out the sockets with a local port out of [lo, hi] in the kernel. Returns
+ * -1 if the dump failed. */
+static int diag_dump(int nl_fd, int family, TcpSample *ss, size_t count,
+                     in_port_t lo, in_port_t hi) {
+        struct {
+                struct nlmsghdr nlh;
+                struct inet_diag_req_v2 req;
+                struct rtattr bc_attr;
+                struct inet_diag_bc_op bc[4];
+        } request;
+        memset(&request, 0, sizeof(request));
+        request.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(request.req));
+        request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+        request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        request.req.sdiag_family = family;
+        request.req.sdiag_protocol = IPPROTO_TCP;
+        request.req.idiag_states = DIAG_STATES;
+        request.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+        if (hi) {
+                // Each comparison takes 2 ops of 4 bytes, the port is in the
+                // 2nd. A match goes on to the next comparison (8 bytes on),
+                // else the socket is rejected by jumping 4 bytes past the end.
+                struct inet_diag_bc_op *bc = request.bc;
+                bc[0] = (struct inet_diag_bc_op){INET_DIAG_BC_S_GE, 8, 20};
+                bc[1].no = lo;
+                bc[2] = (struct inet_diag_bc_op){INET_DIAG_BC_S_LE, 8, 12};
+                bc[3].no = hi;
+                request.bc_attr.rta_type = INET_DIAG_REQ_BYTECODE;
+                request.bc_attr.rta_len = RTA_LENGTH(sizeof(request.bc));
+                request.nlh.nlmsg_len = sizeof(request);
+        }
+
+        struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+        if (ORIG(sendto)(nl_fd, &request, request.nlh.nlmsg_len, 0,
+                         (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+                goto error;
+
+        long buf[DIAG_BUF_SIZE / sizeof(long)];  // Aligned for nlmsghdr.
+        while (true) {
+                ssize_t n = ORIG(recv)(nl_fd, buf, sizeof(buf), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) goto error;
+                int len = n;
+                const struct nlmsghdr *nlh = (const struct nlmsghdr *)buf;
+                for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+                        if (nlh->nlmsg_type == NLMSG_DONE) return 0;
+                        if (nlh->nlmsg_type == NLMSG_ERROR) {
+                                const struct nlmsgerr *e =
+                                    (const struct nlmsgerr *)NLMSG_DATA(nlh);
+                                errno = -e->error;
+                                goto error;
+                        }
+                        if (nlh->nlmsg_type == SOCK_DIAG_BY_FAMILY)
+                                store_diag_msg(nlh, ss, count);
+                }
+        }
+error:
+        LOG(WARN, "sock_diag dump failed. %s.", strerror(errno));
+        LOG_FUNC_WARN;
+        return -1;
+}
+
+/* Fills the tcp_info of the samples found by sock_diag, one dump per family
+ * in use. Returns -1 if NETLINK_SOCK_DIAG is not usable. */
+static int diag_collect(TcpSample *ss, size_t count) {
+        bool inet = false, inet6 = false;
+        in_port_t lo = UINT16_MAX, hi = 0;
+        for (size_t i = 0; i < count; i++) {
+                inet |= (ss[i].domain != AF_INET6);
+                inet6 |= (ss[i].domain != AF_INET);
+                if (ss[i].port < lo) lo = ss[i].port;
+                if (ss[i].port > hi) hi = ss[i].port;
+        }
+        if (!lo) hi = 0;  // Some port is unknown: no filter.
+        qsort(ss, count, sizeof(TcpSample), compare_samples);
+
+        int nl_fd = ORIG(socket)(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                                 NETLINK_SOCK_DIAG);
+        if (nl_fd < 0) goto error1;
+        if ((inet && diag_dump(nl_fd, AF_INET, ss, count, lo, hi)) ||
+            (inet6 && diag_dump(nl_fd, AF_INET6, ss, count, lo, hi)))
+                goto error2;
+        ORIG(close)(nl_fd);
+        return 0;
+error1:
+        LOG(WARN, "socket() failed. %s.", strerror(errno));
+        goto error_out;
+error2:
+        ORIG(close)(nl_fd);
+error_out:
+        LOG(WARN, "tcp_info is read with getsockopt() from now on.");
+        return -1;
+}
+
+static TcpSample *new_sample(size_t count) {
+        if (count == samples_size) {
+                size_t size = samples_size ? samples_size * 2 : 64;
+                TcpSample *ss = (TcpSample *)my_realloc(
+                    samples, size * sizeof(TcpSample));
+                if (!ss) return NULL;
+                samples = ss;
+                samples_size = size;
+        }
+        return &samples[count];
+}
+
+// Whether the samples differ in cwnd, retransmissions, ca_state or RTT. The
+// smoothed RTT moves a little with every ACK, only larger moves count.
+static bool has_moved(const TcpInfo *a, const TcpInfo *b) {
+        if (a->tcpi_snd_cwnd != b->tcpi_snd_cwnd ||
+            a->tcpi_ca_state != b->tcpi_ca_state ||
+            a->tcpi_retrans != b->tcpi_retrans ||
+            a->tcpi_total_retrans != b->tcpi_total_retrans)
+                return true;
+        uint32_t d = (a->tcpi_rtt > b->tcpi_rtt) ? a->tcpi_rtt - b->tcpi_rtt
+                                                 : b->tcpi_rtt - a->tcpi_rtt;
+        return d > (a->tcpi_rtt >> RTT_CHANGE_SHIFT);
+}
+
+/* Samples the flagged sockets and, on ticks, those whose interval elapsed.
+ * With NETLINK_SOCK_DIAG, the tcp_info of all of them are collected at once.
+ * Sockets missing from the dump, if any, are sampled with getsockopt(). The
+ * socket locks are not held while collecting. */
+static void sample_sockets(bool tick) {
+        long now = ts_now_ns() / 1000;
+        size_t count = 0;
+        for (long i = 0; i < ra_get_size(); i++) {
+                if (!ra_is_present(i)) continue;
+                Socket *sock = ra_get_and_lock_elem(i);
+                if (!sock) continue;
+                // Half a tick of slack, as ticks and samples are not exact.
+                long elapsed = now - sock->last_info_dump_micros;
+                bool due = sock->tcp_info_requested ||
+                           (tick && elapsed >= sock->tcp_info_interval -
+                                                   conf_opt_u / 2);
+                TcpSample *s = NULL;
+                if (due && is_tcp_socket(i) && (s = new_sample(count))) {
+                        if (!sock->inode) {
+                                struct stat st;
+                                if (!fstat(i, &st)) sock->inode = st.st_ino;
+                        }
+                        if (!sock->local_port) sock->local_port = local_port(i);
+                        s->fd = i;
+                        s->id = sock->id;
+                        s->domain = sock->sock_info.filled
+                                        ? sock->sock_info.domain
+                                        : AF_UNSPEC;
+                        s->inode = sock->inode;
+                        s->port = sock->local_port;
+                        s->found = false;
+                        count++;
+                }
+                ra_unlock_elem(sock);
+        }
+        if (!count) return;
+
+        if (use_diag && diag_collect(samples, count)) use_diag = false;
+        for (size_t i = 0; i < count; i++) {
+                TcpSample *s = &samples[i];
+                if (s->found)
+                        sock_ev_tcp_info(s->fd, s->id, s->inode, 0, 0,
+                                         &s->info, s->len);
+                else
+                        sample_socket(s->fd, s->id);
+        }
+}
+
+static void *sampler_thread(void *arg) {
+        UNUSED(arg);
+        LOG_FUNC_INFO;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        while (true) {
+                bool tick = false;
+                mutex_lock(&sampler_mutex);
+                while (!requested && !tick) {
+                        if (conf_opt_u > 0)
+                                tick = pthread_cond_timedwait(
+                                           &sampler_cond, &sampler_mutex,
+                                           &deadline) == ETIMEDOUT;
+                        else
+                                pthread_cond_wait(&sampler_cond,
+                                                  &sampler_mutex);
+                }
+                requested = false;
+                mutex_unlock(&sampler_mutex);
+
+                sample_sockets(tick);
+                if (!tick) continue;
+
+                // Do not try to catch up if sampling took longer than -u.
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                add_micros(&deadline, conf_opt_u);
+                if (is_before(&deadline, &now)) {
+                        deadline = now;
+                        add_micros(&deadline, conf_opt_u);
+                }
+        }
+        // Unreachable
+        return NULL;
+}
+
+/* Public functions */
+
+void ti_start(void) {
+        if (conf_opt_u <= 0 && conf_opt_b <= 0) return;
+        if (!is_traced(SOCK_EV_TCP_INFO)) return;
+        mutex_lock(&sampler_mutex);
+        if (!sampler_started) {
+                pthread_t thread;
+                sampler_started = !my_pthread_create(&thread, NULL,
+                                                     sampler_thread, NULL);
+        }
+        mutex_unlock(&sampler_mutex);
+}
+
+void ti_request(void) {
+        mutex_lock(&sampler_mutex);
+        requested = true;
+        pthread_cond_signal(&sampler_cond);
+        mutex_unlock(&sampler_mutex);
+}
+
+long ti_next_interval(const TcpInfoState *prev, const TcpInfo *info,
+                      long interval) {
+        if (conf_opt_w <= conf_opt_u || !prev->count) return conf_opt_u;
+        TcpInfo last;
+        memcpy(&last, prev->words, sizeof(last));
+        if (has_moved(&last, info)) return conf_opt_u;
+        return (interval * 2 < conf_opt_w) ? interval * 2 : conf_opt_w;
+}
+
+/* The kernel times the send path of a connection: busy with data to send
+ * (busy time), including when limited by the receive window of the peer
+ * (rwnd limited) or by the send buffer (sndbuf limited). The rest of the busy
+ * time is limited by the congestion window, unless the delivery rate sample
+ * is marked application limited. A connection mostly idle is limited by the
+ * application. */
+TcpLimit ti_limited_by(const TcpInfoState *prev, const TcpInfo *info,
+                       size_t len, long elapsed_micros) {
+        if (!TCP_INFO_HAS(len, tcpi_sndbuf_limited)) return TCP_LIMIT_UNKNOWN;
+        uint64_t busy = info->tcpi_busy_time;
+        uint64_t rwnd = info->tcpi_rwnd_limited;
+        uint64_t sndbuf = info->tcpi_sndbuf_limited;
+        if (prev && prev->count) {
+                TcpInfo last;
+                memcpy(&last, prev->words, sizeof(last));
+                busy -= last.tcpi_busy_time;
+                rwnd -= last.tcpi_rwnd_limited;
+                sndbuf -= last.tcpi_sndbuf_limited;
+        }
+        bool idle = (elapsed_micros > 0 && busy * 2 < (uint64_t)elapsed_micros);
+        if (!busy || idle) return TCP_LIMIT_APP;
+        uint64_t cwnd = (rwnd + sndbuf < busy) ? busy - rwnd - sndbuf : 0;
+        if (rwnd >= sndbuf && rwnd >= cwnd) return TCP_LIMIT_RWND;
+        if (sndbuf >= cwnd) return TCP_LIMIT_SNDBUF;
+        return info->tcpi_delivery_rate_app_limited ? TCP_LIMIT_APP
+                                                    : TCP_LIMIT_CWND;
+}
+
+const char *string_from_tcp_limit(TcpLimit limit) {
+        static const char *strings[] = {"unknown", "app", "cwnd", "rwnd",
+                                        "sndbuf"};
+        return strings[limit];
+}
+
+void ti_encode(TcpInfoState *state, const TcpInfo *info,
+               SockEvTcpInfo *ev, Arena *arena) {
+        uint32_t words[TCP_INFO_WORDS];
+        memcpy(words, info, sizeof(words));
+        bool keyframe = (state->count++ % TCP_INFO_KEYFRAME == 0);
+
+        uint32_t delta[TCP_INFO_WORDS];
+        int n = 0;
+        ev->changed = 0;
+        for (size_t i = 0; i < TCP_INFO_WORDS; i++) {
+                if (!keyframe && words[i] == state->words[i]) continue;
+                ev->changed |= (uint64_t)1 << i;
+                delta[n++] = words[i];
+        }
+        ev->words = NULL;
+        if (n) {
+                ev->words = (uint32_t *)arena_alloc(arena, n * sizeof(uint32_t));
+                memcpy(ev->words, delta, n * sizeof(uint32_t));
+        }
+        memcpy(state->words, words, sizeof(words));
+}
+
+void ti_decode(TcpInfoState *state, SockEvTcpInfo *ev) {
+        if (!ev->super.success) return;  // Not encoded.
+        int n = 0;
+        if (!ev->words) ev->changed = 0;  // Corrupted, from a trace.
+        for (size_t i = 0; i < TCP_INFO_WORDS; i++)
+                if ((ev->changed >> i) & 1) state->words[i] = ev->words[n++];
+        state->count++;
+        ev->changed = TCP_INFO_ALL_WORDS;
+        ev->words = state->words;
+}
+
+void ti_reset(void) {
+        mutex_init(&sampler_mutex);
+        pthread_cond_init(&sampler_cond, NULL);
+        requested = false;
+        sampler_started = false;
+        free(samples);
+        samples = NULL;
+        samples_size = 0;
+        use_diag = true;
+}
@@ -0,0 +1,44 @@
+#ifndef TCP_INFO_H
+#define TCP_INFO_H
+
+#include "arena.h"
+#include "sock_events.h"
+
+/* Periodic TCP_INFO sampling of the TCP sockets, with -u & -b. Samples are
+ * taken by a dedicated thread, so that the traced calls never pay for the
+ * getsockopt(): every -u microseconds, the sampler records a SOCK_EV_TCP_INFO
+ * for each live TCP socket. The data path only compares the byte counters of
+ * the socket against -b and, when the threshold is crossed, flags the socket
+ * and wakes the sampler with ti_request().
+ *
+ * The sampler collects the tcp_info of all due sockets at once, with one
+ * NETLINK_SOCK_DIAG dump per address family. It falls back to getsockopt()
+ * for the sockets missing from the dump, and for all sockets if sock_diag is
+ * not available.
+ *
+ * With -w, the interval of each socket adapts to the connection: it goes
+ * back to -u whenever the congestion state moves between two samples, and
+ * doubles, up to -w, while it is stable. */
+
+void ti_start(void);    // Start the sampler, if -u or -b is set.
+void ti_request(void);  // Sample the flagged sockets now.
+void ti_reset(void);    // The sampler did not survive fork().
+
+// Interval after a successful sample, given the previous one.
+long ti_next_interval(const TcpInfoState *prev, const TcpInfo *info,
+                      long interval);
+// What limited the connection since the previous sample, or since its start
+// if prev is NULL. elapsed_micros is the time since, 0 if unknown.
+TcpLimit ti_limited_by(const TcpInfoState *prev, const TcpInfo *info,
+                       size_t len, long elapsed_micros);
+const char *string_from_tcp_limit(TcpLimit limit);
+
+// Fill ev with the delta of info against the previous sample. The words are
+// allocated from arena.
+void ti_encode(TcpInfoState *state, const TcpInfo *info,
+               SockEvTcpInfo *ev, Arena *arena);
+// Turn ev into a full sample, given the previous samples. The words then
+// belong to state, until the next call. A failed sample is left without.
+void ti_decode(TcpInfoState *state, SockEvTcpInfo *ev);
+
+#endif
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+
+/* tcpsnitch-convert expands binary traces (see binary_format.h) to the JSON
+ * traces the library writes by default. It reuses the library JSON writer,
+ * so both paths produce identical files. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binary_format.h"
+#include "json_writer.h"
+#include "lib.h"
+#include "tcp_info.h"
+
+static char *alloc_json_path(const char *bin_path) {
+        size_t n = strlen(bin_path);
+        const char *ext = ".bin";
+        size_t ext_len = strlen(ext);
+        if (n >= ext_len && !strcmp(bin_path + n - ext_len, ext)) n -= ext_len;
+
+        char *path = (char *)my_malloc(n + strlen(".json") + 1);
+        memcpy(path, bin_path, n);
+        strcpy(path + n, ".json");
+        return path;
+}
+
+static bool convert(const char *bin_path) {
+        FILE *in, *out;
+        char *json_path = alloc_json_path(bin_path);
+        BinTraceReader reader;
+        SockEvent *ev;
+        AddrStrCache addr_cache = {.addr.len = 0};  // A trace is one socket.
+        TcpInfoState tcp_info = {.count = 0};
+        bool ok = false;
+
+        if (!(in = fopen(bin_path, "r"))) goto error1;
+        if (!(out = fopen(json_path, "w"))) goto error2;
+        if (!bin_trace_open(&reader, in)) goto exit;
+
+        while ((ev = bin_trace_next(&reader))) {
+                if (ev->type == SOCK_EV_TCP_INFO)
+                        ti_decode(&tcp_info, (SockEvTcpInfo *)ev);
+                fputs(sock_ev_json(ev, &addr_cache, NULL), out);
+                fputs("\n", out);
+        }
+        ok = !reader.error;
+exit:
+        bin_trace_close(&reader);
+        if (fclose(out) == EOF) ok = false;
+        fclose(in);
+        free(json_path);
+        if (!ok) fprintf(stderr, "%s: conversion failed.\n", bin_path);
+        return ok;
+error2:
+        fprintf(stderr, "%s: %s.\n", json_path, strerror(errno));
+        fclose(in);
+        free(json_path);
+        return false;
+error1:
+        fprintf(stderr, "%s: %s.\n", bin_path, strerror(errno));
+        free(json_path);
+        return false;
+}
+
+int main(int argc, char **argv) {
+        if (argc < 2) {
+                fprintf(stderr, "Usage: tcpsnitch-convert <trace.bin>...\n");
+                fprintf(stderr, "Writes <trace>.json next to each trace.\n");
+                return EXIT_FAILURE;
+        }
+
+        int rc = EXIT_SUCCESS;
+        for (int i = 1; i < argc; i++)
+                if (!convert(argv[i])) rc = EXIT_FAILURE;
+        return rc;
+}
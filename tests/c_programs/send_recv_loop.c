@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/unistd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(void) {
+  int lsock, csock, ssock;
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(0);
+  inet_aton("127.0.0.1", &addr.sin_addr);
+
+  socklen_t len = sizeof(addr);
+  char buf[100] = {0};
+  ssize_t n;
+  if ((lsock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    return(EXIT_FAILURE);
+  if (getsockname(lsock, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if (listen(lsock, 1) < 0)
+    return(EXIT_FAILURE);
+  if ((csock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return(EXIT_FAILURE);
+  if (connect(csock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    return(EXIT_FAILURE);
+  if ((ssock = accept(lsock, NULL, NULL)) < 0)
+    return(EXIT_FAILURE);
+  for (int i = 0; i < 3000; i++) {
+    if (send(csock, buf, 10, 0) != 10)
+      return(EXIT_FAILURE);
+    if (recv(ssock, buf, sizeof(buf), 0) != 10)
+      return(EXIT_FAILURE);
+  }
+  close(csock);
+  while ((n = recv(ssock, buf, sizeof(buf), 0)) > 0);
+  if (n < 0)
+    return(EXIT_FAILURE);
+  close(ssock);
+  close(lsock);
+
+  return(EXIT_SUCCESS);
+}
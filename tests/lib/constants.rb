@@ -1,10 +1,13 @@
 EXECUTABLE="../bin/tcpsnitch"
+CONVERTER="../bin/tcpsnitch-convert"
 LD_PRELOAD="LD_PRELOAD=../libtcpsnitch.so.1.0"
 TEST_DIR="/tmp/netspy"
 
 # LOGS
 PROCESS_DIR_REGEX="*.out*"
 LOG_FILE="logs.txt"
+THREADS_FILE="threads.json"
+LATENCY_FILE="latency.json"
 LOG_LABEL_ERROR="ERROR"
 LOG_LABEL_WARN="WARN"
 LOG_LABEL_INFO="INFO"
@@ -69,6 +72,14 @@ SOCK_EV_EPOLL_PWAIT="epoll_pwait"
 SOCK_EV_FDOPEN="fdopen"
 
 SOCK_EV_TCP_INFO="tcp_info"
+TCP_INFO_KEYFRAME=64 # Samples between full tcp_info samples, see sock_events.h
+
+# Events which are not calls
+SOCK_EV_GHOST_SOCKET="ghost_socket"
+SOCK_EV_SKIPPED="skipped"
+SOCK_EV_COALESCED="coalesced"
+SOCK_EV_SUMMARY="summary"
+SOCK_EV_LATENCY="latency"
 
 SOCKET_SYSCALLS = [
   SOCK_EV_SOCKET,
@@ -1,3 +1,4 @@
+require 'json'
 require 'json_expressions/minitest'
 require 'tempfile'
 require './lib/constants.rb'
@@ -76,6 +77,26 @@ def read_json_as_array(con_id=0)
   wrap_as_array(read_json_trace(con_id))
 end
 
+# The events of the given type, in the JSON trace of con_id.
+def read_events(con_id, type)
+  JSON.parse(read_json_as_array(con_id)).select { |ev| ev['type'] == type }
+end
+
+def bin_file_str(con_id=0)
+  dir_str+"/#{con_id}.bin"
+end
+
+def convert_bin_trace(con_id=0)
+  system("#{CONVERTER} #{bin_file_str(con_id)} >/dev/null 2>&1")
+end
+
+# Events without the fields which differ from one run to the next.
+def events_without_timing(json_array)
+  JSON.parse(json_array).map do |ev|
+    ev.reject { |k, _| ['timestamp_usec', 'thread_id'].include?(k) }
+  end
+end
+
 ##################
 # Others helpers #
 ##################
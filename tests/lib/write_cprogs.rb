@@ -1108,3 +1108,39 @@ CONCURRENT_CONNECTIONS = CProg.new(<<-EOT, 'concurrent_connections')
   close(sock1);
   close(sock2);
 EOT
+
+# A loopback connection: 3000 send() of 10 bytes on connection 1, each
+# received on connection 2, then recv() until EOF.
+SEND_RECV_LOOP = CProg.new(<<-EOT, 'send_recv_loop')
+  int lsock, csock, ssock;
+#{sockaddr_in(0)}
+  socklen_t len = sizeof(addr);
+  char buf[100] = {0};
+  ssize_t n;
+  if ((lsock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return(EXIT_FAILURE);
+  if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    return(EXIT_FAILURE);
+  if (getsockname(lsock, (struct sockaddr *)&addr, &len) < 0)
+    return(EXIT_FAILURE);
+  if (listen(lsock, 1) < 0)
+    return(EXIT_FAILURE);
+  if ((csock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    return(EXIT_FAILURE);
+  if (connect(csock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    return(EXIT_FAILURE);
+  if ((ssock = accept(lsock, NULL, NULL)) < 0)
+    return(EXIT_FAILURE);
+  for (int i = 0; i < 3000; i++) {
+    if (send(csock, buf, 10, 0) != 10)
+      return(EXIT_FAILURE);
+    if (recv(ssock, buf, sizeof(buf), 0) != 10)
+      return(EXIT_FAILURE);
+  }
+  close(csock);
+  while ((n = recv(ssock, buf, sizeof(buf), 0)) > 0);
+  if (n < 0)
+    return(EXIT_FAILURE);
+  close(ssock);
+  close(lsock);
+EOT
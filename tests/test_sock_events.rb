@@ -44,6 +44,93 @@ describe 'tcp_spy' do
     end
   end
 
+  describe 'sampling' do
+    it 'should report the bytes of the events skipped with -s' do
+      run_c_program('send_recv_loop', '-s 3')
+      sent = read_events(1, SOCK_EV_SEND).map { |ev| ev['return_value'] }.sum
+      skipped = read_events(1, SOCK_EV_SKIPPED)
+      assert !skipped.empty?
+      sent += skipped.map { |ev| ev['details']['bytes_sent'] }.sum
+      assert_equal 30000, sent
+    end
+
+    it 'should terminate with -m larger than the ring buffers' do
+      reset_dir(TEST_DIR)
+      assert tcpsnitch("-d #{TEST_DIR} -m 2000",
+                       'timeout 10 ./c_programs/send_recv_loop.out')
+      skipped = read_events(1, SOCK_EV_SKIPPED)
+      skipped = skipped.map { |ev| ev['details']['events'] }.sum
+      assert_equal 3000, read_events(1, SOCK_EV_SEND).size + skipped
+      assert_equal 1, read_events(1, SOCK_EV_CLOSE).size
+    end
+  end
+
+  describe 'coalescing' do
+    # -t 0: no periodic dump splits the runs.
+    it 'should coalesce the send() calls into a single event with -g' do
+      run_c_program('send_recv_loop', '-g -t 0')
+      runs = read_events(1, SOCK_EV_COALESCED)
+      assert_equal 1, runs.size
+      assert_equal SOCK_EV_SEND, runs[0]['details']['event']
+      assert_equal 3000, runs[0]['details']['count']
+      assert_equal 30000, runs[0]['details']['bytes']
+      assert read_events(1, SOCK_EV_SEND).empty?
+    end
+
+    it 'should add up the bytes received, not requested, with -g' do
+      run_c_program('send_recv_loop', '-g -t 0')
+      runs = read_events(2, SOCK_EV_COALESCED)
+      assert_equal 1, runs.size
+      assert_equal 3000, runs[0]['details']['count']
+      assert_equal 30000, runs[0]['details']['bytes']
+      assert_equal 10, runs[0]['details']['max_bytes']
+    end
+
+    it 'should not merge a recv() at EOF into a run' do
+      run_c_program('send_recv_loop', '-g -t 0')
+      trace = JSON.parse(read_json_as_array(2))
+      run = trace.index { |ev| ev['type'] == SOCK_EV_COALESCED }
+      eof = trace.index { |ev| ev['type'] == SOCK_EV_RECV }
+      assert eof > run
+      assert_equal 0, trace[eof]['return_value']
+    end
+  end
+
+  describe 'summary mode' do
+    # -t 0: a single summary, when the socket is closed.
+    it 'should only record summary events with -z' do
+      run_c_program('send_recv_loop', '-z -t 0')
+      (0..2).each do |con_id|
+        trace = JSON.parse(read_json_as_array(con_id))
+        assert_equal [SOCK_EV_SUMMARY], trace.map { |ev| ev['type'] }
+      end
+    end
+
+    it 'should count the calls of the program with -z' do
+      run_c_program('send_recv_loop', '-z -t 0')
+      calls = read_events(1, SOCK_EV_SUMMARY)[0]['details']['calls']
+      assert_equal({ SOCK_EV_SOCKET => 1, SOCK_EV_CONNECT => 1,
+                     SOCK_EV_SEND => 3000, SOCK_EV_CLOSE => 1 }, calls)
+      calls = read_events(2, SOCK_EV_SUMMARY)[0]['details']['calls']
+      assert_equal({ SOCK_EV_ACCEPT => 1, SOCK_EV_RECV => 3001,
+                     SOCK_EV_CLOSE => 1 }, calls)
+    end
+  end
+
+  describe 'event filter' do
+    # Sockets are traced from their first recorded call: the client first.
+    it 'should only record the listed calls with -o' do
+      run_c_program('send_recv_loop', '-o connect,close')
+      types = (0..2).map do |con_id|
+        JSON.parse(read_json_as_array(con_id)).map { |ev| ev['type'] }
+      end
+      assert_equal [SOCK_EV_GHOST_SOCKET, SOCK_EV_CONNECT, SOCK_EV_CLOSE],
+                   types[0]
+      assert_equal [SOCK_EV_GHOST_SOCKET, SOCK_EV_CLOSE], types[1]
+      assert_equal [SOCK_EV_GHOST_SOCKET, SOCK_EV_CLOSE], types[2]
+    end
+  end
+
   shared_fields = {
     details: Hash,
     return_value: Integer,
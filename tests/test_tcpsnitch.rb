@@ -25,7 +25,7 @@ describe "tcpsnitch" do
     end
   end
 
-  ["-b", "-f", "-l", "-t", "-u"].each do |opt|
+  ["-b", "-f", "-i", "-l", "-m", "-s", "-t", "-u", "-w"].each do |opt|
     describe "when #{opt} is set" do
       it "should report 'invalid #{opt} argument'" do
         assert_match(/invalid #{opt} argument/, tcpsnitch_output("#{opt} -42", cmd))
@@ -55,6 +55,100 @@ describe "tcpsnitch" do
     # Rest is tested in test_packet_sniffer.rb
   end
 
+  describe "option -r" do
+    it "should record binary traces with -r" do
+      run_c_program(SOCK_EV_SEND, "-r")
+      assert contains?(dir_str, "0.bin")
+      assert !contains?(dir_str, "0.json")
+    end
+
+    it "should convert to the trace recorded without -r" do
+      run_c_program(SOCK_EV_SEND)
+      json_trace = events_without_timing(read_json_as_array)
+      run_c_program(SOCK_EV_SEND, "-r")
+      assert convert_bin_trace
+      assert_equal json_trace, events_without_timing(read_json_as_array)
+    end
+  end
+
+  describe "option -u" do
+    # Fields which stay the same on the client socket of send_recv_loop, and
+    # some which never decrease.
+    let(:constant) { ['state', 'options', 'snd_wscale', 'rcv_wscale',
+                      'snd_mss', 'advmss', 'pmtu'] }
+    let(:counters) { ['bytes_acked', 'bytes_sent', 'segs_out',
+                      'data_segs_out'] }
+
+    def tcp_info_samples
+      read_events(1, SOCK_EV_TCP_INFO).map { |ev| ev['details'] }
+    end
+
+    # Past a keyframe, the samples are decoded from deltas.
+    def assert_full_samples(samples)
+      assert samples.size > TCP_INFO_KEYFRAME
+      samples.each do |s|
+        assert_equal samples[0].keys, s.keys
+        assert_equal samples[0].values_at(*constant), s.values_at(*constant)
+      end
+      samples.each_cons(2) do |a, b|
+        counters.each { |c| assert a[c] <= b[c] }
+      end
+    end
+
+    it "should record full tcp_info samples" do
+      run_c_program('send_recv_loop', '-u 10')
+      assert_full_samples(tcp_info_samples)
+    end
+
+    it "should convert the tcp_info samples recorded with -r" do
+      run_c_program('send_recv_loop', '-u 10')
+      json_sample = tcp_info_samples[0]
+      run_c_program('send_recv_loop', '-u 10 -r')
+      assert convert_bin_trace(1)
+      samples = tcp_info_samples
+      assert_full_samples(samples)
+      assert_equal json_sample.keys, samples[0].keys
+      assert_equal json_sample.values_at(*constant),
+                   samples[0].values_at(*constant)
+    end
+  end
+
+  describe "option -e" do
+    # Calls of send_recv_loop, by connection: the listening socket, then the
+    # client and accepted sockets.
+    let(:calls) { [{ 'accept' => 1, 'close' => 1 },
+                   { 'connect' => 1, 'send' => 3000, 'close' => 1 },
+                   { 'recv' => 3001, 'close' => 1 }] }
+
+    def assert_histogram(count, h)
+      assert_equal count, h['count']
+      assert_equal count, h['buckets'].map { |b| b[1] }.sum
+      quantiles = ['p50_ns', 'p90_ns', 'p99_ns', 'p999_ns', 'max_ns']
+      h.values_at(*quantiles).each_cons(2) { |a, b| assert a <= b }
+    end
+
+    it "should write the latency of the calls to latency.json" do
+      run_c_program('send_recv_loop', '-e')
+      total = calls.reduce { |a, b| a.merge(b) { |_, x, y| x + y } }
+      latency = JSON.parse(File.read(dir_str+"/"+LATENCY_FILE))
+      assert_equal total.keys.sort, latency.keys.sort
+      total.each { |call, count| assert_histogram(count, latency[call]) }
+    end
+
+    it "should record the latency of the calls on each socket" do
+      run_c_program('send_recv_loop', '-e')
+      calls.each_with_index do |expected, con_id|
+        events = read_events(con_id, SOCK_EV_LATENCY)
+        assert !events.empty?
+        counts = Hash.new(0)
+        events.each do |ev|
+          ev['details'].each { |call, h| counts[call] += h['count'] }
+        end
+        assert_equal expected, counts
+      end
+    end
+  end
+
   describe "when -d is set" do
     it "should report 'invalid argument' with invalid dir" do
       assert_match(/invalid -d argument/, tcpsnitch_output("-d 1234", cmd))
@@ -70,6 +164,15 @@ describe "tcpsnitch" do
       tcpsnitch("-d #{TEST_DIR}", cmd)
       assert !dir_empty?(TEST_DIR)
     end
+
+    it "should count the events of each thread" do
+      run_c_program('send_recv_loop')
+      threads = JSON.parse(File.read(dir_str+"/"+THREADS_FILE))['threads']
+      assert_equal 1, threads.size
+      assert !threads[0]['terminated']
+      events = (0..2).map { |id| JSON.parse(read_json_as_array(id)).size }
+      assert_equal events.sum, threads[0]['events']
+    end
   end
 
   describe "when -l is set" do
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+
+#include "thread_cache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "json_writer.h"
+#include "lib.h"
+#include "logger.h"
+#include "thread_registry.h"
+
+typedef struct {
+        ThreadRecord super;
+        pid_t tid;
+        atomic_ulong events;  // Only written by the owner thread.
+} ThreadCache;
+
+static void release_cache(ThreadRecord *rec);
+
+static ThreadRegistry threads = TR_INITIALIZER(ThreadCache, my_calloc, release_cache);
+static __thread ThreadRecord *my_cache = NULL;
+// Terminated threads, the first TC_MAX_EXITED by tid.
+static pthread_mutex_t exited_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TcThreadCount *exited = NULL;
+static size_t exited_count = 0;
+static size_t exited_size = 0;
+static unsigned long other_threads = 0;
+static unsigned long other_events = 0;
+
+static void add_exited(pid_t tid, unsigned long events) {
+        if (exited_count == exited_size && exited_size < TC_MAX_EXITED) {
+                size_t size = exited_size ? exited_size * 2 : 64;
+                TcThreadCount *e = (TcThreadCount *)my_realloc(
+                    exited, size * sizeof(TcThreadCount));
+                if (e) {
+                        exited = e;
+                        exited_size = size;
+                }
+        }
+        if (exited_count < exited_size) {
+                TcThreadCount *e = &exited[exited_count++];
+                e->tid = tid;
+                e->events = events;
+                e->terminated = true;
+        } else {
+                other_threads++;
+                other_events += events;
+        }
+}
+
+static void release_cache(ThreadRecord *rec) {
+        ThreadCache *c = (ThreadCache *)rec;
+        pthread_mutex_lock(&exited_mutex);
+        add_exited(c->tid, atomic_load(&c->events));
+        pthread_mutex_unlock(&exited_mutex);
+}
+
+static ThreadCache *get_cache(void) {
+        if (my_cache) return (ThreadCache *)my_cache;
+        ThreadCache *cache = (ThreadCache *)tr_adopt(&threads, &my_cache);
+        cache->tid = syscall(SYS_gettid);
+        atomic_store(&cache->events, 0);
+        return cache;
+}
+
+pid_t tc_get_tid(void) { return get_cache()->tid; }
+
+void tc_count_event(void) {
+        ThreadCache *cache = get_cache();
+        // Single writer: no need for an atomic read-modify-write.
+        unsigned long n =
+            atomic_load_explicit(&cache->events, memory_order_relaxed);
+        atomic_store_explicit(&cache->events, n + 1, memory_order_relaxed);
+}
+
+void tc_dump(const char *path) {
+        // Threads cannot terminate meanwhile, but new ones may start.
+        pthread_mutex_lock(&exited_mutex);
+        size_t count = exited_count;
+        for (ThreadRecord *r = atomic_load(&threads.records); r; r = r->next)
+                if (atomic_load(&r->in_use)) count++;
+        TcThreadCount *counts =
+            (TcThreadCount *)my_malloc((count + 1) * sizeof(TcThreadCount));
+        if (!counts) goto exit;
+
+        size_t n = exited_count;
+        memcpy(counts, exited, n * sizeof(TcThreadCount));
+        for (ThreadRecord *r = atomic_load(&threads.records); r && n < count;
+             r = r->next) {
+                if (!atomic_load(&r->in_use)) continue;
+                ThreadCache *c = (ThreadCache *)r;
+                counts[n].tid = c->tid;
+                counts[n].events = atomic_load_explicit(&c->events,
+                                                        memory_order_relaxed);
+                counts[n].terminated = false;
+                n++;
+        }
+        const char *json =
+            threads_json(counts, n, other_threads, other_events, NULL);
+        if (append_string_to_file(json, path)) LOG_FUNC_ERROR;
+        free(counts);
+exit:
+        pthread_mutex_unlock(&exited_mutex);
+}
+
+/* Only the calling thread survives fork(), and its cached tid is the one of
+ * its parent thread. The events of the parent are reported by the parent. */
+void tc_reset(void) {
+        tr_reset(&threads, my_cache);
+        if (my_cache) {
+                ThreadCache *cache = (ThreadCache *)my_cache;
+                cache->tid = syscall(SYS_gettid);
+                atomic_store(&cache->events, 0);
+        }
+        pthread_mutex_init(&exited_mutex, NULL);
+        exited_count = 0;
+        other_threads = other_events = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef THREAD_CACHE_H
+#define THREAD_CACHE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Per-thread state which is costly to get on the hot path: the kernel thread
+ * id, fetched once per thread instead of once per event, and the number of
+ * events the thread recorded. The record of a terminated thread is reused by
+ * the next new thread, once its tid and counter are moved to the list of the
+ * terminated threads. Past TC_MAX_EXITED of them, only their total is kept. */
+
+#define TC_MAX_EXITED (1 << 16)
+
+typedef struct {
+        pid_t tid;
+        unsigned long events;
+        bool terminated;
+} TcThreadCount;
+
+pid_t tc_get_tid(void);
+void tc_count_event(void);
+
+void tc_dump(const char *path);  // Write the event counters as JSON.
+void tc_reset(void);             // Forget the parent's threads, after fork().
+
+#endif
@@ -0,0 +1,67 @@
+#define _GNU_SOURCE
+
+#include "thread_registry.h"
+#include <pthread.h>
+
+// One key for the records of all registries: its value is the last record
+// adopted by the thread, the others follow by next_mine.
+static pthread_key_t records_key;
+static pthread_once_t records_key_once = PTHREAD_ONCE_INIT;
+static __thread ThreadRecord *my_records = NULL;
+
+/* Private functions */
+
+static void release_records(void *records) {
+        // Records adopted by later destructors are released on the next pass.
+        my_records = NULL;
+        ThreadRecord *rec = (ThreadRecord *)records;
+        while (rec) {
+                // The record is not ours once released.
+                ThreadRecord *next = rec->next_mine;
+                if (rec->registry->release) rec->registry->release(rec);
+                *rec->self = NULL;
+                atomic_store(&rec->in_use, false);
+                rec = next;
+        }
+}
+
+static void make_records_key(void) {
+        pthread_key_create(&records_key, release_records);
+}
+
+/* Public functions */
+
+ThreadRecord *tr_adopt(ThreadRegistry *reg, ThreadRecord **self) {
+        // Adopt the record of a terminated thread if possible.
+        ThreadRecord *rec;
+        for (rec = atomic_load(&reg->records); rec; rec = rec->next) {
+                bool expected = false;
+                if (atomic_compare_exchange_strong(&rec->in_use, &expected,
+                                                   true))
+                        break;
+        }
+
+        if (!rec) {
+                rec = (ThreadRecord *)reg->alloc(reg->size);
+                if (!rec) return NULL;
+                atomic_init(&rec->in_use, true);
+                rec->registry = reg;
+                rec->next = atomic_load(&reg->records);
+                while (!atomic_compare_exchange_weak(&reg->records,
+                                                     &rec->next, rec))
+                        ;
+        }
+
+        rec->self = self;
+        rec->next_mine = my_records;
+        my_records = rec;
+        pthread_once(&records_key_once, make_records_key);
+        pthread_setspecific(records_key, rec);
+        return *self = rec;
+}
+
+void tr_reset(ThreadRegistry *reg, const ThreadRecord *mine) {
+        for (ThreadRecord *rec = atomic_load(&reg->records); rec;
+             rec = rec->next)
+                if (rec != mine) atomic_store(&rec->in_use, false);
+}
@@ -0,0 +1,48 @@
+#ifndef THREAD_REGISTRY_H
+#define THREAD_REGISTRY_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Per-thread records which outlive their thread. The records of a registry
+ * are kept in a lock-free list, which other threads may walk. When a thread
+ * terminates, its record is released, and the next new thread adopts it
+ * instead of allocating one. Records are never freed.
+ *
+ * A record starts with a ThreadRecord, named super. Its owner keeps a
+ * thread-local pointer to it, which is set by tr_adopt() and cleared when
+ * the record is released: a later TLS destructor then adopts a new record,
+ * as a new thread may adopt the released one at once. */
+
+typedef struct ThreadRecord ThreadRecord;
+typedef struct ThreadRegistry ThreadRegistry;
+
+struct ThreadRecord {
+        atomic_bool in_use;  // Owned by a live thread.
+        ThreadRecord *next;  // In the registry.
+        ThreadRegistry *registry;
+        ThreadRecord **self;      // Thread-local pointer of the owner.
+        ThreadRecord *next_mine;  // Of the owner, in another registry.
+};
+
+struct ThreadRegistry {
+        _Atomic(ThreadRecord *) records;
+        size_t size;                    // Of the records.
+        void *(*alloc)(size_t size);    // Zeroed memory, e.g. my_calloc().
+        // Called by the owner as it terminates, before the record is left,
+        // or NULL.
+        void (*release)(ThreadRecord *rec);
+};
+
+#define TR_INITIALIZER(type, alloc, release) \
+        { NULL, sizeof(type), alloc, release }
+
+// Adopt a released record, or allocate one, for the calling thread and
+// point self to it. NULL if alloc failed.
+ThreadRecord *tr_adopt(ThreadRegistry *reg, ThreadRecord **self);
+
+// Only the calling thread survives fork(): leave the other records.
+void tr_reset(ThreadRegistry *reg, const ThreadRecord *mine);
+
+#endif
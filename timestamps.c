@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+
+#include "timestamps.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TS_TSC
+#endif
+
+#define CLOCKSOURCE_PATH \
+        "/sys/devices/system/clocksource/clocksource0/current_clocksource"
+
+static TsAnchor anchor;
+static clockid_t clock_id = CLOCK_MONOTONIC_RAW;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static uint64_t clock_ns(clockid_t id) {
+        struct timespec ts;
+        clock_gettime(id, &ts);
+        return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+#ifdef TS_TSC
+/* ns = base_ns + (tsc - base_tsc) * mult >> shift. Written once by the thread
+ * which calibrates, then published with tsc_ready. */
+typedef struct {
+        uint64_t base_tsc;
+        uint64_t base_ns;
+        uint64_t mult;  // Less than 2^32.
+        int shift;      // At most 32.
+} TscParams;
+
+static TscParams tsc;
+static uint64_t anchor_tsc;
+static bool tsc_usable = false;
+static atomic_bool tsc_ready = false;
+static atomic_flag calibrating = ATOMIC_FLAG_INIT;
+
+// The TSC runs at a constant rate and the kernel trusts it to be synchronized
+// across CPUs.
+static bool is_tsc_usable(void) {
+        unsigned int a, b, c, d;
+        if (!__get_cpuid(0x80000007, &a, &b, &c, &d)) return false;
+        if (!(d & (1 << 8))) return false;  // Invariant TSC.
+
+        char buf[32] = "";
+        FILE *fp = fopen(CLOCKSOURCE_PATH, "r");
+        if (!fp) return false;
+        bool ok = fgets(buf, sizeof(buf), fp) && !strcmp(buf, "tsc\n");
+        fclose(fp);
+        return ok;
+}
+
+static uint64_t tsc_to_ns(uint64_t now) {
+        // Split the product to avoid overflowing 64 bits on long runs.
+        uint64_t delta = now - tsc.base_tsc;
+        uint64_t lo = ((delta & 0xffffffff) * tsc.mult) >> tsc.shift;
+        uint64_t hi = ((delta >> 32) * tsc.mult) << (32 - tsc.shift);
+        return tsc.base_ns + hi + lo;
+}
+
+static void calibrate(void) {
+        uint64_t now_tsc = __rdtsc();
+        uint64_t now_mono = clock_ns(clock_id);
+        double ns_per_tick =
+            (double)(now_mono - anchor.mono_ns) / (now_tsc - anchor_tsc);
+        int shift = 32;
+        while (shift > 0 && ns_per_tick * ((uint64_t)1 << shift) >= UINT32_MAX)
+                shift--;
+        tsc.base_tsc = now_tsc;
+        tsc.base_ns = anchor.wall_ns + (now_mono - anchor.mono_ns);
+        tsc.mult = ns_per_tick * ((uint64_t)1 << shift) + 0.5;
+        tsc.shift = shift;
+        atomic_store_explicit(&tsc_ready, true, memory_order_release);
+}
+#endif
+
+static void init(void) {
+        struct timespec ts;
+        if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) {
+                clock_id = CLOCK_MONOTONIC;
+                anchor.clock = TS_CLOCK_MONOTONIC;
+        }
+#ifdef TS_TSC
+        if (clock_id == CLOCK_MONOTONIC_RAW && (tsc_usable = is_tsc_usable()))
+                anchor.clock = TS_CLOCK_TSC;
+        anchor_tsc = __rdtsc();
+#endif
+        anchor.mono_ns = clock_ns(clock_id);
+        anchor.wall_ns = clock_ns(CLOCK_REALTIME);
+}
+
+void ts_init(void) { pthread_once(&init_once, init); }
+
+uint64_t ts_now_ns(void) {
+#ifdef TS_TSC
+        if (atomic_load_explicit(&tsc_ready, memory_order_acquire))
+                return tsc_to_ns(__rdtsc());
+#endif
+        uint64_t elapsed = clock_ns(clock_id) - anchor.mono_ns;
+#ifdef TS_TSC
+        if (tsc_usable && elapsed >= TS_CALIBRATION_NS &&
+            !atomic_flag_test_and_set(&calibrating))
+                calibrate();
+#endif
+        return anchor.wall_ns + elapsed;
+}
+
+const TsAnchor *ts_get_anchor(void) { return &anchor; }
+
+const char *string_from_ts_clock(TsClock clock) {
+        static const char *strings[] = {"CLOCK_MONOTONIC_RAW",
+                                        "CLOCK_MONOTONIC", "TSC"};
+        return strings[clock];
+}
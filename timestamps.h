@@ -0,0 +1,35 @@
+#ifndef TIMESTAMPS_H
+#define TIMESTAMPS_H
+
+#include <stdint.h>
+
+/* Event timestamps, in nanoseconds since the Epoch. They are measured with a
+ * monotonic clock and aligned on the wall clock once, at ts_init(): NTP
+ * adjustments do not reorder them, but they may drift from the wall clock
+ * over time.
+ *
+ * The clock is CLOCK_MONOTONIC_RAW (served by the vDSO). When the kernel
+ * itself relies on an invariant TSC, timestamps switch to rdtsc once it has
+ * been calibrated against CLOCK_MONOTONIC_RAW, TS_CALIBRATION_NS after the
+ * anchor. */
+
+#define TS_CALIBRATION_NS (100 * 1000 * 1000)
+
+typedef enum TsClock {
+        TS_CLOCK_MONOTONIC_RAW,
+        TS_CLOCK_MONOTONIC,  // Fallback if CLOCK_MONOTONIC_RAW is missing.
+        TS_CLOCK_TSC         // Calibrated against CLOCK_MONOTONIC_RAW.
+} TsClock;
+
+typedef struct {
+        uint64_t wall_ns;  // CLOCK_REALTIME at the anchor.
+        uint64_t mono_ns;  // Monotonic clock at the anchor.
+        TsClock clock;
+} TsAnchor;
+
+void ts_init(void);  // Idempotent.
+uint64_t ts_now_ns(void);
+const TsAnchor *ts_get_anchor(void);
+const char *string_from_ts_clock(TsClock clock);
+
+#endif
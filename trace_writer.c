@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+
+#include "trace_writer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "init.h"
+#include "lib.h"
+#include "libc_symbols.h"
+#include "logger.h"
+
+#if !defined(__ANDROID__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define TW_IO_URING
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef __ANDROID__
+#define MUTEX_ERRORCHECK PTHREAD_ERRORCHECK_MUTEX_INITIALIZER
+#else
+#define MUTEX_ERRORCHECK PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP
+#endif
+
+#define TW_MIN_CHUNK_SIZE 512   // First chunk of a file, then doubling.
+#define TW_MAX_FREE_CHUNKS 64   // Chunks of TW_CHUNK_SIZE kept for reuse.
+#define TW_MAX_IOV 64           // Chunks per writev() call.
+
+typedef struct Chunk Chunk;
+struct Chunk {
+        Chunk *next;
+        size_t len;
+        size_t size;
+        char data[];
+};
+
+struct TraceFile {
+        char *path;
+        int fd;          // -1 if not open. Writer side.
+        Chunk *head;     // Pending data.
+        Chunk *tail;
+        Chunk *flushing;  // Data being written. Writer side.
+        bool closed;      // Release after the last flush.
+        bool release;     // Closed when the current flush started.
+        bool dirty;       // In the dirty list.
+        TraceFile *next_dirty;
+        TraceFile *next_batch;
+        TraceFile *prev;  // All files, to drop them after fork().
+        TraceFile *next;
+        TraceFile *lru_prev;  // Open files, most recently used first.
+        TraceFile *lru_next;  // Writer side.
+};
+
+// Protects the files lists, their pending data & the chunk pool.
+static pthread_mutex_t state_mutex = MUTEX_ERRORCHECK;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static TraceFile *files = NULL;
+static TraceFile *dirty = NULL;  // Files with pending data or closed.
+static size_t pending_bytes = 0;
+static unsigned long dropped_events = 0;
+static unsigned long reported_drops = 0;  // Logged by the writer.
+static Chunk *free_chunks = NULL;
+static int free_chunks_count = 0;
+static bool writer_started = false;
+
+// Serializes flushes. Also protects the writer side of the files.
+static pthread_mutex_t flush_mutex = MUTEX_ERRORCHECK;
+static TraceFile *lru_head = NULL;
+static TraceFile *lru_tail = NULL;
+static int open_files = 0;
+
+/* Private functions */
+
+// Small chunks first, so that idle sockets do not hold large buffers.
+static Chunk *alloc_chunk(const Chunk *prev) {
+        size_t size = prev ? prev->size * 2 : TW_MIN_CHUNK_SIZE;
+        Chunk *c;
+        if (size >= TW_CHUNK_SIZE && free_chunks) {
+                c = free_chunks;
+                free_chunks = c->next;
+                free_chunks_count--;
+        } else {
+                if (size > TW_CHUNK_SIZE) size = TW_CHUNK_SIZE;
+                c = (Chunk *)my_malloc(sizeof(Chunk) + size);
+                c->size = size;
+        }
+        c->next = NULL;
+        c->len = 0;
+        return c;
+}
+
+static void recycle_chunks(Chunk *c) {
+        Chunk *next;
+        for (; c; c = next) {
+                next = c->next;
+                if (c->size == TW_CHUNK_SIZE &&
+                    free_chunks_count < TW_MAX_FREE_CHUNKS) {
+                        c->next = free_chunks;
+                        free_chunks = c;
+                        free_chunks_count++;
+                } else {
+                        free(c);
+                }
+        }
+}
+
+static void free_chunks_list(Chunk *c) {
+        Chunk *next;
+        for (; c; c = next) {
+                next = c->next;
+                free(c);
+        }
+}
+
+static void mark_dirty(TraceFile *file) {
+        if (file->dirty) return;
+        file->dirty = true;
+        file->next_dirty = dirty;
+        dirty = file;
+}
+
+// LRU of open files
+
+static void lru_unlink(TraceFile *file) {
+        if (file->lru_prev)
+                file->lru_prev->lru_next = file->lru_next;
+        else
+                lru_head = file->lru_next;
+        if (file->lru_next)
+                file->lru_next->lru_prev = file->lru_prev;
+        else
+                lru_tail = file->lru_prev;
+        file->lru_prev = file->lru_next = NULL;
+}
+
+static void lru_push(TraceFile *file) {
+        file->lru_prev = NULL;
+        file->lru_next = lru_head;
+        if (lru_head) lru_head->lru_prev = file;
+        lru_head = file;
+        if (!lru_tail) lru_tail = file;
+}
+
+static void close_file_fd(TraceFile *file) {
+        if (file->fd == -1) return;
+        lru_unlink(file);
+        if (ORIG(close)(file->fd))
+                LOG(ERROR, "close() failed. %s.", strerror(errno));
+        file->fd = -1;
+        open_files--;
+}
+
+static int get_file_fd(TraceFile *file) {
+        if (file->fd != -1) {
+                lru_unlink(file);
+                lru_push(file);
+                return file->fd;
+        }
+
+        if (open_files >= TW_MAX_OPEN_FILES) close_file_fd(lru_tail);
+        file->fd = open(file->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0666);
+        if (file->fd == -1) goto error;
+        lru_push(file);
+        open_files++;
+        return file->fd;
+error:
+        LOG(ERROR, "open() failed for %s. %s.", file->path, strerror(errno));
+        LOG_FUNC_ERROR;
+        return -1;
+}
+
+static void release_file(TraceFile *file) {
+        close_file_fd(file);
+        if (file->prev)
+                file->prev->next = file->next;
+        else
+                files = file->next;
+        if (file->next) file->next->prev = file->prev;
+        free(file->path);
+        free(file);
+}
+
+// Write chunks to fd, skipping the first skip bytes (already written).
+static void write_chunks(int fd, Chunk *c, size_t skip) {
+        struct iovec iov[TW_MAX_IOV];
+        while (c) {
+                int n = 0;
+                for (; c && n < TW_MAX_IOV; c = c->next) {
+                        if (skip >= c->len) {
+                                skip -= c->len;
+                                continue;
+                        }
+                        iov[n].iov_base = c->data + skip;
+                        iov[n].iov_len = c->len - skip;
+                        skip = 0;
+                        n++;
+                }
+
+                int i = 0;
+                while (i < n) {
+                        ssize_t rc = ORIG(writev)(fd, iov + i, n - i);
+                        if (rc == -1 && errno == EINTR) continue;
+                        if (rc == -1) goto error;
+                        // Partial write: skip what was written.
+                        for (; i < n && (size_t)rc >= iov[i].iov_len; i++)
+                                rc -= iov[i].iov_len;
+                        if (i < n) {
+                                iov[i].iov_base = (char *)iov[i].iov_base + rc;
+                                iov[i].iov_len -= rc;
+                        }
+                }
+        }
+        return;
+error:
+        LOG(ERROR, "writev() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+}
+
+#ifdef TW_IO_URING
+/* Minimal io_uring backend, through raw syscalls. Each batch is submitted at
+ * once as IORING_OP_WRITEV requests, which lets the kernel write many trace
+ * files with a single system call. */
+
+typedef struct {
+        int fd;
+        _Atomic unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        _Atomic unsigned *cq_head;
+        _Atomic unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ptr;
+        size_t sq_size;
+        void *cq_ptr;
+        size_t cq_size;
+        size_t sqes_size;
+} Uring;
+
+static Uring ring;
+static enum { URING_UNKNOWN, URING_READY, URING_UNAVAILABLE } ring_state;
+static struct iovec ring_iovs[TW_BATCH_SIZE][TW_MAX_IOV];
+
+static void uring_free(void) {
+        if (ring.sqes) munmap(ring.sqes, ring.sqes_size);
+        if (ring.cq_ptr && ring.cq_ptr != ring.sq_ptr)
+                munmap(ring.cq_ptr, ring.cq_size);
+        if (ring.sq_ptr) munmap(ring.sq_ptr, ring.sq_size);
+        if (ring.fd > 0) ORIG(close)(ring.fd);
+        memset(&ring, 0, sizeof(Uring));
+}
+
+static bool uring_init(void) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        memset(&ring, 0, sizeof(Uring));
+        ring.fd = syscall(__NR_io_uring_setup, TW_BATCH_SIZE, &p);
+        if (ring.fd < 0) goto error1;
+        // Offset -1 (current position) is needed for appending.
+        if (!(p.features & IORING_FEAT_RW_CUR_POS)) goto error2;
+
+        ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(*ring.cqes);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring.cq_size > ring.sq_size) ring.sq_size = ring.cq_size;
+                ring.cq_size = ring.sq_size;
+        }
+        ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.fd,
+                           IORING_OFF_SQ_RING);
+        if (ring.sq_ptr == MAP_FAILED) goto error3;
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring.cq_ptr = ring.sq_ptr;
+        } else {
+                ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, ring.fd,
+                                   IORING_OFF_CQ_RING);
+                if (ring.cq_ptr == MAP_FAILED) goto error3;
+        }
+        ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+        if (ring.sqes == MAP_FAILED) goto error3;
+
+        char *sq = (char *)ring.sq_ptr;
+        char *cq = (char *)ring.cq_ptr;
+        ring.sq_tail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+        ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+        ring.cq_head = (_Atomic unsigned *)(cq + p.cq_off.head);
+        ring.cq_tail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+        ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        LOG(INFO, "Trace writer uses io_uring.");
+        return true;
+error3:
+        if (ring.sq_ptr == MAP_FAILED) ring.sq_ptr = NULL;
+        if (ring.cq_ptr == MAP_FAILED) ring.cq_ptr = NULL;
+        if (ring.sqes == MAP_FAILED) ring.sqes = NULL;
+        LOG(ERROR, "mmap() failed. %s.", strerror(errno));
+        uring_free();
+        goto error_out;
+error2:
+        uring_free();
+        goto error_out;
+error1:
+        LOG(INFO, "io_uring_setup() failed. %s.", strerror(errno));
+error_out:
+        LOG(INFO, "Trace writer uses writev().");
+        return false;
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete) {
+        int rc;
+        do {
+                rc = syscall(__NR_io_uring_enter, ring.fd, to_submit,
+                             min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (rc == -1 && errno == EINTR);
+        return rc;
+}
+
+// Reap the available completions, then wait for one if none was. Returns
+// the completions reaped, -1 if waiting failed.
+static int uring_reap(TraceFile **batch, int *fds, bool *in_flight) {
+        unsigned head = atomic_load_explicit(ring.cq_head,
+                                             memory_order_relaxed);
+        unsigned cq_tail = atomic_load_explicit(ring.cq_tail,
+                                                memory_order_acquire);
+        if (head == cq_tail) return uring_enter(0, 1) == -1 ? -1 : 0;
+        int done = 0;
+        for (; head != cq_tail; head++, done++) {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+                int i = cqe->user_data;
+                in_flight[i] = false;
+                if (cqe->res < 0) {
+                        LOG(ERROR, "io_uring writev() failed. %s.",
+                            strerror(-cqe->res));
+                        continue;
+                }
+                // Short write, or more chunks than TW_MAX_IOV.
+                write_chunks(fds[i], batch[i]->flushing, cqe->res);
+        }
+        atomic_store_explicit(ring.cq_head, head, memory_order_release);
+        return done;
+}
+
+/* The kernel may take fewer requests than submitted, e.g. with EAGAIN or
+ * EBUSY while completions are pending: the rest stays in the SQ ring and is
+ * submitted again once some completions are reaped. Requests which cannot be
+ * submitted are written with writev(). */
+static void uring_write_batch(TraceFile **batch, int *fds, int count) {
+        bool in_flight[TW_BATCH_SIZE];
+        unsigned tail = atomic_load_explicit(ring.sq_tail,
+                                             memory_order_relaxed);
+        for (int i = 0; i < count; i++) {
+                int n = 0;
+                for (Chunk *c = batch[i]->flushing; c && n < TW_MAX_IOV;
+                     c = c->next, n++) {
+                        ring_iovs[i][n].iov_base = c->data;
+                        ring_iovs[i][n].iov_len = c->len;
+                }
+                unsigned idx = tail & *ring.sq_mask;
+                struct io_uring_sqe *sqe = &ring.sqes[idx];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = IORING_OP_WRITEV;
+                sqe->fd = fds[i];
+                sqe->addr = (unsigned long)ring_iovs[i];
+                sqe->len = n;
+                sqe->off = (__u64)-1;
+                sqe->user_data = i;
+                ring.sq_array[idx] = idx;
+                in_flight[i] = false;
+                tail++;
+        }
+        atomic_store_explicit(ring.sq_tail, tail, memory_order_release);
+
+        // Requests are taken in order: the first submitted ones are in flight.
+        int submitted = 0, done = 0;
+        while (submitted < count) {
+                int rc = uring_enter(count - submitted, 0);
+                if (rc > 0) {
+                        for (int i = submitted; i < submitted + rc; i++)
+                                in_flight[i] = true;
+                        submitted += rc;
+                        continue;
+                }
+                if (rc == -1 && errno != EAGAIN && errno != EBUSY)
+                        goto error1;
+                // No request taken: make room by reaping completions.
+                if (submitted == done) goto error1;  // Nothing to wait for.
+                if ((rc = uring_reap(batch, fds, in_flight)) == -1)
+                        goto error2;
+                done += rc;
+        }
+        while (done < count) {
+                int rc = uring_reap(batch, fds, in_flight);
+                if (rc == -1) goto error2;
+                done += rc;
+        }
+        return;
+error1:
+        LOG(ERROR, "io_uring_enter() failed. %s.", strerror(errno));
+        LOG_FUNC_ERROR;
+        // Wait for the requests in flight before tearing the ring down.
+        while (done < submitted) {
+                int rc = uring_reap(batch, fds, in_flight);
+                if (rc == -1) goto error2;
+                done += rc;
+        }
+        uring_free();
+        ring_state = URING_UNAVAILABLE;
+        for (int i = submitted; i < count; i++)
+                write_chunks(fds[i], batch[i]->flushing, 0);
+        return;
+error2:
+        // The kernel may still read the requests in flight: their chunks,
+        // ring_iovs and the ring are left as they are, for good.
+        LOG(ERROR, "io_uring_enter() failed. %s.", strerror(errno));
+        LOG(ERROR, "Trace data may be lost.");
+        LOG_FUNC_ERROR;
+        for (int i = 0; i < count; i++) {
+                if (in_flight[i])
+                        batch[i]->flushing = NULL;
+                else if (i >= submitted)
+                        write_chunks(fds[i], batch[i]->flushing, 0);
+        }
+        ring_state = URING_UNAVAILABLE;
+}
+#endif
+
+static void write_batch(TraceFile **batch, int count) {
+        int fds[TW_BATCH_SIZE];
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+                if (!batch[i]->flushing) continue;
+                int fd = get_file_fd(batch[i]);
+                if (fd == -1) continue;
+                batch[n] = batch[i];
+                fds[n++] = fd;
+        }
+        if (!n) return;
+
+#ifdef TW_IO_URING
+        if (ring_state == URING_UNKNOWN)
+                ring_state = uring_init() ? URING_READY : URING_UNAVAILABLE;
+        if (ring_state == URING_READY) {
+                uring_write_batch(batch, fds, n);
+                return;
+        }
+#endif
+        for (int i = 0; i < n; i++) write_chunks(fds[i], batch[i]->flushing, 0);
+}
+
+static void flush_dirty(void) {
+        mutex_lock(&flush_mutex);
+
+        // Detach pending data, so that appends may go on during the I/O.
+        mutex_lock(&state_mutex);
+        TraceFile *to_flush = dirty;
+        dirty = NULL;
+        pending_bytes = 0;
+        unsigned long dropped = dropped_events;
+        for (TraceFile *f = to_flush; f; f = f->next_dirty) {
+                f->flushing = f->head;
+                f->head = f->tail = NULL;
+                f->release = f->closed;
+                f->dirty = false;
+                f->next_batch = f->next_dirty;
+        }
+        mutex_unlock(&state_mutex);
+
+        TraceFile *batch[TW_BATCH_SIZE];
+        int count = 0;
+        for (TraceFile *f = to_flush; f; f = f->next_batch) {
+                batch[count++] = f;
+                if (count == TW_BATCH_SIZE || !f->next_batch) {
+                        write_batch(batch, count);
+                        count = 0;
+                }
+        }
+
+        mutex_lock(&state_mutex);
+        TraceFile *next;
+        for (TraceFile *f = to_flush; f; f = next) {
+                next = f->next_batch;
+                recycle_chunks(f->flushing);
+                f->flushing = NULL;
+                if (f->release) release_file(f);
+        }
+        mutex_unlock(&state_mutex);
+
+        if (dropped != reported_drops) {
+                LOG(WARN, "%lu events dropped, the disk did not keep up.",
+                    dropped - reported_drops);
+                reported_drops = dropped;
+        }
+        mutex_unlock(&flush_mutex);
+}
+
+static void *writer_thread(void *arg) {
+        UNUSED(arg);
+        LOG_FUNC_INFO;
+        long interval_ms = (conf_opt_t > 0) ? conf_opt_t : 1000;
+
+        while (true) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += interval_ms / 1000;
+                deadline.tv_nsec += (interval_ms % 1000) * 1000 * 1000;
+                if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000 * 1000 * 1000;
+                }
+
+                mutex_lock(&state_mutex);
+                while (pending_bytes < TW_FLUSH_THRESHOLD &&
+                       pthread_cond_timedwait(&state_cond, &state_mutex,
+                                              &deadline) != ETIMEDOUT)
+                        ;
+                mutex_unlock(&state_mutex);
+
+                flush_dirty();
+        }
+        // Unreachable
+        return NULL;
+}
+
+/* Public functions */
+
+TraceFile *tw_open(const char *path) {
+        TraceFile *file = (TraceFile *)my_calloc(sizeof(TraceFile));
+        file->path = (char *)my_malloc(strlen(path) + 1);
+        strcpy(file->path, path);
+        file->fd = -1;
+
+        mutex_lock(&state_mutex);
+        file->next = files;
+        if (files) files->prev = file;
+        files = file;
+        if (!writer_started) {
+                pthread_t thread;
+                writer_started = !my_pthread_create(&thread, NULL,
+                                                    writer_thread, NULL);
+        }
+        mutex_unlock(&state_mutex);
+        return file;
+}
+
+void tw_append(TraceFile *file, const void *data, size_t len) {
+        const char *bytes = (const char *)data;
+        mutex_lock(&state_mutex);
+        mark_dirty(file);
+        while (len) {
+                if (!file->tail || file->tail->len == file->tail->size) {
+                        Chunk *c = alloc_chunk(file->tail);
+                        if (file->tail)
+                                file->tail->next = c;
+                        else
+                                file->head = c;
+                        file->tail = c;
+                }
+                Chunk *c = file->tail;
+                size_t n = c->size - c->len;
+                if (n > len) n = len;
+                memcpy(c->data + c->len, bytes, n);
+                c->len += n;
+                bytes += n;
+                len -= n;
+                pending_bytes += n;
+        }
+        if (pending_bytes >= TW_FLUSH_THRESHOLD)
+                pthread_cond_signal(&state_cond);
+        mutex_unlock(&state_mutex);
+}
+
+void tw_close(TraceFile *file) {
+        mutex_lock(&state_mutex);
+        file->closed = true;
+        mark_dirty(file);
+        mutex_unlock(&state_mutex);
+}
+
+bool tw_is_full(void) {
+        mutex_lock(&state_mutex);
+        bool full = (pending_bytes >= TW_MAX_PENDING);
+        mutex_unlock(&state_mutex);
+        return full;
+}
+
+void tw_drop(void) {
+        mutex_lock(&state_mutex);
+        dropped_events++;
+        mutex_unlock(&state_mutex);
+}
+
+void tw_flush(void) { flush_dirty(); }
+
+void tw_reset(void) {
+        mutex_init(&state_mutex);
+        mutex_init(&flush_mutex);
+        pthread_cond_init(&state_cond, NULL);
+        TraceFile *next;
+        for (TraceFile *f = files; f; f = next) {
+                next = f->next;
+                if (f->fd != -1) ORIG(close)(f->fd);
+                free_chunks_list(f->head);
+                free_chunks_list(f->flushing);
+                free(f->path);
+                free(f);
+        }
+        files = dirty = lru_head = lru_tail = NULL;
+        open_files = 0;
+        pending_bytes = 0;
+        dropped_events = reported_drops = 0;
+        writer_started = false;
+#ifdef TW_IO_URING
+        // The rings are shared with the parent.
+        if (ring_state == URING_READY) uring_free();
+        ring_state = URING_UNKNOWN;
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_WRITER_H
+#define TRACE_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TW_CHUNK_SIZE (1 << 16)       // Max bytes per buffer chunk.
+#define TW_FLUSH_THRESHOLD (1 << 20)  // Pending bytes waking up the writer.
+#define TW_MAX_OPEN_FILES 64          // Trace files kept open (LRU).
+#define TW_BATCH_SIZE 64              // Files written per I/O submission.
+#define TW_MAX_PENDING (1 << 26)      // Pending bytes before dropping events.
+
+/* Asynchronous trace output. Data appended to a trace file is buffered in
+ * memory and written to disk by a single writer thread, in batches: with
+ * io_uring when the kernel supports it, with writev() otherwise. Except for
+ * tw_flush(), the functions below never block on disk I/O. */
+
+typedef struct TraceFile TraceFile;
+
+// The file is created on the first write.
+TraceFile *tw_open(const char *path);
+void tw_append(TraceFile *file, const void *data, size_t len);
+// Release the file once its pending data is written. It must not be used
+// afterwards.
+void tw_close(TraceFile *file);
+
+// Whether TW_MAX_PENDING bytes are waiting for the disk. Events should then be
+// dropped, and counted with tw_drop(), rather than appended.
+bool tw_is_full(void);
+void tw_drop(void);  // The drops are logged by the writer.
+
+void tw_flush(void);  // Write all pending data, from the calling thread.
+void tw_reset(void);  // Drop the state inherited from the parent, after fork().
+
+#endif
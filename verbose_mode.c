@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include "constants.h"
 #include "init.h"
+#include "latency.h"
 #include "lib.h"
 #include "logger.h"
 
@@ -186,6 +187,27 @@ static void output_ev_pselect(const SockEvPselect *ev) {
         OUTPUT_EV("pselect()=%d", ev->super.return_value);
 }
 
+static void output_ev_coalesced(const SockEvCoalesced *ev) {
+        OUTPUT_EV("%lu x %s()", ev->count,
+                  string_from_sock_event_type(ev->ev_type));
+}
+
+static void output_ev_skipped(const SockEvSkipped *ev) {
+        OUTPUT_EV("skipped %lu events", ev->events);
+}
+
+static void output_ev_summary(const SockEvSummary *ev) {
+        OUTPUT_EV("summary sent=%lu received=%lu", ev->bytes_sent,
+                  ev->bytes_received);
+}
+
+static void output_ev_latency(const SockEvLatency *ev) {
+        unsigned long calls = 0;
+        for (int i = 0; i < LAT_CALLS; i++)
+                if (ev->histograms[i]) calls += ev->histograms[i]->count;
+        OUTPUT_EV("latency of %lu calls", calls);
+}
+
 static void output_ev_tcpinfo(const SockEvTcpInfo *ev) {
         OUTPUT_EV("tcp_info=%d", ev->super.return_value);
 }
@@ -345,6 +367,18 @@ void output_event(const SockEvent *ev) {
                 case SOCK_EV_FDOPEN:
                         output_ev_fdopen((const SockEvFdopen *)ev);
                         break;
+                case SOCK_EV_COALESCED:
+                        output_ev_coalesced((const SockEvCoalesced *)ev);
+                        break;
+                case SOCK_EV_SKIPPED:
+                        output_ev_skipped((const SockEvSkipped *)ev);
+                        break;
+                case SOCK_EV_SUMMARY:
+                        output_ev_summary((const SockEvSummary *)ev);
+                        break;
+                case SOCK_EV_LATENCY:
+                        output_ev_latency((const SockEvLatency *)ev);
+                        break;
                 case SOCK_EV_TCP_INFO:
                         output_ev_tcpinfo((const SockEvTcpInfo *)ev);
                         break;